@@ -23,7 +23,11 @@
 #ifndef LUX_MEMORY_H
 #define LUX_MEMORY_H
 
+#include <cstddef>
 #include <malloc.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 //#include <boost/cstdint.hpp>
 //using boost::int8_t;
@@ -56,6 +60,29 @@ template<class T> inline void FreeAligned(T *ptr)
 #endif // NOBOOK
 }
 
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+// Allocate a large array aligned to the huge pages and ask the kernel to
+// back it with them (transparent huge pages, only on Linux). The arrays
+// smaller than a huge page use the normal allocation. It is released
+// with FreeAligned().
+template<class T> inline T *AllocHugePages(size_t size)
+{
+	const size_t bytes = size * sizeof(T);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (bytes >= HUGE_PAGE_SIZE) {
+		const size_t pagesBytes = (bytes + HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(HUGE_PAGE_SIZE - 1);
+		T *ptr = static_cast<T *>(memalign(HUGE_PAGE_SIZE, pagesBytes));
+		if (ptr)
+			madvise(ptr, pagesBytes, MADV_HUGEPAGE);
+		return ptr;
+	}
+#endif
+	return AllocAligned<T>(size);
+}
+
 template <typename T, std::size_t N = 16> class AlignedAllocator
 {
 public:
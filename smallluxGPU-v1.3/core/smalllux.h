@@ -155,7 +155,8 @@ inline string ReadSources(const string &name, const string &fileName) {
 	return prog;
 }
 
-inline cl::Kernel *SetUpKernel(const string &name, const string &funcName, const cl::Context &context, const cl::Device &device, const string &kernelFileName) {
+inline cl::Kernel *SetUpKernel(const string &name, const string &funcName, const cl::Context &context, const cl::Device &device, const string &kernelFileName,
+		const string &options = "") {
 	string src = ReadSources(name, kernelFileName);
 
 	// Compile sources
@@ -165,9 +166,9 @@ inline cl::Kernel *SetUpKernel(const string &name, const string &funcName, const
 		VECTOR_CLASS<cl::Device> buildDevice;
 		buildDevice.push_back(device);
 #if defined(__APPLE__)
-		program.build(buildDevice, "-I. -D__APPLE__");
+		program.build(buildDevice, ("-I. -D__APPLE__ " + options).c_str());
 #else
-		program.build(buildDevice, "-I.");
+		program.build(buildDevice, ("-I. " + options).c_str());
 #endif
 	} catch (cl::Error err) {
 		cl::string strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
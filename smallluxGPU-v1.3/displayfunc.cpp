@@ -175,6 +175,9 @@ void keyFunc(unsigned char key, int x, int y) {
 	switch (key) {
 		case 'p': {
 			config->scene->camera->film->SavePPM("image.ppm");
+#if defined(QBVH_TRAVERSAL_STATS)
+			config->scene->camera->film->SaveCostPPM("image_cost.ppm");
+#endif
 			break;
 		}
 		case 27: // Escape key
@@ -345,6 +348,9 @@ static void motionFunc(int x, int y) {
 }
 
 void timerFunc(int value) {
+	// Use the final QBVH of a progressive scene as soon as it is ready
+	config->scene->SwapAccelerator();
+
 	unsigned int pass = 0;
 	const vector<RenderThread *> &renderThreads = config->GetRenderThreads();
 	for (size_t i = 0; i < renderThreads.size(); ++i)
@@ -77,17 +77,34 @@ class Film {
 public:
 	Film(const bool lowLatencyMode, const unsigned int w, unsigned int h) {
 		lowLatency = lowLatencyMode;
+#if defined(QBVH_TRAVERSAL_STATS)
+		pixelsCost = NULL;
+		pixelsCostWeight = NULL;
+#endif
 
 		Init(w, h);
 	}
 
-	virtual ~Film() { }
+	virtual ~Film() {
+#if defined(QBVH_TRAVERSAL_STATS)
+		delete[] pixelsCost;
+		delete[] pixelsCostWeight;
+#endif
+	}
 
 	virtual void Init(const unsigned int w, unsigned int h) {
 		width = w;
 		height = h;
 		cerr << "Film size " << width << "x" << height << endl;
 
+#if defined(QBVH_TRAVERSAL_STATS)
+		delete[] pixelsCost;
+		delete[] pixelsCostWeight;
+		pixelsCost = new float[width * height];
+		pixelsCostWeight = new float[width * height];
+		ResetCost();
+#endif
+
 		statsTotalSampleCount = 0;
 		statsAvgSampleSec = 0.0;
 		statsStartSampleTime = WallClockTime();
@@ -101,6 +118,9 @@ public:
 		statsTotalSampleCount = 0;
 		statsAvgSampleSec = 0.0;
 		statsStartSampleTime = WallClockTime();
+#if defined(QBVH_TRAVERSAL_STATS)
+		ResetCost();
+#endif
 	}
 
 	virtual void UpdateScreenBuffer() = 0;
@@ -110,6 +130,18 @@ public:
 	virtual void SplatSampleBuffer(const SampleBuffer *sampleBuffer) {
 		// Update statistics
 		statsTotalSampleCount += (unsigned int)sampleBuffer->GetSampleCount();
+
+#if defined(QBVH_TRAVERSAL_STATS)
+		const SampleBufferElem *sbe = sampleBuffer->GetSampleBuffer();
+		for (size_t i = 0; i < sampleBuffer->GetSampleCount(); ++i) {
+			const int x = Clamp<int>(Floor2Int(sbe[i].screenX + .5f), 0, width - 1);
+			const int y = Clamp<int>(Floor2Int(sbe[i].screenY + .5f), 0, height - 1);
+			const unsigned int offset = x + y * width;
+
+			pixelsCost[offset] += sbe[i].traversalCost;
+			pixelsCostWeight[offset] += 1.f;
+		}
+#endif
 	}
 
 	unsigned int GetWidth() { return width; }
@@ -150,7 +182,60 @@ public:
 		file.close();
 	}
 
+#if defined(QBVH_TRAVERSAL_STATS)
+	// Save the average traversal cost of the samples of each pixel in
+	// false colours, from blue (no cost) to red (the highest cost)
+	void SaveCostPPM(const string &fileName) {
+		float maxCost = 0.f;
+		for (unsigned int i = 0; i < width * height; ++i) {
+			if (pixelsCostWeight[i] > 0.f)
+				maxCost = max(maxCost, pixelsCost[i] / pixelsCostWeight[i]);
+		}
+		const float invMaxCost = (maxCost > 0.f) ? (1.f / maxCost) : 0.f;
+		cerr << "Maximum traversal cost by sample: " << maxCost << endl;
+
+		ofstream file;
+		file.exceptions(ifstream::eofbit | ifstream::failbit | ifstream::badbit);
+		file.open(fileName.c_str(), ios::out);
+
+		file << "P3\n" << width << " " << height << "\n255\n";
+
+		for (unsigned int y = 0; y < height; ++y) {
+			for (unsigned int x = 0; x < width; ++x) {
+				const int offset = x + (height - y - 1) * width;
+				const float cost = (pixelsCostWeight[offset] > 0.f) ?
+					(pixelsCost[offset] / pixelsCostWeight[offset] * invMaxCost) : 0.f;
+
+				// Blue, cyan, green, yellow and red at each quarter
+				const float c = 4.f * cost;
+				const float r = Clamp(c - 2.f, 0.f, 1.f);
+				const float g = (c < 2.f) ? Clamp(c, 0.f, 1.f) : Clamp(4.f - c, 0.f, 1.f);
+				const float b = Clamp(2.f - c, 0.f, 1.f);
+
+				file << (int)(r * 255.f + .5f) << " " << (int)(g * 255.f + .5f) << " " <<
+						(int)(b * 255.f + .5f) << " ";
+			}
+		}
+
+		file.close();
+	}
+#endif
+
 protected:
+#if defined(QBVH_TRAVERSAL_STATS)
+	void ResetCost() {
+		for (unsigned int i = 0; i < width * height; ++i) {
+			pixelsCost[i] = 0.f;
+			pixelsCostWeight[i] = 0.f;
+		}
+	}
+
+	// The sum of the traversal costs and the number of the samples
+	// of each pixel
+	float *pixelsCost;
+	float *pixelsCostWeight;
+#endif
+
 	unsigned int width, height;
 	unsigned int pixelCount;
 
@@ -45,12 +45,263 @@ double IntersectionDevice::GetPerformance() const {
 	return (statsTotalRayTime == 0.0) ?	1.0 : (statsTotalRayCount / statsTotalRayTime);
 }
 
+#if defined(QBVH_TRAVERSAL_STATS)
+QBVHTraversalStats IntersectionDevice::GetTraversalStats() const {
+	boost::mutex::scoped_lock lock(statsTraversalMutex);
+	return statsTraversal;
+}
+
+void IntersectionDevice::AddTraversalStats(QBVHTraversalStats &stats) {
+	boost::mutex::scoped_lock lock(statsTraversalMutex);
+	statsTraversal.Add(stats);
+	stats.Reset();
+}
+#endif
+
+//------------------------------------------------------------------------------
+// NativeRayTracer
+//------------------------------------------------------------------------------
+
+void NativeRayTracer::TraceRays(RayBuffer *rayBuffer, const size_t first, const size_t last) {
+	const Ray *rb = rayBuffer->GetRayBuffer();
+	const unsigned char *tb = rayBuffer->GetRayTypeBuffer();
+	RayHit *hb = rayBuffer->GetHitBuffer();
+
+#if defined(QBVH_TRAVERSAL_STATS)
+	// The counters are only available in the single ray traversals
+	unsigned int *costs = rayBuffer->GetRayCostBuffer();
+	for (size_t i = first; i < last; ++i) {
+		const boost::uint64_t cost = statsTraversal.Cost();
+		if (tb[i] == RAY_OCCLUSION)
+			scene->IntersectP(rb[i], &hb[i], &statsTraversal);
+		else
+			scene->Intersect(rb[i], &hb[i], &statsTraversal);
+		costs[i] = static_cast<unsigned int>(statsTraversal.Cost() - cost);
+	}
+#else
+	// Rays with the same origin (eye rays, shadow rays from the same
+	// point) are traced in packets, the other ones in streams
+	traced.assign(last - first, false);
+	streamIndices[RAY_INTERSECT].clear();
+	streamIndices[RAY_OCCLUSION].clear();
+	Ray packetRays[PACKET_MAX_RAYS];
+	RayHit packetHits[PACKET_MAX_RAYS];
+	unsigned int packetIndices[PACKET_MAX_RAYS];
+	for (unsigned int i = first; i < last; ++i) {
+		if (traced[i - first])
+			continue;
+
+		unsigned int packetSize = 1;
+		packetIndices[0] = i;
+		const size_t searchEnd = min(last, (size_t)(i + PACKET_SEARCH_WINDOW));
+		for (size_t j = i + 1; (j < searchEnd) && (packetSize < PACKET_MAX_RAYS); ++j) {
+			if (!traced[j - first] && (tb[j] == tb[i]) && QBVHAccel::CoherentRays(rb[i], rb[j]))
+				packetIndices[packetSize++] = j;
+		}
+
+		if (packetSize >= PACKET_MIN_RAYS) {
+			for (unsigned int k = 0; k < packetSize; ++k)
+				packetRays[k] = rb[packetIndices[k]];
+
+			if (tb[i] == RAY_OCCLUSION)
+				scene->IntersectPPacket(packetRays, packetHits, packetSize);
+			else
+				scene->IntersectPacket(packetRays, packetHits, packetSize);
+
+			for (unsigned int k = 0; k < packetSize; ++k) {
+				hb[packetIndices[k]] = packetHits[k];
+				traced[packetIndices[k] - first] = true;
+			}
+		} else
+			streamIndices[tb[i]].push_back(i);
+	}
+
+	for (int type = RAY_INTERSECT; type <= RAY_OCCLUSION; ++type) {
+		const vector<unsigned int> &indices = streamIndices[type];
+		if (indices.empty())
+			continue;
+
+		streamRays.resize(indices.size());
+		streamHits.resize(indices.size());
+		for (size_t k = 0; k < indices.size(); ++k)
+			streamRays[k] = rb[indices[k]];
+
+		if (type == RAY_OCCLUSION)
+			scene->IntersectPStream(&streamRays[0], &streamHits[0], indices.size());
+		else
+			scene->IntersectStream(&streamRays[0], &streamHits[0], indices.size());
+
+		for (size_t k = 0; k < indices.size(); ++k)
+			hb[indices[k]] = streamHits[k];
+	}
+#endif
+}
+
+//------------------------------------------------------------------------------
+// NativeThreadPool
+//------------------------------------------------------------------------------
+
+NativeThreadPool::NativeThreadPool(const Scene *scene, const size_t threadCount) {
+	queuedChunks = 0;
+	nextWorker = 0;
+
+	cerr << "[NativeThreadPool] Starting " << threadCount << " threads" << endl;
+	for (size_t i = 0; i < threadCount; ++i)
+		workers.push_back(new Worker(scene));
+	for (size_t i = 0; i < threadCount; ++i)
+		workers[i]->thread = new boost::thread(boost::bind(NativeThreadPool::WorkerThread, this, i));
+}
+
+NativeThreadPool::~NativeThreadPool() {
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i]->thread->interrupt();
+
+	// The threads steal from all the queues, they are all joined before
+	// freeing any queue
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i]->thread->join();
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		delete workers[i]->thread;
+		delete workers[i];
+	}
+}
+
+void NativeThreadPool::TraceRays(NativeRayTracer *tracer, RayBuffer *rayBuffer) {
+	const size_t rayCount = rayBuffer->GetRayCount();
+	if (rayCount == 0)
+		return;
+
+	Job job(rayBuffer);
+	job.pendingChunks = (rayCount + NATIVE_POOL_CHUNK_SIZE - 1) / NATIVE_POOL_CHUNK_SIZE;
+
+	// Spread the chunks on the queues, the next buffer starts where this
+	// one ends
+	{
+		boost::mutex::scoped_lock lock(idleMutex);
+
+		for (size_t first = 0; first < rayCount; first += NATIVE_POOL_CHUNK_SIZE) {
+			Chunk chunk;
+			chunk.job = &job;
+			chunk.first = first;
+			chunk.last = min(rayCount, first + NATIVE_POOL_CHUNK_SIZE);
+
+			Worker *worker = workers[nextWorker];
+			nextWorker = (nextWorker + 1) % workers.size();
+
+			boost::mutex::scoped_lock workerLock(worker->chunksMutex);
+			worker->chunks.push_back(chunk);
+		}
+		queuedChunks += job.pendingChunks;
+	}
+	idleCondition.notify_all();
+
+	// The queued chunks reference the job, it can't be interrupted before
+	// they are all done
+	boost::this_thread::disable_interruption noInterruption;
+
+	// Trace the chunks while there are some left, then wait for the
+	// ones being traced by the pool
+	Chunk chunk;
+	for (;;) {
+		{
+			boost::mutex::scoped_lock lock(job.jobMutex);
+			if (job.pendingChunks == 0)
+				break;
+		}
+
+		if (PopChunk(workers.size(), &chunk))
+			TraceChunk(tracer, chunk);
+		else {
+			boost::mutex::scoped_lock lock(job.jobMutex);
+			while (job.pendingChunks > 0)
+				job.jobDone.wait(lock);
+			break;
+		}
+	}
+
+#if defined(QBVH_TRAVERSAL_STATS)
+	tracer->statsTraversal.Add(job.statsTraversal);
+#endif
+}
+
+bool NativeThreadPool::PopChunk(const size_t index, Chunk *chunk) {
+	bool found = false;
+
+	// The last chunk of the own queue, the most recently queued
+	if (index < workers.size()) {
+		Worker *worker = workers[index];
+		boost::mutex::scoped_lock lock(worker->chunksMutex);
+
+		if (!worker->chunks.empty()) {
+			*chunk = worker->chunks.back();
+			worker->chunks.pop_back();
+			found = true;
+		}
+	}
+
+	// Steal the first chunk of the other queues, the oldest one
+	for (size_t i = 1; (i <= workers.size()) && !found; ++i) {
+		Worker *worker = workers[(index + i) % workers.size()];
+		boost::mutex::scoped_lock lock(worker->chunksMutex);
+
+		if (!worker->chunks.empty()) {
+			*chunk = worker->chunks.front();
+			worker->chunks.pop_front();
+			found = true;
+		}
+	}
+
+	if (found) {
+		boost::mutex::scoped_lock lock(idleMutex);
+		--queuedChunks;
+	}
+
+	return found;
+}
+
+void NativeThreadPool::TraceChunk(NativeRayTracer *tracer, const Chunk &chunk) {
+	Job *job = chunk.job;
+	tracer->TraceRays(job->rayBuffer, chunk.first, chunk.last);
+
+	// The job can be destroyed as soon as the lock is released
+	boost::mutex::scoped_lock lock(job->jobMutex);
+#if defined(QBVH_TRAVERSAL_STATS)
+	job->statsTraversal.Add(tracer->statsTraversal);
+	tracer->statsTraversal.Reset();
+#endif
+	if (--job->pendingChunks == 0)
+		job->jobDone.notify_all();
+}
+
+void NativeThreadPool::WorkerThread(NativeThreadPool *pool, const size_t index) {
+	try {
+		NativeRayTracer *tracer = &pool->workers[index]->tracer;
+
+		Chunk chunk;
+		for (;;) {
+			if (pool->PopChunk(index, &chunk)) {
+				pool->TraceChunk(tracer, chunk);
+				continue;
+			}
+
+			// Wait for new chunks
+			boost::mutex::scoped_lock lock(pool->idleMutex);
+			while (pool->queuedChunks == 0)
+				pool->idleCondition.wait(lock);
+		}
+	} catch (boost::thread_interrupted) {
+		// Time to exit
+	}
+}
+
 //------------------------------------------------------------------------------
 // NativeIntersectionDevice
 //------------------------------------------------------------------------------
 
 NativeIntersectionDevice::NativeIntersectionDevice(Scene *scn, const bool lowLatency,
-		const unsigned int index) : IntersectionDevice(scn, index) {
+		const unsigned int index, NativeThreadPool *pool) : IntersectionDevice(scn, index),
+		tracer(scn), threadPool(pool) {
 	char buff[64];
 	sprintf(buff, "Thread-%03d", deviceIndex);
 	deviceName = string(buff);
@@ -79,13 +330,19 @@ void NativeIntersectionDevice::PushRayBuffer(RayBuffer *rayBuffer) {
 }
 
 void NativeIntersectionDevice::TraceRays(RayBuffer *rayBuffer) {
-	const Ray *rb = rayBuffer->GetRayBuffer();
-	RayHit *hb = rayBuffer->GetHitBuffer();
-	const size_t rayCount = rayBuffer->GetRayCount();
-	for (unsigned int i = 0; i < rayCount; ++i)
-		scene->Intersect(rb[i], &hb[i]);
+	// The accelerators can't be swapped while they are in use
+	boost::shared_lock<boost::shared_mutex> lock(scene->accelMutex);
+
+	if (threadPool)
+		threadPool->TraceRays(&tracer, rayBuffer);
+	else
+		tracer.TraceRays(rayBuffer, 0, rayBuffer->GetRayCount());
+
+#if defined(QBVH_TRAVERSAL_STATS)
+	AddTraversalStats(tracer.statsTraversal);
+#endif
 
-	statsTotalRayCount += rayCount;
+	statsTotalRayCount += rayBuffer->GetRayCount();
 }
 
 RayBuffer *NativeIntersectionDevice::PopRayBuffer() {
@@ -95,14 +352,127 @@ RayBuffer *NativeIntersectionDevice::PopRayBuffer() {
 	return result;
 }
 
+//------------------------------------------------------------------------------
+// AsyncNativeIntersectionDevice
+//------------------------------------------------------------------------------
+
+AsyncNativeIntersectionDevice::AsyncNativeIntersectionDevice(Scene *scn, const bool lowLatency,
+		const unsigned int index, const size_t threadCount) : IntersectionDevice(scn, index) {
+	char buff[64];
+	sprintf(buff, "AsyncThreads-%03d", deviceIndex);
+	deviceName = string(buff);
+
+	for (size_t i = 0; i < threadCount; ++i)
+		tracers.push_back(new NativeRayTracer(scn));
+
+	statsDeviceIdleTime = 0.0;
+	statsDeviceTotalTime = 0.0;
+}
+
+AsyncNativeIntersectionDevice::~AsyncNativeIntersectionDevice() {
+	if (started)
+		Stop();
+
+	for (size_t i = 0; i < tracers.size(); ++i)
+		delete tracers[i];
+}
+
+void AsyncNativeIntersectionDevice::Start() {
+	started = true;
+
+	statsDeviceIdleTime = 0.0;
+	statsDeviceTotalTime = 0.0;
+
+	// Create the threads for the ray intersections
+	for (size_t i = 0; i < tracers.size(); ++i)
+		rayIntersectionThreads.push_back(new boost::thread(boost::bind(
+				AsyncNativeIntersectionDevice::RayIntersectionThread, this, i)));
+}
+
+void AsyncNativeIntersectionDevice::Interrupt() {
+	for (size_t i = 0; i < rayIntersectionThreads.size(); ++i)
+		rayIntersectionThreads[i]->interrupt();
+}
+
+void AsyncNativeIntersectionDevice::Stop() {
+	started = false;
+
+	for (size_t i = 0; i < rayIntersectionThreads.size(); ++i)
+		rayIntersectionThreads[i]->interrupt();
+	for (size_t i = 0; i < rayIntersectionThreads.size(); ++i) {
+		rayIntersectionThreads[i]->join();
+		delete rayIntersectionThreads[i];
+	}
+	rayIntersectionThreads.clear();
+
+	cerr << "[Device::" << deviceName << "] Queue max. depth: " << todoRayBufferQueue.GetMaxSize() <<
+			", waiting for buffers: " << todoRayBufferQueue.GetPopWaitTime() <<
+			" secs, waiting for room: " << todoRayBufferQueue.GetPushWaitTime() << " secs" << endl;
+	todoRayBufferQueue.Clear();
+	todoRayBufferQueue.ResetStats();
+	doneRayBufferQueue.Clear();
+}
+
+void AsyncNativeIntersectionDevice::PushRayBuffer(RayBuffer *rayBuffer) {
+	todoRayBufferQueue.Push(rayBuffer);
+}
+
+RayBuffer *AsyncNativeIntersectionDevice::PopRayBuffer() {
+	return doneRayBufferQueue.Pop();
+}
+
+void AsyncNativeIntersectionDevice::RayIntersectionThread(AsyncNativeIntersectionDevice *intersectionDevice,
+		const size_t threadIndex) {
+	cerr << "[Device::" << intersectionDevice->GetName() << "::" << threadIndex << "] RayIntersection thread started" << endl;
+
+	try {
+		NativeRayTracer *tracer = intersectionDevice->tracers[threadIndex];
+
+		while (!boost::this_thread::interruption_requested()) {
+			const double t1 = WallClockTime();
+			RayBuffer *rayBuffer = intersectionDevice->todoRayBufferQueue.Pop();
+			const double t2 = WallClockTime();
+
+			{
+				// The accelerators can't be swapped while they are in use
+				boost::shared_lock<boost::shared_mutex> lock(intersectionDevice->scene->accelMutex);
+				for (size_t i = 0; i < rayBuffer->GetPartCount(); ++i) {
+					RayBuffer *part = rayBuffer->GetPart(i);
+					tracer->TraceRays(part, 0, part->GetRayCount());
+				}
+			}
+
+			const double t3 = WallClockTime();
+
+			{
+				boost::mutex::scoped_lock lock(intersectionDevice->statsMutex);
+
+				// The times of all the threads, the load is the average one
+				intersectionDevice->statsDeviceIdleTime += t2 - t1;
+				intersectionDevice->statsDeviceTotalTime += t3 - t1;
+				intersectionDevice->statsTotalRayCount += rayBuffer->GetRayCount();
+#if defined(QBVH_TRAVERSAL_STATS)
+				intersectionDevice->AddTraversalStats(tracer->statsTraversal);
+#endif
+			}
+
+			intersectionDevice->doneRayBufferQueue.Push(rayBuffer);
+		}
+
+		cerr << "[Device::" << intersectionDevice->GetName() << "::" << threadIndex << "] RayIntersection thread halted" << endl;
+	} catch (boost::thread_interrupted) {
+		cerr << "[Device::" << intersectionDevice->GetName() << "::" << threadIndex << "] RayIntersection thread halted" << endl;
+	}
+}
+
 //------------------------------------------------------------------------------
 // OpenCLIntersectionDevice
 //------------------------------------------------------------------------------
 
 OpenCLIntersectionDevice::OpenCLIntersectionDevice(Scene *scn, const bool lowLatency,
-	unsigned int index, const cl::Device &device,
+	unsigned int index, const cl::Device &dev,
 	const unsigned int forceGPUWorkSize) :
-	IntersectionDevice(scn, index) {
+	IntersectionDevice(scn, index), device(dev), forceGPUWorkSize(forceGPUWorkSize) {
 	deviceName = device.getInfo<CL_DEVICE_NAME > ().c_str();
 
 	// Allocate a context with the selected device
@@ -120,34 +490,52 @@ OpenCLIntersectionDevice::OpenCLIntersectionDevice(Scene *scn, const bool lowLat
 	//--------------------------------------------------------------------------
 	// Allocate buffers
 
-	const size_t rayBufferSize = lowLatency ? (RAY_BUFFER_SIZE / 8) : RAY_BUFFER_SIZE;
-
-	cerr << "[Device::" << deviceName << "] rays buffer size: " << (sizeof(Ray) * rayBufferSize / 1024) << "Kb" <<endl;
-	raysBuff = new cl::Buffer(*context,
-			CL_MEM_READ_ONLY,
-			sizeof(Ray) * rayBufferSize);
-	cerr << "[Device::" << deviceName << "] ray hits buffer size: " << (sizeof(RayHit) * rayBufferSize / 1024) << "Kb" <<endl;
-	hitsBuff = new cl::Buffer(*context,
-			CL_MEM_WRITE_ONLY,
-			sizeof(RayHit) * rayBufferSize);
-
-	cerr << "[Device::" << deviceName << "] QBVH buffer size: " << (sizeof(QBVHNode) * scene->qbvh->nNodes / 1024) << "Kb" <<endl;
-	qbvhBuff = new cl::Buffer(*context,
-			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			sizeof(QBVHNode) * scene->qbvh->nNodes,
-			scene->qbvh->nodes);
-
-	cerr << "[Device::" << deviceName << "] QuadTriangle buffer size: " << (sizeof(QuadTriangle) * scene->qbvh->nQuads / 1024) << "Kb" <<endl;
-	qbvhTrisBuff = new cl::Buffer(*context,
-			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			sizeof(QuadTriangle) * scene->qbvh->nQuads,
-			scene->qbvh->prims);
+	// The low latency RayBuffers can be coalesced up to RAY_BUFFER_SIZE rays
+	// by VirtualM2OIntersectionDevice
+	const size_t rayBufferSize = RAY_BUFFER_SIZE;
 
-	//--------------------------------------------------------------------------
-	// QBVH kernel
-	//--------------------------------------------------------------------------
+	raysBuff = AllocBuffer("rays", CL_MEM_READ_ONLY,
+			sizeof(Ray) * rayBufferSize, NULL);
+	rayTypesBuff = AllocBuffer("ray types", CL_MEM_READ_ONLY,
+			sizeof(unsigned char) * rayBufferSize, NULL);
+	hitsBuff = AllocBuffer("ray hits", CL_MEM_WRITE_ONLY,
+			sizeof(RayHit) * rayBufferSize, NULL);
+
+	AllocQBVHBuffers();
+	accelVersion = scene->accelVersion;
+
+	// The instances of a two level tree never change, Refit() only
+	// updates the bounding boxes
+	if (scene->qbvh->instances)
+		qbvhInstancesBuff = AllocBuffer("QBVH instances", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(QBVHInstance) * static_cast<size_t>(scene->qbvh->nInstances),
+				scene->qbvh->instances);
+	else
+		qbvhInstancesBuff = NULL;
+
+	bvhKernel = NULL;
+	SetUpQBVHKernel();
+
+	rayIntersectionThread = NULL;
+}
+
+void OpenCLIntersectionDevice::SetUpQBVHKernel() {
+	delete bvhKernel;
 
-	bvhKernel = SetUpKernel(deviceName, "Intersect", *context, device, "qbvh_kernel.cl");
+	string kernelOptions;
+	if (scene->qbvh->compressedNodes)
+		kernelOptions += " -D PARAM_COMPRESSED_NODES";
+	if (scene->qbvh->instances)
+		kernelOptions += " -D PARAM_INSTANCES";
+	if (qbvhLeavesBuff)
+		kernelOptions += " -D PARAM_LEAVES_TABLE";
+	if (meshTrisBuff)
+		kernelOptions += " -D PARAM_INDEXED_LEAVES";
+#if defined(QBVH_WOOP_TRIANGLES)
+	kernelOptions += " -D PARAM_WOOP_TRIANGLES";
+#endif
+	bvhKernel = SetUpKernel(deviceName, "Intersect", *context, device, "qbvh_kernel.cl",
+			kernelOptions);
 	bvhKernel->getWorkGroupInfo<size_t>(device, CL_KERNEL_WORK_GROUP_SIZE, &qbvhWorkGroupSize);
 	cerr << "[Device::" << deviceName << "] QBVH kernel work group size: " << qbvhWorkGroupSize << endl;
 	cl_ulong memSize;
@@ -165,11 +553,20 @@ OpenCLIntersectionDevice::OpenCLIntersectionDevice(Scene *scn, const bool lowLat
 
 	// Set Arguments
 	bvhKernel->setArg(0, *raysBuff);
-	bvhKernel->setArg(1, *hitsBuff);
-	bvhKernel->setArg(2, *qbvhBuff);
-	bvhKernel->setArg(3, *qbvhTrisBuff);
-
-	rayIntersectionThread = NULL;
+	bvhKernel->setArg(1, *rayTypesBuff);
+	bvhKernel->setArg(2, *hitsBuff);
+	bvhKernel->setArg(3, *qbvhBuff);
+	bvhKernel->setArg(4, *qbvhTrisBuff);
+	// The optional buffers follow the ray count
+	unsigned int argIndex = 6;
+	if (qbvhInstancesBuff)
+		bvhKernel->setArg(argIndex++, *qbvhInstancesBuff);
+	if (qbvhLeavesBuff)
+		bvhKernel->setArg(argIndex++, *qbvhLeavesBuff);
+	if (meshTrisBuff) {
+		bvhKernel->setArg(argIndex++, *meshTrisBuff);
+		bvhKernel->setArg(argIndex++, *meshVertsBuff);
+	}
 }
 
 OpenCLIntersectionDevice::~OpenCLIntersectionDevice() {
@@ -179,14 +576,138 @@ OpenCLIntersectionDevice::~OpenCLIntersectionDevice() {
 	delete bvhKernel;
 
 	delete raysBuff;
+	delete rayTypesBuff;
 	delete hitsBuff;
 	delete qbvhBuff;
 	delete qbvhTrisBuff;
+	delete qbvhInstancesBuff;
+	delete qbvhLeavesBuff;
+	delete meshTrisBuff;
+	delete meshVertsBuff;
 
 	delete queue;
 	delete context;
 }
 
+cl::Buffer *OpenCLIntersectionDevice::AllocBuffer(const string &name,
+		const cl_mem_flags flags, const size_t size, void *hostPtr) {
+	cerr << "[Device::" << deviceName << "] " << name << " buffer size: " << (size / 1024) << "Kb" << endl;
+
+	// The huge meshes can be larger than the largest buffer of the device
+	const cl_ulong maxSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	if (size > maxSize) {
+		stringstream ss;
+		ss << "The " << name << " buffer of " << (size / 1024) << "Kb is larger than the " <<
+				(maxSize / 1024) << "Kb allowed by the device " << deviceName;
+		throw runtime_error(ss.str());
+	}
+
+	return new cl::Buffer(*context, flags, size, hostPtr);
+}
+
+void OpenCLIntersectionDevice::AllocQBVHBuffers() {
+	const QBVHAccel *qbvh = scene->qbvh;
+	qbvhNodeCount = qbvh->nNodes;
+	qbvhQuadCount = qbvh->nQuads;
+
+	if (qbvh->compressedNodes)
+		qbvhBuff = AllocBuffer("compressed QBVH", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(QBVHCompressedNode) * static_cast<size_t>(qbvh->nNodes),
+				qbvh->compressedNodes);
+	else
+		qbvhBuff = AllocBuffer("QBVH", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(QBVHNode) * static_cast<size_t>(qbvh->nNodes), qbvh->nodes);
+
+	if (qbvh->indexedPrims) {
+		// The kernel builds the quads from the mesh
+		qbvhTrisBuff = AllocBuffer("IndexedQuad", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(IndexedQuad) * static_cast<size_t>(qbvh->nQuads), qbvh->indexedPrims);
+
+		const TriangleMesh *mesh = scene->mesh;
+		meshTrisBuff = AllocBuffer("mesh triangles", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(Triangle) * static_cast<size_t>(mesh->triangleCount), mesh->triangles);
+		meshVertsBuff = AllocBuffer("mesh vertices", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(Point) * static_cast<size_t>(mesh->vertexCount), mesh->vertices);
+	} else {
+		qbvhTrisBuff = AllocBuffer("QuadTriangle", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(QuadTriangle) * static_cast<size_t>(qbvh->nQuads), qbvh->prims);
+		meshTrisBuff = NULL;
+		meshVertsBuff = NULL;
+	}
+
+	if (qbvh->leaves)
+		qbvhLeavesBuff = AllocBuffer("QBVH leaves", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(QBVHLeaf) * static_cast<size_t>(qbvh->nLeaves), qbvh->leaves);
+	else
+		qbvhLeavesBuff = NULL;
+}
+
+void OpenCLIntersectionDevice::ReloadQBVH() {
+	const bool leavesTable = (qbvhLeavesBuff != NULL);
+	const bool indexedLeaves = (meshTrisBuff != NULL);
+	delete qbvhBuff;
+	delete qbvhTrisBuff;
+	delete qbvhLeavesBuff;
+	delete meshTrisBuff;
+	delete meshVertsBuff;
+	AllocQBVHBuffers();
+	accelVersion = scene->accelVersion;
+
+	// The leaves encoding is a kernel option
+	if ((leavesTable != (qbvhLeavesBuff != NULL)) || (indexedLeaves != (meshTrisBuff != NULL)))
+		SetUpQBVHKernel();
+	else {
+		bvhKernel->setArg(3, *qbvhBuff);
+		bvhKernel->setArg(4, *qbvhTrisBuff);
+		unsigned int argIndex = qbvhInstancesBuff ? 7 : 6;
+		if (qbvhLeavesBuff)
+			bvhKernel->setArg(argIndex++, *qbvhLeavesBuff);
+		if (meshTrisBuff) {
+			bvhKernel->setArg(argIndex++, *meshTrisBuff);
+			bvhKernel->setArg(argIndex++, *meshVertsBuff);
+		}
+	}
+}
+
+void OpenCLIntersectionDevice::UpdateQBVH() {
+	const QBVHAccel *qbvh = scene->qbvh;
+	const size_t nodeSize = qbvh->compressedNodes ? sizeof(QBVHCompressedNode) : sizeof(QBVHNode);
+	const char *nodesData = qbvh->compressedNodes ?
+		reinterpret_cast<const char *>(qbvh->compressedNodes) :
+		reinterpret_cast<const char *>(qbvh->nodes);
+
+	if ((accelVersion != scene->accelVersion) ||
+			(qbvhNodeCount != qbvh->nNodes) || (qbvhQuadCount != qbvh->nQuads)) {
+		// The tree has been built again or replaced
+		ReloadQBVH();
+		return;
+	}
+
+	if (qbvh->refitFirstNode < qbvh->refitLastNode) {
+		cerr << "[Device::" << deviceName << "] QBVH nodes update: " << (nodeSize * (qbvh->refitLastNode - qbvh->refitFirstNode) / 1024) << "Kb" << endl;
+		queue->enqueueWriteBuffer(*qbvhBuff, CL_TRUE,
+				nodeSize * qbvh->refitFirstNode,
+				nodeSize * (qbvh->refitLastNode - qbvh->refitFirstNode),
+				nodesData + nodeSize * qbvh->refitFirstNode);
+	}
+
+	if (qbvh->refitFirstQuad < qbvh->refitLastQuad) {
+		cerr << "[Device::" << deviceName << "] QuadTriangle update: " << (sizeof(QuadTriangle) * (qbvh->refitLastQuad - qbvh->refitFirstQuad) / 1024) << "Kb" << endl;
+		queue->enqueueWriteBuffer(*qbvhTrisBuff, CL_TRUE,
+				sizeof(QuadTriangle) * qbvh->refitFirstQuad,
+				sizeof(QuadTriangle) * (qbvh->refitLastQuad - qbvh->refitFirstQuad),
+				qbvh->prims + qbvh->refitFirstQuad);
+	}
+
+	// The indexed leaves use the current vertices
+	if (meshVertsBuff) {
+		const TriangleMesh *mesh = scene->mesh;
+		cerr << "[Device::" << deviceName << "] Mesh vertices update: " << (sizeof(Point) * mesh->vertexCount / 1024) << "Kb" << endl;
+		queue->enqueueWriteBuffer(*meshVertsBuff, CL_TRUE, 0,
+				sizeof(Point) * static_cast<size_t>(mesh->vertexCount), mesh->vertices);
+	}
+}
+
 void OpenCLIntersectionDevice::Start() {
 	started = true;
 
@@ -212,7 +733,11 @@ void OpenCLIntersectionDevice::Stop() {
 		rayIntersectionThread = NULL;
 	}
 
+	cerr << "[Device::" << deviceName << "] Queue max. depth: " << todoRayBufferQueue.GetMaxSize() <<
+			", waiting for buffers: " << todoRayBufferQueue.GetPopWaitTime() <<
+			" secs, waiting for room: " << todoRayBufferQueue.GetPushWaitTime() << " secs" << endl;
 	todoRayBufferQueue.Clear();
+	todoRayBufferQueue.ResetStats();
 	doneRayBufferQueue.Clear();
 }
 
@@ -233,33 +758,70 @@ void OpenCLIntersectionDevice::RayIntersectionThread(OpenCLIntersectionDevice *i
 			RayBuffer *rayBuffer = intersectionDevice->todoRayBufferQueue.Pop();
 			const double t2 = WallClockTime();
 
+			// Upload the new QBVH of a progressive scene, the previous
+			// RayBuffer has been completely traced
+			{
+				boost::shared_lock<boost::shared_mutex> lock(intersectionDevice->scene->accelMutex);
+				if (intersectionDevice->accelVersion != intersectionDevice->scene->accelVersion) {
+					cerr << "[Device::" << intersectionDevice->GetName() << "] QBVH replaced" << endl;
+					intersectionDevice->ReloadQBVH();
+				}
+			}
+
 			// Trace rays
 
-			// Download the rays to the GPU
-			cl::Event writeBufferEvent;
-			intersectionDevice->queue->enqueueWriteBuffer(
-					*(intersectionDevice->raysBuff),
-					CL_FALSE,
-					0,
-					sizeof(Ray) * rayBuffer->GetRayCount(),
-					rayBuffer->GetRayBuffer(), NULL, &writeBufferEvent);
+			// Download the rays to the GPU, the parts of a coalesced
+			// RayBuffer one after the other
+			VECTOR_CLASS<cl::Event> kernelWaitEvents;
+			for (size_t i = 0, offset = 0; i < rayBuffer->GetPartCount(); ++i) {
+				RayBuffer *part = rayBuffer->GetPart(i);
+
+				cl::Event writeBufferEvent;
+				intersectionDevice->queue->enqueueWriteBuffer(
+						*(intersectionDevice->raysBuff),
+						CL_FALSE,
+						sizeof(Ray) * offset,
+						sizeof(Ray) * part->GetRayCount(),
+						part->GetRayBuffer(), NULL, &writeBufferEvent);
+				cl::Event writeTypesBufferEvent;
+				intersectionDevice->queue->enqueueWriteBuffer(
+						*(intersectionDevice->rayTypesBuff),
+						CL_FALSE,
+						sizeof(unsigned char) * offset,
+						sizeof(unsigned char) * part->GetRayCount(),
+						part->GetRayTypeBuffer(), NULL, &writeTypesBufferEvent);
+
+				kernelWaitEvents.push_back(writeBufferEvent);
+				kernelWaitEvents.push_back(writeTypesBufferEvent);
+				offset += part->GetRayCount();
+			}
 
-			intersectionDevice->bvhKernel->setArg(4, (unsigned int)rayBuffer->GetRayCount());
+			// The global size must be a multiple of the work group size (the
+			// O2M slices can have any size), the kernel skips the work items
+			// after the last ray
+			const size_t workGroupSize = intersectionDevice->qbvhWorkGroupSize;
+			const size_t globalSize = ((rayBuffer->GetSize() + workGroupSize - 1) / workGroupSize) * workGroupSize;
+			intersectionDevice->bvhKernel->setArg(5, (unsigned int)rayBuffer->GetRayCount());
 			cl::Event kernelEvent;
-			VECTOR_CLASS<cl::Event> kernelWaitEvents(1, writeBufferEvent);
 			intersectionDevice->queue->enqueueNDRangeKernel(*(intersectionDevice->bvhKernel), cl::NullRange,
-					cl::NDRange(rayBuffer->GetSize()), cl::NDRange(intersectionDevice->qbvhWorkGroupSize),
+					cl::NDRange(globalSize), cl::NDRange(workGroupSize),
 					&kernelWaitEvents, &kernelEvent);
 
-			// Upload the results
+			// Upload the results, the queue is in order: the last read
+			// waits for all of them
 			VECTOR_CLASS<cl::Event> readBufferWaitEvents(1, kernelEvent);
-			intersectionDevice->queue->enqueueReadBuffer(
-					*(intersectionDevice->hitsBuff),
-					CL_TRUE,
-					0,
-					sizeof(RayHit) * rayBuffer->GetRayCount(),
-					rayBuffer->GetHitBuffer(),
-					&readBufferWaitEvents);
+			for (size_t i = 0, offset = 0; i < rayBuffer->GetPartCount(); ++i) {
+				RayBuffer *part = rayBuffer->GetPart(i);
+
+				intersectionDevice->queue->enqueueReadBuffer(
+						*(intersectionDevice->hitsBuff),
+						(i == rayBuffer->GetPartCount() - 1) ? CL_TRUE : CL_FALSE,
+						sizeof(RayHit) * offset,
+						sizeof(RayHit) * part->GetRayCount(),
+						part->GetHitBuffer(),
+						&readBufferWaitEvents);
+				offset += part->GetRayCount();
+			}
 
 			const double t3 = WallClockTime();
 
@@ -283,7 +845,7 @@ void OpenCLIntersectionDevice::RayIntersectionThread(OpenCLIntersectionDevice *i
 //------------------------------------------------------------------------------
 
 VirtualM2OIntersectionDevice::VirtualM2OIntersectionDevice(const size_t count,
-		IntersectionDevice *device, Scene *scn) {
+		IntersectionDevice *device, Scene *scn, const bool coalesce) {
 	virtualDeviceCount = count;
 	realDevice = device;
 	scene = scn;
@@ -294,10 +856,26 @@ VirtualM2OIntersectionDevice::VirtualM2OIntersectionDevice(const size_t count,
 
 	// Start the RayBuffer routing thread
 	routerThread = new boost::thread(boost::bind(VirtualM2OIntersectionDevice::RayBufferRouter, this));
+
+	// Start the RayBuffer coalescing thread
+	if (coalesce) {
+		todoRayBufferQueue = new RayBufferQueue();
+		coalescerThread = new boost::thread(boost::bind(VirtualM2OIntersectionDevice::RayBufferCoalescer, this));
+	} else {
+		todoRayBufferQueue = NULL;
+		coalescerThread = NULL;
+	}
 }
 
 VirtualM2OIntersectionDevice::~VirtualM2OIntersectionDevice() {
-	// Stop the router thread
+	// Stop the router threads
+	if (coalescerThread) {
+		coalescerThread->interrupt();
+		coalescerThread->join();
+		delete coalescerThread;
+		delete todoRayBufferQueue;
+	}
+
 	routerThread->interrupt();
 	routerThread->join();
 
@@ -315,8 +893,16 @@ void VirtualM2OIntersectionDevice::RayBufferRouter(VirtualM2OIntersectionDevice
 		while (!boost::this_thread::interruption_requested()) {
 			RayBuffer *rayBuffer = virtualDevice->realDevice->PopRayBuffer();
 
-			size_t instanceIndex = rayBuffer->GetUserData();
-			virtualDevice->virtualDeviceInstances[instanceIndex]->PushRayBufferDone(rayBuffer);
+			// Split the coalesced RayBuffers
+			for (size_t i = 0; i < rayBuffer->GetPartCount(); ++i) {
+				RayBuffer *part = rayBuffer->GetPart(i);
+
+				size_t instanceIndex = part->GetUserData();
+				virtualDevice->virtualDeviceInstances[instanceIndex]->PushRayBufferDone(part);
+			}
+
+			if (rayBuffer->IsCoalesced())
+				delete rayBuffer;
 		}
 	} catch (boost::thread_interrupted) {
 		// Time to exit
@@ -325,6 +911,34 @@ void VirtualM2OIntersectionDevice::RayBufferRouter(VirtualM2OIntersectionDevice
 	}
 }
 
+void VirtualM2OIntersectionDevice::RayBufferCoalescer(VirtualM2OIntersectionDevice *virtualDevice) {
+	try {
+		vector<RayBuffer *> parts;
+
+		while (!boost::this_thread::interruption_requested()) {
+			RayBuffer *rayBuffer = virtualDevice->todoRayBufferQueue->Pop();
+
+			// Add the other pending RayBuffers, without waiting for new ones
+			parts.clear();
+			parts.push_back(rayBuffer);
+			size_t size = rayBuffer->GetSize();
+			while (RayBuffer *part = virtualDevice->todoRayBufferQueue->TryPop(RAY_BUFFER_SIZE - size)) {
+				parts.push_back(part);
+				size += part->GetSize();
+			}
+
+			if (parts.size() > 1)
+				virtualDevice->realDevice->PushRayBuffer(new RayBuffer(parts));
+			else
+				virtualDevice->realDevice->PushRayBuffer(rayBuffer);
+		}
+	} catch (boost::thread_interrupted) {
+		// Time to exit
+	} catch (cl::Error err) {
+		cerr << "[VirtualM2ODevice::" << virtualDevice->realDevice->GetName() << "] RayBufferCoalescer thread ERROR: " << err.what() << "(" << err.err() << ")" << endl;
+	}
+}
+
 //------------------------------------------------------------------------------
 // VirtualM2OIntersectionDevice class
 //------------------------------------------------------------------------------
@@ -388,7 +1002,10 @@ void VirtualM2OIntersectionDevice::VirtualM2ODevInstance::Stop() {
 void VirtualM2OIntersectionDevice::VirtualM2ODevInstance::PushRayBuffer(RayBuffer *rayBuffer) {
 	rayBuffer->PushUserData(instanceIndex);
 
-	virtualDevice->realDevice->PushRayBuffer(rayBuffer);
+	if (virtualDevice->todoRayBufferQueue)
+		virtualDevice->todoRayBufferQueue->Push(rayBuffer);
+	else
+		virtualDevice->realDevice->PushRayBuffer(rayBuffer);
 	++pendingRayBuffers;
 }
 
@@ -409,12 +1026,14 @@ void VirtualM2OIntersectionDevice::VirtualM2ODevInstance::PushRayBufferDone(RayB
 //------------------------------------------------------------------------------
 
 VirtualO2MIntersectionDevice::VirtualO2MIntersectionDevice(vector<IntersectionDevice *> devices,
-		Scene *scn, const size_t index) : IntersectionDevice(scn, index) {
+		Scene *scn, const size_t index, const size_t slice) : IntersectionDevice(scn, index) {
 	char buf[64];
 	sprintf(buf, "VirtualO2MDevice-%03d", (int)deviceIndex);
 	deviceName = std::string(buf);
 
 	realDevices = devices;
+	sliceSize = slice;
+	estimates.resize(realDevices.size());
 	pusherThread = NULL;
 }
 
@@ -426,6 +1045,9 @@ VirtualO2MIntersectionDevice::~VirtualO2MIntersectionDevice() {
 void VirtualO2MIntersectionDevice::Start() {
 	started = true;
 
+	for (size_t i = 0; i < estimates.size(); ++i)
+		estimates[i].Reset();
+
 	// Start all real devices
 	for (size_t i = 0; i < realDevices.size(); ++i)
 		realDevices[i]->Start();
@@ -470,8 +1092,25 @@ void VirtualO2MIntersectionDevice::Stop() {
 	if (started) {
 		for (size_t i = 0; i < realDevices.size(); ++i)
 			realDevices[i]->Stop();
+
+		cerr << "[" << deviceName << "] Queue max. depth: " << todoRayBufferQueue.GetMaxSize() <<
+				", waiting for room: " << todoRayBufferQueue.GetPushWaitTime() << " secs" << endl;
+		for (size_t i = 0; i < realDevices.size(); ++i)
+			cerr << "[" << deviceName << "::" << realDevices[i]->GetName() << "] Estimated speed: " <<
+					int(estimates[i].raysPerSec / 1000.0) << "K rays/sec, latency: " <<
+					estimates[i].latency * 1000.0 << " msecs" << endl;
 	}
 
+	todoRayBufferQueue.Clear();
+	todoRayBufferQueue.ResetStats();
+	doneRayBufferQueue.Clear();
+
+	// The slices lost in the queues of the real devices
+	for (map<RayBuffer *, RayBuffer *>::iterator i = slices.begin(); i != slices.end(); ++i)
+		delete i->first;
+	slices.clear();
+	pendingSlices.clear();
+
 	started = false;
 }
 
@@ -483,25 +1122,124 @@ RayBuffer *VirtualO2MIntersectionDevice::PopRayBuffer() {
 	return doneRayBufferQueue.Pop();
 }
 
+double VirtualO2MIntersectionDevice::EstimatedTime(const size_t deviceIndex, const size_t rayCount) const {
+	double raysPerSec = estimates[deviceIndex].raysPerSec;
+
+	if (raysPerSec <= 0.0) {
+		// Use the average speed of the other devices
+		size_t count = 0;
+		for (size_t i = 0; i < estimates.size(); ++i) {
+			if (estimates[i].raysPerSec > 0.0) {
+				raysPerSec += estimates[i].raysPerSec;
+				++count;
+			}
+		}
+
+		raysPerSec = (count == 0) ? 1.0 : (raysPerSec / count);
+	}
+
+	return rayCount / raysPerSec;
+}
+
+size_t VirtualO2MIntersectionDevice::SelectDevice(const size_t rayCount) const {
+	size_t index = 0;
+	double minTime = EstimatedTime(0, estimates[0].pendingRays + rayCount);
+	for (size_t i = 1; i < estimates.size(); ++i) {
+		const double t = EstimatedTime(i, estimates[i].pendingRays + rayCount);
+		if (t < minTime) {
+			index = i;
+			minTime = t;
+		}
+	}
+
+	return index;
+}
+
+void VirtualO2MIntersectionDevice::SliceRayBuffer(RayBuffer *rayBuffer,
+		vector<RayBuffer *> &slicesToPush, vector<size_t> &slicesDevice) {
+	const size_t rayCount = rayBuffer->GetRayCount();
+
+	// Give each slice to the device which would trace it first
+	vector<size_t> deviceSliceCount(realDevices.size(), 0);
+	vector<size_t> pendingRays(realDevices.size());
+	for (size_t i = 0; i < realDevices.size(); ++i)
+		pendingRays[i] = estimates[i].pendingRays;
+
+	for (size_t first = 0; first < rayCount; first += sliceSize) {
+		size_t index = 0;
+		double minTime = EstimatedTime(0, pendingRays[0] + sliceSize);
+		for (size_t i = 1; i < realDevices.size(); ++i) {
+			const double t = EstimatedTime(i, pendingRays[i] + sliceSize);
+			if (t < minTime) {
+				index = i;
+				minTime = t;
+			}
+		}
+
+		++deviceSliceCount[index];
+		pendingRays[index] += sliceSize;
+	}
+
+	// Merge the slices of each device
+	size_t first = 0;
+	for (size_t i = 0; i < realDevices.size(); ++i) {
+		if (deviceSliceCount[i] == 0)
+			continue;
+
+		const size_t size = min(deviceSliceCount[i] * sliceSize, rayBuffer->GetSize());
+		const size_t count = min(deviceSliceCount[i] * sliceSize, rayCount - first);
+
+		slicesToPush.push_back(new RayBuffer(rayBuffer, first, count, size));
+		slicesDevice.push_back(i);
+		first += count;
+	}
+
+	if (slicesToPush.size() == 1) {
+		// All the slices are for the same device
+		delete slicesToPush[0];
+		slicesToPush[0] = rayBuffer;
+	} else {
+		pendingSlices[rayBuffer] = slicesToPush.size();
+		for (size_t i = 0; i < slicesToPush.size(); ++i)
+			slices[slicesToPush[i]] = rayBuffer;
+	}
+}
+
 void VirtualO2MIntersectionDevice::PusherRouter(VirtualO2MIntersectionDevice *virtualDevice) {
 	try {
+		vector<RayBuffer *> slicesToPush;
+		vector<size_t> slicesDevice;
+
 		while (!boost::this_thread::interruption_requested()) {
 			RayBuffer *rayBuffer = virtualDevice->todoRayBufferQueue.Pop();
 
-			// Look for the device with less work to do
-			size_t index = 0;
-// Windows crap ...
-#undef max
-			size_t minQueueSize = numeric_limits<size_t>::max();
-			for (size_t i = 0; i < virtualDevice->realDevices.size(); ++i) {
-				const size_t queueSize = virtualDevice->realDevices[i]->GetQueueSize();
-				if (queueSize < minQueueSize) {
-					index = i;
-					minQueueSize = queueSize;
+			slicesToPush.clear();
+			slicesDevice.clear();
+			{
+				boost::mutex::scoped_lock lock(virtualDevice->routerMutex);
+
+				// The coalesced RayBuffers are made of small ones, they
+				// aren't sliced
+				if ((virtualDevice->sliceSize > 0) && (virtualDevice->realDevices.size() > 1) &&
+						!rayBuffer->IsCoalesced() &&
+						(rayBuffer->GetRayCount() >= 2 * virtualDevice->sliceSize))
+					virtualDevice->SliceRayBuffer(rayBuffer, slicesToPush, slicesDevice);
+				else {
+					// Look for the device which would trace the rays first
+					slicesToPush.push_back(rayBuffer);
+					slicesDevice.push_back(virtualDevice->SelectDevice(rayBuffer->GetRayCount()));
+				}
+
+				const double t = WallClockTime();
+				for (size_t i = 0; i < slicesToPush.size(); ++i) {
+					DeviceEstimate &estimate = virtualDevice->estimates[slicesDevice[i]];
+					estimate.pendingRays += slicesToPush[i]->GetRayCount();
+					estimate.pushTimes.push_back(t);
 				}
 			}
 
-			virtualDevice->realDevices[index]->PushRayBuffer(rayBuffer);
+			for (size_t i = 0; i < slicesToPush.size(); ++i)
+				virtualDevice->realDevices[slicesDevice[i]]->PushRayBuffer(slicesToPush[i]);
 		}
 	} catch (boost::thread_interrupted) {
 		// Time to exit
@@ -516,8 +1254,50 @@ void VirtualO2MIntersectionDevice::PopperRouter(VirtualO2MIntersectionDevice *vi
 
 		while (!boost::this_thread::interruption_requested()) {
 			RayBuffer *rayBuffer = device->PopRayBuffer();
+			RayBuffer *doneRayBuffer = rayBuffer;
+
+			{
+				boost::mutex::scoped_lock lock(virtualDevice->routerMutex);
+
+				// Update the estimates, the device traces the buffers in
+				// order: this one has been started when the previous one
+				// was done
+				DeviceEstimate &estimate = virtualDevice->estimates[deviceIndex];
+				const double t = WallClockTime();
+				const double pushTime = estimate.pushTimes.empty() ? t : estimate.pushTimes.front();
+				if (!estimate.pushTimes.empty())
+					estimate.pushTimes.pop_front();
+
+				const size_t rayCount = rayBuffer->GetRayCount();
+				estimate.pendingRays -= min(estimate.pendingRays, rayCount);
+
+				const double traceTime = t - max(pushTime, estimate.lastDoneTime);
+				if (traceTime > 0.0) {
+					const double raysPerSec = rayCount / traceTime;
+					estimate.raysPerSec = (estimate.raysPerSec == 0.0) ? raysPerSec :
+						(estimate.raysPerSec + O2M_ESTIMATE_WEIGHT * (raysPerSec - estimate.raysPerSec));
+				}
+				estimate.latency = (estimate.latency == 0.0) ? (t - pushTime) :
+					(estimate.latency + O2M_ESTIMATE_WEIGHT * ((t - pushTime) - estimate.latency));
+				estimate.lastDoneTime = t;
+
+				// Reassemble the sliced RayBuffers
+				map<RayBuffer *, RayBuffer *>::iterator it = virtualDevice->slices.find(rayBuffer);
+				if (it != virtualDevice->slices.end()) {
+					RayBuffer *slicedRayBuffer = it->second;
+					virtualDevice->slices.erase(it);
+					delete rayBuffer;
+
+					if (--(virtualDevice->pendingSlices[slicedRayBuffer]) == 0) {
+						virtualDevice->pendingSlices.erase(slicedRayBuffer);
+						doneRayBuffer = slicedRayBuffer;
+					} else
+						doneRayBuffer = NULL;
+				}
+			}
 
-			virtualDevice->doneRayBufferQueue.Push(rayBuffer);
+			if (doneRayBuffer)
+				virtualDevice->doneRayBufferQueue.Push(doneRayBuffer);
 		}
 	} catch (boost::thread_interrupted) {
 		// Time to exit
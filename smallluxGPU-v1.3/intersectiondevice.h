@@ -22,9 +22,24 @@
 #define	_INTERSECTIONDEVICE_H
 
 #include <queue>
+#include <deque>
+#include <vector>
+#include <map>
 
 #include "smalllux.h"
 #include "raybuffer.h"
+#include "qbvhaccel.h"
+
+// How far NativeIntersectionDevice looks ahead in a RayBuffer for rays
+// coherent with the current one
+#define PACKET_SEARCH_WINDOW 64
+
+// The rays of a chunk traced by a thread of the NativeThreadPool
+#define NATIVE_POOL_CHUNK_SIZE 256
+
+// The weight of a new sample in the moving estimates of the performance of
+// the devices used by VirtualO2MIntersectionDevice
+#define O2M_ESTIMATE_WEIGHT 0.2
 
 class IntersectionDevice {
 public:
@@ -44,8 +59,17 @@ public:
 
 	double GetPerformance() const;
 
+#if defined(QBVH_TRAVERSAL_STATS)
+	// Only the native devices count the traversals, return a copy of the
+	// counters taken while they can be updated by the rendering threads
+	QBVHTraversalStats GetTraversalStats() const;
+#endif
+
 	virtual double GetLoad() const = 0;
 
+	// Called, while the device is stopped, after Scene::Refit()
+	virtual void UpdateQBVH() { }
+
 protected:
 	string deviceName;
 	unsigned int deviceIndex;
@@ -55,13 +79,119 @@ protected:
 	// Execution profiling
 	double statsTotalRayCount;
 	double statsStartTime;
+#if defined(QBVH_TRAVERSAL_STATS)
+	// Add the counters of a tracer to statsTraversal and reset them
+	void AddTraversalStats(QBVHTraversalStats &stats);
+
+	mutable boost::mutex statsTraversalMutex;
+	QBVHTraversalStats statsTraversal;
+#endif
 
 	bool started;
 };
 
+//------------------------------------------------------------------------------
+// Native ray tracing
+//------------------------------------------------------------------------------
+
+// Trace the rays of a RayBuffer on the CPU, with the scratch buffers of a
+// single thread. The rays with the same origin are traced in packets, the
+// other ones in streams.
+class NativeRayTracer {
+public:
+	NativeRayTracer(const Scene *scn) : scene(scn) { }
+
+	// Trace the rays [first, last) of the buffer, the caller holds a
+	// shared lock of Scene::accelMutex
+	void TraceRays(RayBuffer *rayBuffer, const size_t first, const size_t last);
+
+#if defined(QBVH_TRAVERSAL_STATS)
+	// The counters of the rays traced since the last Reset()
+	QBVHTraversalStats statsTraversal;
+#endif
+
+private:
+	const Scene *scene;
+
+	// The rays already traced in packets
+	vector<bool> traced;
+	// The other rays, traced in streams
+	vector<unsigned int> streamIndices[2];
+	vector<Ray> streamRays;
+	vector<RayHit> streamHits;
+};
+
+// A pool of threads tracing the RayBuffers of all the native render threads.
+// Each buffer is split in chunks spread on the queues of the threads. Each
+// thread traces the last chunk of its own queue and, when it is empty,
+// steals the first chunk of the other queues, so the idle threads help
+// with the longest buffers.
+class NativeThreadPool {
+public:
+	NativeThreadPool(const Scene *scene, const size_t threadCount);
+	~NativeThreadPool();
+
+	size_t GetThreadCount() const { return workers.size(); }
+
+	// Trace all the rays of the buffer with the pool, the calling thread
+	// traces chunks with its own tracer too while they aren't all done
+	void TraceRays(NativeRayTracer *tracer, RayBuffer *rayBuffer);
+
+private:
+	// The chunks of a buffer being traced
+	class Job {
+	public:
+		Job(RayBuffer *rb) : rayBuffer(rb), pendingChunks(0) { }
+
+		RayBuffer *rayBuffer;
+
+		boost::mutex jobMutex;
+		boost::condition_variable jobDone;
+		size_t pendingChunks;
+#if defined(QBVH_TRAVERSAL_STATS)
+		QBVHTraversalStats statsTraversal;
+#endif
+	};
+
+	typedef struct {
+		Job *job;
+		size_t first, last;
+	} Chunk;
+
+	class Worker {
+	public:
+		Worker(const Scene *scene) : tracer(scene), thread(NULL) { }
+
+		boost::mutex chunksMutex;
+		deque<Chunk> chunks;
+
+		NativeRayTracer tracer;
+		boost::thread *thread;
+	};
+
+	// The threads of the pool use their index, the other ones
+	// GetThreadCount() to only steal chunks
+	bool PopChunk(const size_t index, Chunk *chunk);
+	void TraceChunk(NativeRayTracer *tracer, const Chunk &chunk);
+
+	static void WorkerThread(NativeThreadPool *pool, const size_t index);
+
+	vector<Worker *> workers;
+
+	// The idle threads wait for queued chunks
+	boost::mutex idleMutex;
+	boost::condition_variable idleCondition;
+	size_t queuedChunks;
+	// The queue of the next chunk
+	size_t nextWorker;
+};
+
 class NativeIntersectionDevice : public IntersectionDevice {
 public:
-	NativeIntersectionDevice(Scene *scene, const bool lowLatency, const unsigned int index);
+	// The rays are traced by the calling thread, or with the shared pool
+	// if threadPool isn't NULL
+	NativeIntersectionDevice(Scene *scene, const bool lowLatency, const unsigned int index,
+			NativeThreadPool *threadPool = NULL);
 	~NativeIntersectionDevice();
 
 	void Start();
@@ -79,8 +209,49 @@ public:
 	// A short-cut
 	void TraceRays(RayBuffer *rayBuffer);
 
+	NativeThreadPool *GetThreadPool() const { return threadPool; }
+
 private:
 	queue<RayBuffer *> doneRayBufferQueue;
+
+	NativeRayTracer tracer;
+	NativeThreadPool *threadPool;
+};
+
+// A CPU device with its own threads and queues like the OpenCL devices, so
+// it can be used by the DeviceRenderThreads and in VirtualO2MIntersectionDevice
+class AsyncNativeIntersectionDevice : public IntersectionDevice {
+public:
+	AsyncNativeIntersectionDevice(Scene *scene, const bool lowLatency, const unsigned int index,
+			const size_t threadCount);
+	~AsyncNativeIntersectionDevice();
+
+	void Start();
+	void Interrupt();
+	void Stop();
+
+	void PushRayBuffer(RayBuffer *rayBuffer);
+	RayBuffer *PopRayBuffer();
+	size_t GetQueueSize() { return todoRayBufferQueue.Size(); }
+
+	double GetLoad() const {
+		return (statsDeviceTotalTime == 0.0) ? 0.0 : (1.0 - statsDeviceIdleTime / statsDeviceTotalTime);
+	}
+
+private:
+	static void RayIntersectionThread(AsyncNativeIntersectionDevice *intersectionDevice,
+			const size_t threadIndex);
+
+	// Each thread traces a whole RayBuffer with its own tracer
+	vector<NativeRayTracer *> tracers;
+	vector<boost::thread *> rayIntersectionThreads;
+	RayBufferQueue todoRayBufferQueue;
+	RayBufferQueue doneRayBufferQueue;
+
+	// The statistics are updated by all the threads
+	boost::mutex statsMutex;
+	double statsDeviceIdleTime;
+	double statsDeviceTotalTime;
 };
 
 class OpenCLIntersectionDevice : public IntersectionDevice {
@@ -101,9 +272,23 @@ public:
 		return (statsDeviceTotalTime == 0.0) ? 0.0 : (1.0 - statsDeviceIdleTime / statsDeviceTotalTime);
 	}
 
+	// Upload the nodes and the quads modified by the refit, all the
+	// tree if it has been built again
+	void UpdateQBVH();
+
 private:
 	static void RayIntersectionThread(OpenCLIntersectionDevice *intersectionDevice);
 
+	// Allocate a buffer after having checked its size against the
+	// largest allocation of the device
+	cl::Buffer *AllocBuffer(const string &name, const cl_mem_flags flags,
+			const size_t size, void *hostPtr);
+	void AllocQBVHBuffers();
+	// Compile the kernel for the format of the uploaded QBVH
+	void SetUpQBVHKernel();
+	// Upload all the QBVH again
+	void ReloadQBVH();
+
 	boost::thread *rayIntersectionThread;
 	RayBufferQueue todoRayBufferQueue;
 	RayBufferQueue doneRayBufferQueue;
@@ -112,14 +297,27 @@ private:
 	cl::Context *context;
 	cl::CommandQueue *queue;
 
+	cl::Device device;
+	unsigned int forceGPUWorkSize;
 	cl::Kernel *bvhKernel;
 	size_t qbvhWorkGroupSize;
 
 	// Buffers
 	cl::Buffer *raysBuff;
+	cl::Buffer *rayTypesBuff;
 	cl::Buffer *hitsBuff;
 	cl::Buffer *qbvhBuff;
 	cl::Buffer *qbvhTrisBuff;
+	cl::Buffer *qbvhInstancesBuff;
+	// The leaves table, NULL if the leaves are encoded in the nodes
+	cl::Buffer *qbvhLeavesBuff;
+	// The mesh triangles and vertices, used by the indexed leaves,
+	// NULL if the QBVH has the full QuadTriangles
+	cl::Buffer *meshTrisBuff;
+	cl::Buffer *meshVertsBuff;
+	unsigned int qbvhNodeCount, qbvhQuadCount;
+	// The Scene::accelVersion of the uploaded QBVH
+	unsigned int accelVersion;
 
 	double statsDeviceIdleTime;
 	double statsDeviceTotalTime;
@@ -131,7 +329,10 @@ private:
 
 class VirtualM2OIntersectionDevice {
 public:
-	VirtualM2OIntersectionDevice(const size_t count, IntersectionDevice *device, Scene *scn);
+	// With coalesce, the RayBuffers pending at the same time are sent to the
+	// real device as a single coalesced RayBuffer of up to RAY_BUFFER_SIZE rays
+	VirtualM2OIntersectionDevice(const size_t count, IntersectionDevice *device, Scene *scn,
+			const bool coalesce = false);
 	~VirtualM2OIntersectionDevice();
 
 	IntersectionDevice *GetVirtualDevice(size_t index);
@@ -163,6 +364,7 @@ private:
 	};
 
 	static void RayBufferRouter(VirtualM2OIntersectionDevice *virtualDevice);
+	static void RayBufferCoalescer(VirtualM2OIntersectionDevice *virtualDevice);
 
 	size_t virtualDeviceCount;
 	IntersectionDevice *realDevice;
@@ -172,6 +374,11 @@ private:
 	VirtualM2ODevInstance **virtualDeviceInstances;
 
 	boost::thread *routerThread;
+
+	// The RayBuffers to coalesce, NULL if they are sent directly to
+	// the real device
+	RayBufferQueue *todoRayBufferQueue;
+	boost::thread *coalescerThread;
 };
 
 //------------------------------------------------------------------------------
@@ -180,8 +387,10 @@ private:
 
 class VirtualO2MIntersectionDevice : public IntersectionDevice {
 public:
+	// The RayBuffers with at least 2 slices of sliceSize rays are split among
+	// the devices, 0 disables the slicing
 	VirtualO2MIntersectionDevice(vector<IntersectionDevice *> devices, Scene *scn,
-			const size_t index);
+			const size_t index, const size_t sliceSize = 0);
 	~VirtualO2MIntersectionDevice();
 
 	void Start();
@@ -195,13 +404,57 @@ public:
 	double GetLoad() const { return 1.0; }
 
 private:
+	// The moving estimates of the performance of a real device
+	class DeviceEstimate {
+	public:
+		DeviceEstimate() { Reset(); }
+
+		void Reset() {
+			raysPerSec = 0.0;
+			latency = 0.0;
+			pendingRays = 0;
+			lastDoneTime = 0.0;
+			pushTimes.clear();
+		}
+
+		// 0.0 until the first RayBuffer is done
+		double raysPerSec;
+		// From the push of a RayBuffer to its pop
+		double latency;
+
+		size_t pendingRays;
+		double lastDoneTime;
+		deque<double> pushTimes;
+	};
+
 	// Funny names ...
 	static void PusherRouter(VirtualO2MIntersectionDevice *virtualDevice);
 	static void PopperRouter(VirtualO2MIntersectionDevice *virtualDevice, size_t deviceIndex);
 
+	// The estimated time to trace rayCount rays with a device, the devices
+	// without estimate yet use the average speed of the other ones. The
+	// caller holds routerMutex.
+	double EstimatedTime(const size_t deviceIndex, const size_t rayCount) const;
+	// The device with the earliest estimated end of the rays
+	size_t SelectDevice(const size_t rayCount) const;
+	// Split the buffer in one slice of contiguous rays for each device
+	// with the earliest estimated end of the slices, return the slices and
+	// their devices. The caller holds routerMutex.
+	void SliceRayBuffer(RayBuffer *rayBuffer, vector<RayBuffer *> &slicesToPush,
+			vector<size_t> &slicesDevice);
+
 	vector<IntersectionDevice *> realDevices;
 	Scene *scene;
 
+	size_t sliceSize;
+
+	boost::mutex routerMutex;
+	vector<DeviceEstimate> estimates;
+	// The sliced RayBuffers and the count of their slices not yet traced
+	map<RayBuffer *, size_t> pendingSlices;
+	// The slices and the RayBuffer they belong to
+	map<RayBuffer *, RayBuffer *> slices;
+
 	RayBufferQueue todoRayBufferQueue;
 	RayBufferQueue doneRayBufferQueue;
 
@@ -157,6 +157,15 @@ TriangleMesh::TriangleMesh(const string &fileName) {
 		throw runtime_error(ss.str());
 	}
 
+	// The vertex and the triangle indices are 32 bit, 0xffffffff is
+	// the index of the rays hitting nothing
+	if ((static_cast<unsigned long long>(plyNbVerts) > 0xffffffffull) ||
+			(static_cast<unsigned long long>(plyNbTris) >= 0xffffffffull)) {
+		stringstream ss;
+		ss << "Too many vertices or triangles in '" << fileName << "'";
+		throw runtime_error(ss.str());
+	}
+
 	Normal *n;
 	long plyNbNormals = ply_set_read_cb(plyfile, "vertex", "nx", NormalCB, &n, 0);
 	ply_set_read_cb(plyfile, "vertex", "ny", NormalCB, &n, 1);
@@ -256,6 +265,10 @@ TriangleMesh::~TriangleMesh() {
 }
 
 TriangleMesh::TriangleMesh(const TriangleMesh &obj0, const TriangleMesh &obj1) {
+	if ((static_cast<unsigned long long>(obj0.vertexCount) + obj1.vertexCount > 0xffffffffull) ||
+			(static_cast<unsigned long long>(obj0.triangleCount) + obj1.triangleCount >= 0xffffffffull))
+		throw runtime_error("Too many vertices or triangles in the merged meshes");
+
 	vertexCount = obj0.vertexCount + obj1.vertexCount;
 	triangleCount = obj0.triangleCount + obj1.triangleCount;
 
@@ -0,0 +1,455 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <immintrin.h>
+#if defined(WIN32) && !defined(__CYGWIN__)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#include "obvhaccel.h"
+
+// Only the functions using AVX2 are compiled for it, MSVC doesn't need
+// any option to use the intrinsics
+#if defined(__GNUC__)
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#else
+#define AVX2_TARGET
+#endif
+
+/***************************************************/
+
+bool OBVHAccel::IsSupported() {
+	unsigned int ecx1, ebx7;
+	unsigned long long xcr0;
+#if defined(WIN32) && !defined(__CYGWIN__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	ecx1 = info[2];
+	__cpuidex(info, 7, 0);
+	ebx7 = info[1];
+	if (!(ecx1 & (1 << 27)))
+		return false;
+	xcr0 = _xgetbv(0);
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid(1, eax, ebx, ecx, edx);
+	ecx1 = ecx;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	ebx7 = ebx;
+	if (!(ecx1 & (1 << 27)))
+		return false;
+	unsigned int xcr0Low, xcr0High;
+	__asm__ __volatile__ ("xgetbv" : "=a" (xcr0Low), "=d" (xcr0High) : "c" (0));
+	xcr0 = (static_cast<unsigned long long>(xcr0High) << 32) | xcr0Low;
+#endif
+
+	// OSXSAVE is checked above, the OS must save the SSE and AVX registers
+	const bool osSupport = ((xcr0 & 0x6) == 0x6);
+	const bool avx = (ecx1 & (1 << 28)) != 0;
+	const bool fma = (ecx1 & (1 << 12)) != 0;
+	const bool avx2 = (ebx7 & (1 << 5)) != 0;
+
+	return osSupport && avx && fma && avx2;
+}
+
+/***************************************************/
+
+OBVHAccel::OBVHAccel(const QBVHAccel &qbvh, const Triangle *tris, const Point *verts) {
+	vertices = verts;
+	triangles = tris;
+
+	const double startTime = WallClockTime();
+
+	std::vector<OBVHNode> buildNodes;
+	std::vector<OctTriangle> buildPrims;
+	buildNodes.reserve(qbvh.nNodes / 2 + 1);
+	buildPrims.reserve(qbvh.nQuads / 2 + 1);
+
+	BuildNode(qbvh, MakeCandidate(qbvh, 0, 0, 4), buildNodes, buildPrims);
+
+	nNodes = buildNodes.size();
+	nodes = AllocAligned<OBVHNode>(nNodes);
+	memcpy(nodes, &buildNodes[0], sizeof(OBVHNode) * nNodes);
+
+	nOcts = buildPrims.size();
+	prims = AllocAligned<OctTriangle>(max(nOcts, 1u));
+	if (nOcts > 0)
+		memcpy(prims, &buildPrims[0], sizeof(OctTriangle) * nOcts);
+
+	cerr << "OBVH completed with " << nNodes << " nodes and " << nOcts <<
+			" groups of 8 triangles in " << (WallClockTime() - startTime) << " secs" << endl;
+}
+
+OBVHAccel::~OBVHAccel() {
+	FreeAligned(prims);
+	FreeAligned(nodes);
+}
+
+OBVHAccel::Candidate OBVHAccel::MakeCandidate(const QBVHAccel &qbvh,
+		int32_t qbvhNode, int firstSlot, int nbSlots) const {
+	const QBVHNode &node = qbvh.nodes[qbvhNode];
+
+	Candidate c;
+	c.qbvhNode = qbvhNode;
+	c.firstSlot = firstSlot;
+	c.nbSlots = nbSlots;
+	for (int i = firstSlot; i < firstSlot + nbSlots; ++i) {
+		if (node.ChildIsLeaf(i) && node.LeafIsEmpty(i))
+			continue;
+
+		BBox bbox;
+		for (int axis = 0; axis < 3; ++axis) {
+			bbox.pMin[axis] = reinterpret_cast<const float *>(&(node.bboxes[0][axis]))[i];
+			bbox.pMax[axis] = reinterpret_cast<const float *>(&(node.bboxes[1][axis]))[i];
+		}
+		c.bbox = Union(c.bbox, bbox);
+	}
+
+	// A single slot with an inner node is the whole inner node
+	if ((nbSlots == 1) && !node.ChildIsLeaf(firstSlot)) {
+		c.qbvhNode = node.children[firstSlot];
+		c.firstSlot = 0;
+		c.nbSlots = 4;
+	}
+
+	std::vector<u_int> leafPrims;
+	c.isLeaf = CollectLeafPrims(qbvh, c, leafPrims) &&
+			((c.nbSlots == 1) || (leafPrims.size() <= 8));
+
+	return c;
+}
+
+bool OBVHAccel::CollectLeafPrims(const QBVHAccel &qbvh, const Candidate &c,
+		std::vector<u_int> &leafPrims) const {
+	const QBVHNode &node = qbvh.nodes[c.qbvhNode];
+	for (int i = c.firstSlot; i < c.firstSlot + c.nbSlots; ++i) {
+		if (!node.ChildIsLeaf(i))
+			return false;
+		if (node.LeafIsEmpty(i))
+			continue;
+
+		// The unused slots of the quads repeat other triangles
+		u_int firstQuad, nbQuads;
+		qbvh.DecodeLeaf(node.children[i], &firstQuad, &nbQuads);
+		for (u_int q = firstQuad; q < firstQuad + nbQuads; ++q) {
+			for (u_int j = 0; j < 4; ++j) {
+				const u_int p = qbvh.prims[q].GetPrimitive(j);
+				if (std::find(leafPrims.begin(), leafPrims.end(), p) == leafPrims.end())
+					leafPrims.push_back(p);
+			}
+		}
+	}
+
+	return true;
+}
+
+void OBVHAccel::BuildNode(const QBVHAccel &qbvh, const Candidate &root,
+		std::vector<OBVHNode> &buildNodes, std::vector<OctTriangle> &buildPrims) {
+	// Open the candidate with the largest surface area until there are
+	// 8 of them. Each QBVH node is opened in 2 halves, following the binary
+	// splits used to build it.
+	std::vector<Candidate> candidates(1, root);
+	while (candidates.size() < 8) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			const float area = candidates[i].bbox.SurfaceArea();
+			if (!candidates[i].isLeaf && (area > bestArea)) {
+				best = i;
+				bestArea = area;
+			}
+		}
+		if (best < 0)
+			break;
+
+		const Candidate c = candidates[best];
+		candidates.erase(candidates.begin() + best);
+
+		const int half = c.nbSlots / 2;
+		for (int h = 1; h >= 0; --h) {
+			const Candidate child = MakeCandidate(qbvh, c.qbvhNode,
+					c.firstSlot + h * half, half);
+			// Skip the empty leaves
+			if (child.bbox.pMin.x <= child.bbox.pMax.x)
+				candidates.insert(candidates.begin() + best, child);
+		}
+	}
+
+	const u_int nodeIndex = buildNodes.size();
+	buildNodes.push_back(OBVHNode());
+
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		const Candidate &c = candidates[i];
+		buildNodes[nodeIndex].SetBBox(i, c.bbox);
+
+		if (!c.isLeaf) {
+			const int32_t childIndex = buildNodes.size();
+			BuildNode(qbvh, c, buildNodes, buildPrims);
+			buildNodes[nodeIndex].children[i] = childIndex;
+		} else {
+			// Repack the triangles of the QBVH leaves in groups of 8
+			std::vector<u_int> leafPrims;
+			CollectLeafPrims(qbvh, c, leafPrims);
+
+			const u_int firstOct = buildPrims.size();
+			for (u_int j = 0; j < leafPrims.size(); j += 8)
+				buildPrims.push_back(OctTriangle(triangles, vertices, &leafPrims[j],
+						min<u_int>(8, leafPrims.size() - j)));
+
+			buildNodes[nodeIndex].InitializeLeaf(i, buildPrims.size() - firstOct, firstOct);
+		}
+	}
+}
+
+/***************************************************/
+
+// Intersect the ray with the 8 bounding boxes of the node, return
+// the visit flags and the entry distances
+static inline AVX2_TARGET int BBoxIntersect(const OBVHNode &node,
+		const __m256 *o, const __m256 *invDir, const int *signs,
+		const __m256 &mint, const __m256 &maxt, __m256 *tEntry) {
+	__m256 tMin = mint;
+	__m256 tMax = maxt;
+	for (int axis = 0; axis < 3; ++axis) {
+		tMin = _mm256_max_ps(tMin, _mm256_mul_ps(_mm256_sub_ps(
+				_mm256_load_ps(node.bboxes[signs[axis]][axis]), o[axis]), invDir[axis]));
+		tMax = _mm256_min_ps(tMax, _mm256_mul_ps(_mm256_sub_ps(
+				_mm256_load_ps(node.bboxes[1 - signs[axis]][axis]), o[axis]), invDir[axis]));
+	}
+
+	*tEntry = tMin;
+	return _mm256_movemask_ps(_mm256_cmp_ps(tMax, tMin, _CMP_GE_OQ));
+}
+
+// Push the children hit by the ray, the farthest first
+static inline AVX2_TARGET void PushChildren(const OBVHNode &node, int visit,
+		const __m256 &tEntry, int32_t *nodeStack, int *todoNode) {
+	float t[8];
+	_mm256_storeu_ps(t, tEntry);
+
+	float dist[8];
+	int32_t children[8];
+	int count = 0;
+	for (int i = 0; visit; ++i, visit >>= 1) {
+		if (!(visit & 1))
+			continue;
+
+		int j = count++;
+		for (; (j > 0) && (dist[j - 1] < t[i]); --j) {
+			dist[j] = dist[j - 1];
+			children[j] = children[j - 1];
+		}
+		dist[j] = t[i];
+		children[j] = node.children[i];
+	}
+
+	for (int i = 0; i < count; ++i)
+		nodeStack[++(*todoNode)] = children[i];
+}
+
+// Test the ray against the 8 triangles, return the mask of the
+// triangles hit inside the [mint, maxt] range of the ray
+static inline AVX2_TARGET int OctTriangleTest(const OctTriangle &tri,
+		const __m256 *o, const __m256 *d, const __m256 &mint, const __m256 &maxt,
+		__m256 *t, __m256 *b1, __m256 *b2) {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 edge1x = _mm256_load_ps(tri.edge1[0]);
+	const __m256 edge1y = _mm256_load_ps(tri.edge1[1]);
+	const __m256 edge1z = _mm256_load_ps(tri.edge1[2]);
+	const __m256 edge2x = _mm256_load_ps(tri.edge2[0]);
+	const __m256 edge2y = _mm256_load_ps(tri.edge2[1]);
+	const __m256 edge2z = _mm256_load_ps(tri.edge2[2]);
+
+	const __m256 s1x = _mm256_fmsub_ps(d[1], edge2z, _mm256_mul_ps(d[2], edge2y));
+	const __m256 s1y = _mm256_fmsub_ps(d[2], edge2x, _mm256_mul_ps(d[0], edge2z));
+	const __m256 s1z = _mm256_fmsub_ps(d[0], edge2y, _mm256_mul_ps(d[1], edge2x));
+	const __m256 divisor = _mm256_fmadd_ps(s1x, edge1x,
+			_mm256_fmadd_ps(s1y, edge1y, _mm256_mul_ps(s1z, edge1z)));
+	__m256 test = _mm256_cmp_ps(divisor, zero, _CMP_NEQ_UQ);
+
+	const __m256 dx = _mm256_sub_ps(o[0], _mm256_load_ps(tri.orig[0]));
+	const __m256 dy = _mm256_sub_ps(o[1], _mm256_load_ps(tri.orig[1]));
+	const __m256 dz = _mm256_sub_ps(o[2], _mm256_load_ps(tri.orig[2]));
+	*b1 = _mm256_div_ps(_mm256_fmadd_ps(dx, s1x,
+			_mm256_fmadd_ps(dy, s1y, _mm256_mul_ps(dz, s1z))), divisor);
+	test = _mm256_and_ps(test, _mm256_cmp_ps(*b1, zero, _CMP_GE_OQ));
+
+	const __m256 s2x = _mm256_fmsub_ps(dy, edge1z, _mm256_mul_ps(dz, edge1y));
+	const __m256 s2y = _mm256_fmsub_ps(dz, edge1x, _mm256_mul_ps(dx, edge1z));
+	const __m256 s2z = _mm256_fmsub_ps(dx, edge1y, _mm256_mul_ps(dy, edge1x));
+	*b2 = _mm256_div_ps(_mm256_fmadd_ps(d[0], s2x,
+			_mm256_fmadd_ps(d[1], s2y, _mm256_mul_ps(d[2], s2z))), divisor);
+	const __m256 b0 = _mm256_sub_ps(_mm256_set1_ps(1.f), _mm256_add_ps(*b1, *b2));
+	test = _mm256_and_ps(test, _mm256_and_ps(_mm256_cmp_ps(*b2, zero, _CMP_GE_OQ),
+			_mm256_cmp_ps(b0, zero, _CMP_GE_OQ)));
+
+	*t = _mm256_div_ps(_mm256_fmadd_ps(edge2x, s2x,
+			_mm256_fmadd_ps(edge2y, s2y, _mm256_mul_ps(edge2z, s2z))), divisor);
+	test = _mm256_and_ps(test, _mm256_and_ps(_mm256_cmp_ps(*t, mint, _CMP_GT_OQ),
+			_mm256_cmp_ps(*t, maxt, _CMP_LT_OQ)));
+
+	return _mm256_movemask_ps(test);
+}
+
+/***************************************************/
+
+AVX2_TARGET void OBVHAccel::Intersect(const Ray &ray, RayHit *rayHit) const {
+	//------------------------------
+	// Prepare the ray for intersection
+	__m256 o[3], d[3], invDir[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		o[axis] = _mm256_set1_ps(ray.o[axis]);
+		d[axis] = _mm256_set1_ps(ray.d[axis]);
+		invDir[axis] = _mm256_set1_ps(1.f / ray.d[axis]);
+	}
+	const __m256 mint = _mm256_set1_ps(ray.mint);
+	__m256 maxt = _mm256_set1_ps(ray.maxt);
+
+	int signs[3];
+	ray.GetDirectionSigns(signs);
+
+	//------------------------------
+	// Main loop
+	int todoNode = 0; // the index in the stack
+	int32_t nodeStack[256];
+	nodeStack[0] = 0; // first node to handle: root node
+
+	while (todoNode >= 0) {
+		const int32_t nodeData = nodeStack[todoNode];
+		--todoNode;
+
+		// Leaves are identified by a negative index
+		if (!QBVHNode::IsLeaf(nodeData)) {
+			const OBVHNode &node = nodes[nodeData];
+
+			__m256 tEntry;
+			const int visit = BBoxIntersect(node, o, invDir, signs, mint, maxt, &tEntry);
+			PushChildren(node, visit, tEntry, nodeStack, &todoNode);
+		} else {
+			if (QBVHNode::IsEmpty(nodeData))
+				continue;
+
+			const u_int offset = QBVHNode::FirstQuadIndex(nodeData);
+			const u_int nbOcts = QBVHNode::NbQuadPrimitives(nodeData);
+			for (u_int i = offset; i < offset + nbOcts; ++i) {
+				__m256 t, b1, b2;
+				const int mask = OctTriangleTest(prims[i], o, d, mint, maxt, &t, &b1, &b2);
+				if (!mask)
+					continue;
+
+				float tf[8];
+				_mm256_storeu_ps(tf, t);
+				int hit = -1;
+				for (int j = 0; j < 8; ++j) {
+					if ((mask & (1 << j)) && (tf[j] < ray.maxt)) {
+						hit = j;
+						ray.maxt = tf[j];
+					}
+				}
+				if (hit < 0)
+					continue;
+				maxt = _mm256_set1_ps(ray.maxt);
+
+				float b1f[8], b2f[8];
+				_mm256_storeu_ps(b1f, b1);
+				_mm256_storeu_ps(b2f, b2);
+				rayHit->t = ray.maxt;
+				rayHit->b1 = b1f[hit];
+				rayHit->b2 = b2f[hit];
+				rayHit->index = prims[i].primitives[hit];
+			}
+		}
+	}
+}
+
+AVX2_TARGET bool OBVHAccel::IntersectP(const Ray &ray, RayHit *rayHit) const {
+	//------------------------------
+	// Prepare the ray for intersection
+	__m256 o[3], d[3], invDir[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		o[axis] = _mm256_set1_ps(ray.o[axis]);
+		d[axis] = _mm256_set1_ps(ray.d[axis]);
+		invDir[axis] = _mm256_set1_ps(1.f / ray.d[axis]);
+	}
+	const __m256 mint = _mm256_set1_ps(ray.mint);
+	const __m256 maxt = _mm256_set1_ps(ray.maxt);
+
+	int signs[3];
+	ray.GetDirectionSigns(signs);
+
+	//------------------------------
+	// Main loop
+	int todoNode = 0; // the index in the stack
+	int32_t nodeStack[256];
+	nodeStack[0] = 0; // first node to handle: root node
+
+	while (todoNode >= 0) {
+		const int32_t nodeData = nodeStack[todoNode];
+		--todoNode;
+
+		// Leaves are identified by a negative index
+		if (!QBVHNode::IsLeaf(nodeData)) {
+			const OBVHNode &node = nodes[nodeData];
+
+			__m256 tEntry;
+			const int visit = BBoxIntersect(node, o, invDir, signs, mint, maxt, &tEntry);
+			PushChildren(node, visit, tEntry, nodeStack, &todoNode);
+		} else {
+			if (QBVHNode::IsEmpty(nodeData))
+				continue;
+
+			const u_int offset = QBVHNode::FirstQuadIndex(nodeData);
+			const u_int nbOcts = QBVHNode::NbQuadPrimitives(nodeData);
+			for (u_int i = offset; i < offset + nbOcts; ++i) {
+				__m256 t, b1, b2;
+				const int mask = OctTriangleTest(prims[i], o, d, mint, maxt, &t, &b1, &b2);
+				if (!mask)
+					continue;
+
+				int hit = 0;
+				while (!(mask & (1 << hit)))
+					++hit;
+
+				float tf[8], b1f[8], b2f[8];
+				_mm256_storeu_ps(tf, t);
+				_mm256_storeu_ps(b1f, b1);
+				_mm256_storeu_ps(b2f, b2);
+				rayHit->t = tf[hit];
+				rayHit->b1 = b1f[hit];
+				rayHit->b2 = b2f[hit];
+				rayHit->index = prims[i].primitives[hit];
+
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
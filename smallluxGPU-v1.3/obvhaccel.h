@@ -0,0 +1,176 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+#ifndef _OBVHACCEL_H
+#define	_OBVHACCEL_H
+
+#include "qbvhaccel.h"
+
+// 8-wide version of the QBVH, traversed with AVX2. The code using AVX2 is
+// compiled only for the functions that need it, so the rest of the
+// program still runs on any SSE CPU. OBVHAccel::IsSupported() must be
+// checked before using it.
+
+/**
+   The OBVH node structure, 256 bytes long. The children use the
+   same encoding of the QBVH nodes, with groups of 8 triangles
+   instead of 4 in the leaves.
+*/
+class OBVHNode {
+public:
+	/**
+	   The 8 bounding boxes, in SoA form, for direct SIMD use
+	*/
+	float bboxes[2][3][8];
+
+	/**
+	   The 8 children
+	*/
+	int32_t children[8];
+
+	int32_t pad[8]; // Padding to 256 bytes
+
+	OBVHNode() {
+		for (int i = 0; i < 8; ++i) {
+			for (int axis = 0; axis < 3; ++axis) {
+				bboxes[0][axis][i] = INFINITY;
+				bboxes[1][axis][i] = -INFINITY;
+			}
+
+			children[i] = QBVHNode::emptyLeafNode;
+			pad[i] = 0;
+		}
+	}
+
+	/**
+	   Initialize the ith child as a leaf
+	*/
+	void InitializeLeaf(int i, u_int nbOcts, u_int firstOctIndex) {
+		if (nbOcts == 0)
+			children[i] = QBVHNode::emptyLeafNode;
+		else
+			children[i] = 0x80000000 |
+				(((static_cast<int32_t>(nbOcts) - 1) & 0xf) << 27) |
+				(static_cast<int32_t>(firstOctIndex) & 0x07ffffff);
+	}
+
+	/**
+	   Set the bounding box for the ith child.
+	*/
+	void SetBBox(int i, const BBox &bbox) {
+		for (int axis = 0; axis < 3; ++axis) {
+			bboxes[0][axis][i] = bbox.pMin[axis];
+			bboxes[1][axis][i] = bbox.pMax[axis];
+		}
+	}
+};
+
+/**
+   8 triangles in SoA form. Unused slots repeat the last triangle.
+*/
+class OctTriangle {
+public:
+	OctTriangle(const Triangle *tris, const Point *verts,
+			const u_int *prims, const u_int nbPrims) {
+		for (u_int i = 0; i < 8; ++i) {
+			primitives[i] = prims[min(i, nbPrims - 1)];
+
+			const Triangle *t = &tris[primitives[i]];
+			for (int axis = 0; axis < 3; ++axis) {
+				orig[axis][i] = verts[t->v[0]][axis];
+				edge1[axis][i] = verts[t->v[1]][axis] - verts[t->v[0]][axis];
+				edge2[axis][i] = verts[t->v[2]][axis] - verts[t->v[0]][axis];
+			}
+		}
+	}
+
+	float orig[3][8];
+	float edge1[3][8];
+	float edge2[3][8];
+	unsigned int primitives[8];
+};
+
+/***************************************************/
+class OBVHAccel {
+public:
+	/**
+	   Build the OBVH collapsing the binary splits of an existing QBVH,
+	   the children with the largest surface area are opened first.
+	*/
+	OBVHAccel(const QBVHAccel &qbvh, const Triangle *tris, const Point *verts);
+	~OBVHAccel();
+
+	/**
+	   Check if the CPU and the OS support AVX2 and FMA.
+	*/
+	static bool IsSupported();
+
+	/**
+	   Same as QBVHAccel::Intersect()
+	*/
+	void Intersect(const Ray &ray, RayHit *hit) const;
+
+	/**
+	   Same as QBVHAccel::IntersectP()
+	*/
+	bool IntersectP(const Ray &ray, RayHit *hit) const;
+
+	OBVHNode *nodes;
+	u_int nNodes;
+
+	OctTriangle *prims;
+	u_int nOcts;
+
+private:
+	/**
+	   A part of the QBVH that can become a child of an OBVH node:
+	   nbSlots consecutive children of a QBVH node. A single slot
+	   is always a leaf, an inner node is referenced with its 4 slots.
+	   Slots with only leaves and up to 8 triangles are merged in a
+	   single OBVH leaf.
+	*/
+	class Candidate {
+	public:
+		int32_t qbvhNode;
+		int firstSlot, nbSlots;
+		BBox bbox;
+		bool isLeaf;
+	};
+
+	Candidate MakeCandidate(const QBVHAccel &qbvh, int32_t qbvhNode,
+		int firstSlot, int nbSlots) const;
+
+	/**
+	   Collect the triangles of the QBVH leaves of a candidate, return
+	   false if it contains an inner node
+	*/
+	bool CollectLeafPrims(const QBVHAccel &qbvh, const Candidate &c,
+		std::vector<u_int> &leafPrims) const;
+
+	void BuildNode(const QBVHAccel &qbvh, const Candidate &root,
+		std::vector<OBVHNode> &buildNodes, std::vector<OctTriangle> &buildPrims);
+
+	const Point *vertices;
+	const Triangle *triangles;
+};
+
+#endif	/* _OBVHACCEL_H */
@@ -66,17 +66,23 @@ public:
 		currentPathRayIndex = rayBuffer->AddRay(pathRay);
 		if (state == NEXT_VERTEX) {
 			for (unsigned int i = 0; i < tracedShadowRayCount; ++i)
-				currentShadowRayIndex[i] = rayBuffer->AddRay(shadowRay[i]);
+				currentShadowRayIndex[i] = rayBuffer->AddRay(shadowRay[i], RAY_OCCLUSION);
 		}
 	}
 
 	void AdvancePath(Scene *scene, Sampler *sampler, const RayBuffer *rayBuffer,
 			SampleBuffer *sampleBuffer) {
 		const RayHit *rayHit = rayBuffer->GetRayHit(currentPathRayIndex);
+#if defined(QBVH_TRAVERSAL_STATS)
+		sample.traversalCost += rayBuffer->GetRayCost(currentPathRayIndex);
+#endif
 
 		if ((state == NEXT_VERTEX) && (tracedShadowRayCount > 0)) {
 			for (unsigned int i = 0; i < tracedShadowRayCount; ++i) {
 				const RayHit *shadowRayHit = rayBuffer->GetRayHit(currentShadowRayIndex[i]);
+#if defined(QBVH_TRAVERSAL_STATS)
+				sample.traversalCost += rayBuffer->GetRayCost(currentShadowRayIndex[i]);
+#endif
 				if (shadowRayHit->index == 0xffffffffu) {
 					// Nothing was hit, light is visible
 					radiance += throughput * lightColor[i] / lightPdf[i];
@@ -94,8 +100,8 @@ public:
 
 		// Something was hit
 		unsigned int currentTriangleIndex = rayHit->index;
-		Spectrum triInterpCol = scene->mesh->triangles[currentTriangleIndex].InterpolateColor(scene->mesh->vertColors, rayHit->b1, rayHit->b2);
-		Normal shadeN = scene->mesh->triangles[currentTriangleIndex].InterpolateNormal(scene->mesh->vertNormals, rayHit->b1, rayHit->b2);
+		Spectrum triInterpCol = scene->InterpolateColor(currentTriangleIndex, rayHit->b1, rayHit->b2);
+		Normal shadeN = scene->InterpolateNormal(currentTriangleIndex, rayHit->b1, rayHit->b2);
 
 		// Calculate next step
 		depth++;
@@ -34,6 +34,10 @@ typedef struct {
 	float mint, maxt;
 } Ray;
 
+// Must match the RayType enum in raybuffer.h
+#define RAY_INTERSECT 0
+#define RAY_OCCLUSION 1
+
 typedef struct {
 	float t;
 	float b1, b2; // Barycentric coordinates of the hit point
@@ -50,24 +54,117 @@ typedef struct QuadRay {
 	float4 mint, maxt;
 } QuadRay;
 
+#if defined(PARAM_WOOP_TRIANGLES) && !defined(PARAM_INDEXED_LEAVES)
+// The transformations to the space of the unit triangle, see the
+// QuadTriangle class
+typedef struct {
+	float4 b1Row[4];
+	float4 b2Row[4];
+	float4 planeRow[4];
+	unsigned int primitives[4];
+} QuadTiangle;
+#else
 typedef struct {
 	float4 origx, origy, origz;
 	float4 edge1x, edge1y, edge1z;
 	float4 edge2x, edge2y, edge2z;
 	unsigned int primitives[4];
 } QuadTiangle;
-
+#endif
+
+#if defined(PARAM_INDEXED_LEAVES)
+// The leaves have only the 4 triangle indices (same layout of IndexedQuad),
+// the QuadTiangle is built in private memory from the mesh triangles (3
+// vertex indices each) and vertices (3 floats each)
+typedef uint4 QuadLeaf;
+#define QUAD_SPACE
+#define INDEXED_LEAVES_PARAM , __global uint *meshTris, __global float *meshVerts
+#define INDEXED_LEAVES_ARG , meshTris, meshVerts
+#else
+typedef QuadTiangle QuadLeaf;
+#define QUAD_SPACE __global
+#define INDEXED_LEAVES_PARAM
+#define INDEXED_LEAVES_ARG
+#endif
+
+#if defined(PARAM_COMPRESSED_NODES)
+// Same layout of QBVHCompressedNode: the bounding boxes are 8 bit
+// coordinates on a grid starting at origin, with cells of 2^exponent
+typedef struct {
+	int4 children;
+	float origin[3];
+	uchar4 qbboxes[2][3];
+	char exponent[3];
+	uchar axisMain, axisSubLeft, axisSubRight;
+	uchar pad[6];
+} QBVHNode;
+#else
 typedef struct {
 	float4 bboxes[2][3];
 	int4 children;
+	int axisMain, axisSubLeft, axisSubRight;
+	int pad;
 } QBVHNode;
+#endif
+
+#if defined(PARAM_INSTANCES)
+// Same layout of QBVHInstance
+typedef struct {
+	float4 worldToLocal[3];
+	int rootNode;
+	unsigned int triangleOffset;
+	unsigned int pad[2];
+} QBVHInstance;
+#endif
 
 #define emptyLeafNode 0xffffffff
 
 #define QBVHNode_IsLeaf(index) (index < 0)
 #define QBVHNode_IsEmpty(index) (index == emptyLeafNode)
+#if defined(PARAM_LEAVES_TABLE)
+// The leaves are in the leaves table (same layout of QBVHLeaf), the
+// leaf index has the 31 bits after the sign
+#define QBVHNode_NbQuadPrimitives(index) (leaves[index & 0x7fffffff].y)
+#define QBVHNode_FirstQuadIndex(index) (leaves[index & 0x7fffffff].x)
+#define LEAVES_TABLE_PARAM , __global uint2 *leaves
+#define LEAVES_TABLE_ARG , leaves
+#else
 #define QBVHNode_NbQuadPrimitives(index) ((unsigned int)(((index >> 27) & 0xf) + 1))
 #define QBVHNode_FirstQuadIndex(index) (index & 0x07ffffff)
+#define LEAVES_TABLE_PARAM
+#define LEAVES_TABLE_ARG
+#endif
+
+// Children visit order, indexed by (visit mask << 3) | direction signs
+// along the 3 node split axes. 4 bits for each child index, the farthest
+// first, 4 means no more children (same table of QBVHAccel::pathTable)
+__constant short pathTable[128] = {
+	0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444,
+	0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440,
+	0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441,
+	0x4401, 0x4401, 0x4410, 0x4410, 0x4401, 0x4401, 0x4410, 0x4410,
+	0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442,
+	0x4402, 0x4402, 0x4402, 0x4402, 0x4420, 0x4420, 0x4420, 0x4420,
+	0x4412, 0x4412, 0x4412, 0x4412, 0x4421, 0x4421, 0x4421, 0x4421,
+	0x4012, 0x4012, 0x4102, 0x4102, 0x4201, 0x4201, 0x4210, 0x4210,
+	0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443,
+	0x4403, 0x4403, 0x4403, 0x4403, 0x4430, 0x4430, 0x4430, 0x4430,
+	0x4413, 0x4413, 0x4413, 0x4413, 0x4431, 0x4431, 0x4431, 0x4431,
+	0x4013, 0x4013, 0x4103, 0x4103, 0x4301, 0x4301, 0x4310, 0x4310,
+	0x4423, 0x4432, 0x4423, 0x4432, 0x4423, 0x4432, 0x4423, 0x4432,
+	0x4023, 0x4032, 0x4023, 0x4032, 0x4230, 0x4320, 0x4230, 0x4320,
+	0x4123, 0x4132, 0x4123, 0x4132, 0x4231, 0x4321, 0x4231, 0x4321,
+	0x0123, 0x0132, 0x1023, 0x1032, 0x2301, 0x3201, 0x2310, 0x3210
+};
+
+#if defined(PARAM_COMPRESSED_NODES)
+// The decoding is exact, the boxes are the same of the CPU
+#define QBVHNode_BBox(node, side, axis) ((float4)node->origin[axis] + \
+		convert_float4(node->qbboxes[side][axis]) * \
+		(float4)as_float(((int)node->exponent[axis] + 127) << 23))
+#else
+#define QBVHNode_BBox(node, side, axis) (node->bboxes[side][axis])
+#endif
 
 static int4 QBVHNode_BBoxIntersect(__global QBVHNode *node, const QuadRay *ray4,
 		const float4 invDir[3], const int sign[3]) {
@@ -75,23 +172,46 @@ static int4 QBVHNode_BBoxIntersect(__global QBVHNode *node, const QuadRay *ray4,
 	float4 tMax = ray4->maxt;
 
 	// X coordinate
-	tMin = max(tMin, (node->bboxes[sign[0]][0] - ray4->ox) * invDir[0]);
-	tMax = min(tMax, (node->bboxes[1 - sign[0]][0] - ray4->ox) * invDir[0]);
+	tMin = max(tMin, (QBVHNode_BBox(node, sign[0], 0) - ray4->ox) * invDir[0]);
+	tMax = min(tMax, (QBVHNode_BBox(node, 1 - sign[0], 0) - ray4->ox) * invDir[0]);
 
 	// Y coordinate
-	tMin = max(tMin, (node->bboxes[sign[1]][1] - ray4->oy) * invDir[1]);
-	tMax = min(tMax, (node->bboxes[1 - sign[1]][1] - ray4->oy) * invDir[1]);
+	tMin = max(tMin, (QBVHNode_BBox(node, sign[1], 1) - ray4->oy) * invDir[1]);
+	tMax = min(tMax, (QBVHNode_BBox(node, 1 - sign[1], 1) - ray4->oy) * invDir[1]);
 
 	// Z coordinate
-	tMin = max(tMin, (node->bboxes[sign[2]][2] - ray4->oz) * invDir[2]);
-	tMax = min(tMax, (node->bboxes[1 - sign[2]][2] - ray4->oz) * invDir[2]);
+	tMin = max(tMin, (QBVHNode_BBox(node, sign[2], 2) - ray4->oz) * invDir[2]);
+	tMax = min(tMax, (QBVHNode_BBox(node, 1 - sign[2], 2) - ray4->oz) * invDir[2]);
 
 	//return the visit flags
 	return  (tMax >= tMin);
 }
 
-static void QuadTriangle_Intersect(const __global QuadTiangle *qt, QuadRay *ray4, RayHit *rayHit) {
+// Returns the mask of the 4 triangles hit inside the [mint, maxt] range
+static int4 QuadTriangle_Test(const QUAD_SPACE QuadTiangle *qt, const QuadRay *ray4,
+		float4 *t, float4 *b1, float4 *b2) {
 	const float4 zero = (float4)0.f;
+#if defined(PARAM_WOOP_TRIANGLES) && !defined(PARAM_INDEXED_LEAVES)
+	// The ray in the space of the unit triangle, it is hit where the
+	// ray crosses the plane z = 0
+	const float4 oz = qt->planeRow[3] - (ray4->ox * qt->planeRow[0] +
+		ray4->oy * qt->planeRow[1] + ray4->oz * qt->planeRow[2]);
+	const float4 dz = ray4->dx * qt->planeRow[0] + ray4->dy * qt->planeRow[1] +
+		ray4->dz * qt->planeRow[2];
+	*t = oz / dz;
+
+	*b1 = qt->b1Row[3] + ray4->ox * qt->b1Row[0] + ray4->oy * qt->b1Row[1] +
+		ray4->oz * qt->b1Row[2] + *t * (ray4->dx * qt->b1Row[0] +
+		ray4->dy * qt->b1Row[1] + ray4->dz * qt->b1Row[2]);
+	*b2 = qt->b2Row[3] + ray4->ox * qt->b2Row[0] + ray4->oy * qt->b2Row[1] +
+		ray4->oz * qt->b2Row[2] + *t * (ray4->dx * qt->b2Row[0] +
+		ray4->dy * qt->b2Row[1] + ray4->dz * qt->b2Row[2]);
+	const float4 b0 = ((float4)1.f) - *b1 - *b2;
+
+	// The '&&' operator is still bugged in the ATI compiler
+	return (b0 >= zero) & (*b1 >= zero) & (*b2 >= zero) &
+		(*t > ray4->mint) & (*t < ray4->maxt);
+#else
 
 	//--------------------------------------------------------------------------
 	// Calc. b1 coordinate
@@ -115,7 +235,7 @@ static void QuadTriangle_Intersect(const __global QuadTiangle *qt, QuadRay *ray4
 	const float4 dy = ray4->oy - qt->origy;
 	const float4 dz = ray4->oz - qt->origz;
 
-	const float4 b1 = ((dx * s1x) + (dy * s1y) + (dz * s1z)) / divisor;
+	*b1 = ((dx * s1x) + (dy * s1y) + (dz * s1z)) / divisor;
 
 	//--------------------------------------------------------------------------
 	// Calc. b2 coordinate
@@ -124,21 +244,27 @@ static void QuadTriangle_Intersect(const __global QuadTiangle *qt, QuadRay *ray4
 	const float4 s2y = (dz * edge1x) - (dx * edge1z);
 	const float4 s2z = (dx * edge1y) - (dy * edge1x);
 
-	const float4 b2 = ((ray4->dx * s2x) + (ray4->dy * s2y) + (ray4->dz * s2z)) / divisor;
+	*b2 = ((ray4->dx * s2x) + (ray4->dy * s2y) + (ray4->dz * s2z)) / divisor;
 
 	//--------------------------------------------------------------------------
 	// Calc. b0 coordinate
 
-	const float4 b0 = ((float4)1.f) - b1 - b2;
+	const float4 b0 = ((float4)1.f) - *b1 - *b2;
 
 	//--------------------------------------------------------------------------
 
-	const float4 t = ((edge2x * s2x) + (edge2y * s2y) + (edge2z * s2z)) / divisor;
+	*t = ((edge2x * s2x) + (edge2y * s2y) + (edge2z * s2z)) / divisor;
 
 	// The '&&' operator is still bugged in the ATI compiler
-	const int4 test = (divisor != zero) &
-		(b0 >= zero) & (b1 >= zero) & (b2 >= zero) &
-		(t > ray4->mint) & (t < ray4->maxt);
+	return (divisor != zero) &
+		(b0 >= zero) & (*b1 >= zero) & (*b2 >= zero) &
+		(*t > ray4->mint) & (*t < ray4->maxt);
+#endif
+}
+
+static void QuadTriangle_Intersect(const QUAD_SPACE QuadTiangle *qt, QuadRay *ray4, RayHit *rayHit) {
+	float4 t, b1, b2;
+	const int4 test = QuadTriangle_Test(qt, ray4, &t, &b1, &b2);
 
 	unsigned int hit = 4;
 	float _b1, _b2;
@@ -179,54 +305,118 @@ static void QuadTriangle_Intersect(const __global QuadTiangle *qt, QuadRay *ray4
 	rayHit->index = qt->primitives[hit];
 }
 
-__kernel void Intersect(
-		__global Ray *rays,
-		__global RayHit *rayHits,
-		__global QBVHNode *nodes,
-		__global QuadTiangle *quadTris,
-		const unsigned int rayCount) {
-	// Select the ray to check
-	const int gid = get_global_id(0);
-	if (gid >= rayCount)
-		return;
-
-	// Prepare the ray for intersection
-	QuadRay ray4;
-	{
-			__global float4 *basePtr =(__global float4 *)&rays[gid];
-			float4 data0 = (*basePtr++);
-			float4 data1 = (*basePtr);
-
-			ray4.ox = (float4)data0.x;
-			ray4.oy = (float4)data0.y;
-			ray4.oz = (float4)data0.z;
+// Any hit version of QuadTriangle_Intersect(), used for shadow rays
+static int QuadTriangle_IntersectP(const QUAD_SPACE QuadTiangle *qt, const QuadRay *ray4, RayHit *rayHit) {
+	float4 t, b1, b2;
+	const int4 test = QuadTriangle_Test(qt, ray4, &t, &b1, &b2);
+
+	if (test.s0) {
+		rayHit->t = t.s0;
+		rayHit->b1 = b1.s0;
+		rayHit->b2 = b2.s0;
+		rayHit->index = qt->primitives[0];
+	} else if (test.s1) {
+		rayHit->t = t.s1;
+		rayHit->b1 = b1.s1;
+		rayHit->b2 = b2.s1;
+		rayHit->index = qt->primitives[1];
+	} else if (test.s2) {
+		rayHit->t = t.s2;
+		rayHit->b1 = b1.s2;
+		rayHit->b2 = b2.s2;
+		rayHit->index = qt->primitives[2];
+	} else if (test.s3) {
+		rayHit->t = t.s3;
+		rayHit->b1 = b1.s3;
+		rayHit->b2 = b2.s3;
+		rayHit->index = qt->primitives[3];
+	} else
+		return 0;
+
+	return 1;
+}
 
-			ray4.dx = (float4)data0.w;
-			ray4.dy = (float4)data1.x;
-			ray4.dz = (float4)data1.y;
+// Push the children of a node hit by the ray on the stack, the farthest first
+static void QBVHNode_PushChildren(__global QBVHNode *node, const QuadRay *ray4,
+		const float4 invDir[3], const int signs[3], int *nodeStack, int *todoNode) {
+	const int4 visit = QBVHNode_BBoxIntersect(node, ray4, invDir, signs);
+
+	const int visitMask = (visit.s0 & 0x1) | (visit.s1 & 0x2) |
+		(visit.s2 & 0x4) | (visit.s3 & 0x8);
+
+	const int children[4] = {
+		node->children.s0, node->children.s1,
+		node->children.s2, node->children.s3
+	};
+	int order = pathTable[(visitMask << 3) |
+		(signs[node->axisMain] << 2) |
+		(signs[node->axisSubLeft] << 1) |
+		signs[node->axisSubRight]];
+	for (int i = 0; i < 4; ++i) {
+		const int child = order & 0xf;
+		if (child == 4)
+			break;
+		nodeStack[++(*todoNode)] = children[child];
+		order >>= 4;
+	}
+}
 
-			ray4.mint = (float4)data1.z;
-			ray4.maxt = (float4)data1.w;
+#if defined(PARAM_INDEXED_LEAVES)
+// Build the QuadTiangle of an indexed leaf, same edge layout of the
+// QuadTriangle class
+static void QuadTriangle_Load(const uint4 indices, __global uint *meshTris,
+		__global float *meshVerts, QuadTiangle *qt) {
+	qt->primitives[0] = indices.x;
+	qt->primitives[1] = indices.y;
+	qt->primitives[2] = indices.z;
+	qt->primitives[3] = indices.w;
+
+	float o[3][4], e1[3][4], e2[3][4];
+	for (unsigned int i = 0; i < 4; ++i) {
+		__global uint *tri = &meshTris[3 * qt->primitives[i]];
+		__global float *p0 = &meshVerts[3 * tri[0]];
+		__global float *p1 = &meshVerts[3 * tri[1]];
+		__global float *p2 = &meshVerts[3 * tri[2]];
+
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			o[axis][i] = p0[axis];
+			e1[axis][i] = p1[axis] - p0[axis];
+			e2[axis][i] = p2[axis] - p0[axis];
+		}
 	}
 
+	qt->origx = (float4)(o[0][0], o[0][1], o[0][2], o[0][3]);
+	qt->origy = (float4)(o[1][0], o[1][1], o[1][2], o[1][3]);
+	qt->origz = (float4)(o[2][0], o[2][1], o[2][2], o[2][3]);
+	qt->edge1x = (float4)(e1[0][0], e1[0][1], e1[0][2], e1[0][3]);
+	qt->edge1y = (float4)(e1[1][0], e1[1][1], e1[1][2], e1[1][3]);
+	qt->edge1z = (float4)(e1[2][0], e1[2][1], e1[2][2], e1[2][3]);
+	qt->edge2x = (float4)(e2[0][0], e2[0][1], e2[0][2], e2[0][3]);
+	qt->edge2y = (float4)(e2[1][0], e2[1][1], e2[1][2], e2[1][3]);
+	qt->edge2z = (float4)(e2[2][0], e2[2][1], e2[2][2], e2[2][3]);
+}
+#endif
+
+// Trace the ray in the tree starting at rootNode, returns 1 if an
+// occlusion ray has hit something
+static int QBVH_Traverse(__global QBVHNode *nodes, __global QuadLeaf *quadTris
+		LEAVES_TABLE_PARAM INDEXED_LEAVES_PARAM, const int rootNode, QuadRay *ray4, const int occlusion,
+		RayHit *rayHit) {
 	float4 invDir[3];
-	invDir[0] = (float4)(1.f / ray4.dx.s0);
-	invDir[1] = (float4)(1.f / ray4.dy.s0);
-	invDir[2] = (float4)(1.f / ray4.dz.s0);
+	invDir[0] = (float4)(1.f / ray4->dx.s0);
+	invDir[1] = (float4)(1.f / ray4->dy.s0);
+	invDir[2] = (float4)(1.f / ray4->dz.s0);
 
 	int signs[3];
-	signs[0] = (ray4.dx.s0 < 0.f);
-	signs[1] = (ray4.dy.s0 < 0.f);
-	signs[2] = (ray4.dz.s0 < 0.f);
-
-	RayHit rayHit;
-	rayHit.index = 0xffffffffu;
+	signs[0] = (ray4->dx.s0 < 0.f);
+	signs[1] = (ray4->dy.s0 < 0.f);
+	signs[2] = (ray4->dz.s0 < 0.f);
 
 	//------------------------------
 	// Main loop
 	int todoNode = 0; // the index in the stack
 	int nodeStack[24];
-	nodeStack[0] = 0; // first node to handle: root node
+	nodeStack[0] = rootNode; // first node to handle: root node
 
 	while (todoNode >= 0) {
 		// Leaves are identified by a negative index
@@ -234,21 +424,11 @@ __kernel void Intersect(
 			__global QBVHNode *node = &nodes[nodeStack[todoNode]];
 			--todoNode;
 
-			const int4 visit = QBVHNode_BBoxIntersect(node, &ray4, invDir, signs);
-
-			const int4 children = node->children;
-			if (visit.s0)
-				nodeStack[++todoNode] = children.s0;
-			if (visit.s1)
-				nodeStack[++todoNode] = children.s1;
-			if (visit.s2)
-				nodeStack[++todoNode] = children.s2;
-			if (visit.s3)
-				nodeStack[++todoNode] = children.s3;
+			QBVHNode_PushChildren(node, ray4, invDir, signs, nodeStack, &todoNode);
 		} else {
 			//----------------------
-			// It is a leaf,
-			// all the informations are encoded in the index
+			// It is a leaf, all the informations are encoded
+			// in the index or in the leaves table
 			const int leafData = nodeStack[todoNode];
 			--todoNode;
 
@@ -259,10 +439,155 @@ __kernel void Intersect(
 			const unsigned int nbQuadPrimitives = QBVHNode_NbQuadPrimitives(leafData);
 			const unsigned int offset = QBVHNode_FirstQuadIndex(leafData);
 
-			for (unsigned int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber)
-				QuadTriangle_Intersect(&quadTris[primNumber], &ray4, &rayHit);
+			for (unsigned int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber) {
+#if defined(PARAM_INDEXED_LEAVES)
+				QuadTiangle quad;
+				QuadTriangle_Load(quadTris[primNumber], meshTris, meshVerts, &quad);
+				const QuadTiangle *qt = &quad;
+#else
+				__global QuadTiangle *qt = &quadTris[primNumber];
+#endif
+				if (occlusion) {
+					if (QuadTriangle_IntersectP(qt, ray4, rayHit))
+						return 1;
+				} else
+					QuadTriangle_Intersect(qt, ray4, rayHit);
+			}
+		}
+	}
+
+	return 0;
+}
+
+#if defined(PARAM_INSTANCES)
+// Transform the ray in the instance space, without normalizing the
+// direction so the distances along the ray don't change
+static void QBVHInstance_ToLocal(__global QBVHInstance *instance, const QuadRay *ray4,
+		QuadRay *localRay4) {
+	const float4 m0 = instance->worldToLocal[0];
+	const float4 m1 = instance->worldToLocal[1];
+	const float4 m2 = instance->worldToLocal[2];
+
+	localRay4->ox = m0.x * ray4->ox + m0.y * ray4->oy + m0.z * ray4->oz + m0.w;
+	localRay4->oy = m1.x * ray4->ox + m1.y * ray4->oy + m1.z * ray4->oz + m1.w;
+	localRay4->oz = m2.x * ray4->ox + m2.y * ray4->oy + m2.z * ray4->oz + m2.w;
+
+	localRay4->dx = m0.x * ray4->dx + m0.y * ray4->dy + m0.z * ray4->dz;
+	localRay4->dy = m1.x * ray4->dx + m1.y * ray4->dy + m1.z * ray4->dz;
+	localRay4->dz = m2.x * ray4->dx + m2.y * ray4->dy + m2.z * ray4->dz;
+
+	localRay4->mint = ray4->mint;
+	localRay4->maxt = ray4->maxt;
+}
+
+// Trace the ray in the top level tree, its leaves reference
+// ranges of instances instead of quads
+static void QBVH_TraverseInstances(__global QBVHNode *nodes, __global QuadLeaf *quadTris,
+		__global QBVHInstance *instances LEAVES_TABLE_PARAM, QuadRay *ray4,
+		const int occlusion, RayHit *rayHit) {
+	float4 invDir[3];
+	invDir[0] = (float4)(1.f / ray4->dx.s0);
+	invDir[1] = (float4)(1.f / ray4->dy.s0);
+	invDir[2] = (float4)(1.f / ray4->dz.s0);
+
+	int signs[3];
+	signs[0] = (ray4->dx.s0 < 0.f);
+	signs[1] = (ray4->dy.s0 < 0.f);
+	signs[2] = (ray4->dz.s0 < 0.f);
+
+	int todoNode = 0;
+	int nodeStack[24];
+	nodeStack[0] = 0;
+
+	while (todoNode >= 0) {
+		if (!QBVHNode_IsLeaf(nodeStack[todoNode])) {
+			__global QBVHNode *node = &nodes[nodeStack[todoNode]];
+			--todoNode;
+
+			QBVHNode_PushChildren(node, ray4, invDir, signs, nodeStack, &todoNode);
+		} else {
+			const int leafData = nodeStack[todoNode];
+			--todoNode;
+
+			if (QBVHNode_IsEmpty(leafData))
+				continue;
+
+			const unsigned int nbInstances = QBVHNode_NbQuadPrimitives(leafData);
+			const unsigned int offset = QBVHNode_FirstQuadIndex(leafData);
+
+			for (unsigned int i = offset; i < offset + nbInstances; ++i) {
+				__global QBVHInstance *instance = &instances[i];
+
+				QuadRay localRay4;
+				QBVHInstance_ToLocal(instance, ray4, &localRay4);
+
+				RayHit localHit;
+				localHit.index = 0xffffffffu;
+				const int occluded = QBVH_Traverse(nodes, quadTris LEAVES_TABLE_ARG,
+						instance->rootNode, &localRay4, occlusion, &localHit);
+
+				if (localHit.index != 0xffffffffu) {
+					*rayHit = localHit;
+					rayHit->index += instance->triangleOffset;
+					ray4->maxt = localRay4.maxt;
+				}
+
+				if (occluded)
+					return;
+			}
 		}
 	}
+}
+#endif
+
+__kernel void Intersect(
+		__global Ray *rays,
+		__global unsigned char *rayTypes,
+		__global RayHit *rayHits,
+		__global QBVHNode *nodes,
+		__global QuadLeaf *quadTris,
+		const unsigned int rayCount
+#if defined(PARAM_INSTANCES)
+		, __global QBVHInstance *instances
+#endif
+		LEAVES_TABLE_PARAM
+		INDEXED_LEAVES_PARAM
+		) {
+	// Select the ray to check
+	const int gid = get_global_id(0);
+	if (gid >= rayCount)
+		return;
+
+	// Prepare the ray for intersection
+	QuadRay ray4;
+	{
+			__global float4 *basePtr =(__global float4 *)&rays[gid];
+			float4 data0 = (*basePtr++);
+			float4 data1 = (*basePtr);
+
+			ray4.ox = (float4)data0.x;
+			ray4.oy = (float4)data0.y;
+			ray4.oz = (float4)data0.z;
+
+			ray4.dx = (float4)data0.w;
+			ray4.dy = (float4)data1.x;
+			ray4.dz = (float4)data1.y;
+
+			ray4.mint = (float4)data1.z;
+			ray4.maxt = (float4)data1.w;
+	}
+
+	// Shadow rays can stop at the first hit
+	const int occlusion = (rayTypes[gid] == RAY_OCCLUSION);
+
+	RayHit rayHit;
+	rayHit.index = 0xffffffffu;
+
+#if defined(PARAM_INSTANCES)
+	QBVH_TraverseInstances(nodes, quadTris, instances LEAVES_TABLE_ARG, &ray4, occlusion, &rayHit);
+#else
+	QBVH_Traverse(nodes, quadTris LEAVES_TABLE_ARG INDEXED_LEAVES_ARG, 0, &ray4, occlusion, &rayHit);
+#endif
 
 	// Write result
 	rayHits[gid].t = rayHit.t;
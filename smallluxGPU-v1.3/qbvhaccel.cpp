@@ -19,34 +19,237 @@
  *
  ***************************************************************************/
 
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
 #include "qbvhaccel.h"
 
 /***************************************************/
 
-QBVHAccel::QBVHAccel(const unsigned int triangleCount, const Triangle *tris, const Point *verts,
-		u_int mp, u_int fst, u_int sf) : fullSweepThreshold(fst),
-		skipFactor(sf), maxPrimsPerLeaf(mp) {
-	// Initialize primitives for _BVHAccel_
-	nPrims = triangleCount;
-	vertices = verts;
-	triangles = tris;
+// Generated for all the 16 visit masks and the 8 combinations of
+// the ray direction signs along the 3 split axes of a node
+// (see the comment in qbvhaccel.h)
+const boost::int16_t QBVHAccel::pathTable[128] = {
+	0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444, 0x4444,
+	0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440, 0x4440,
+	0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441, 0x4441,
+	0x4401, 0x4401, 0x4410, 0x4410, 0x4401, 0x4401, 0x4410, 0x4410,
+	0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442, 0x4442,
+	0x4402, 0x4402, 0x4402, 0x4402, 0x4420, 0x4420, 0x4420, 0x4420,
+	0x4412, 0x4412, 0x4412, 0x4412, 0x4421, 0x4421, 0x4421, 0x4421,
+	0x4012, 0x4012, 0x4102, 0x4102, 0x4201, 0x4201, 0x4210, 0x4210,
+	0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443, 0x4443,
+	0x4403, 0x4403, 0x4403, 0x4403, 0x4430, 0x4430, 0x4430, 0x4430,
+	0x4413, 0x4413, 0x4413, 0x4413, 0x4431, 0x4431, 0x4431, 0x4431,
+	0x4013, 0x4013, 0x4103, 0x4103, 0x4301, 0x4301, 0x4310, 0x4310,
+	0x4423, 0x4432, 0x4423, 0x4432, 0x4423, 0x4432, 0x4423, 0x4432,
+	0x4023, 0x4032, 0x4023, 0x4032, 0x4230, 0x4320, 0x4230, 0x4320,
+	0x4123, 0x4132, 0x4123, 0x4132, 0x4231, 0x4321, 0x4231, 0x4321,
+	0x0123, 0x0132, 0x1023, 0x1032, 0x2301, 0x3201, 0x2310, 0x3210
+};
 
-	// Temporary data for building
-	u_int *primsIndexes = new u_int[nPrims + 3]; // For the case where
-	// the last quad would begin at the last primitive
-	// (or the second or third last primitive)
+/***************************************************/
+
+// Jobs executed by the build threads. They work on disjoint parts of
+// the primitive arrays and the results don't depend on the number of
+// threads, so the tree is always the same.
+
+template<class T> static void RunJobs(std::vector<T> &jobs) {
+	if (jobs.size() == 1) {
+		jobs[0]();
+		return;
+	}
+
+	boost::thread_group threads;
+	for (size_t i = 0; i < jobs.size(); ++i)
+		threads.create_thread(boost::ref(jobs[i]));
+	threads.join_all();
+}
+
+// Fill the bins with a slice of the primitives
+class BinningJob {
+public:
+	void operator()() {
+		for (u_int i = 0; i < nbBins; ++i)
+			bins[i] = 0;
+
+		for (u_int i = start; i < end; i += step) {
+			u_int primIndex = primsIndexes[i];
 
+			const int binId = min(static_cast<int>(nbBins) - 1,
+					Floor2Int(k1 * (primsCentroids[primIndex][axis] - k0)));
+
+			bins[binId]++;
+			binsBbox[binId] = Union(binsBbox[binId], primsBboxes[primIndex]);
+		}
+	}
+
+	u_int start, end, step;
+	int axis;
+	u_int nbBins;
+	float k0, k1;
+	const u_int *primsIndexes;
+	const BBox *primsBboxes;
+	const Point *primsCentroids;
+
+	int bins[QBVH_MAX_BINS];
+	BBox binsBbox[QBVH_MAX_BINS];
+};
+
+// Stable partition of a slice of the primitives: the first pass counts
+// the primitives on the left side and computes the bounding boxes, the
+// second one copies the indices at their final position in sortedIndexes
+class PartitionJob {
+public:
+	void operator()() {
+		if (scatter) {
+			for (u_int i = start; i < end; ++i) {
+				const u_int primIndex = primsIndexes[i];
+
+				if (primsCentroids[primIndex][axis] <= splitPos)
+					sortedIndexes[leftOffset++] = primIndex;
+				else
+					sortedIndexes[rightOffset++] = primIndex;
+			}
+		} else {
+			nbLeft = 0;
+			for (u_int i = start; i < end; ++i) {
+				const u_int primIndex = primsIndexes[i];
+
+				if (primsCentroids[primIndex][axis] <= splitPos) {
+					++nbLeft;
+					leftChildBbox = Union(leftChildBbox, primsBboxes[primIndex]);
+					leftChildCentroidsBbox = Union(leftChildCentroidsBbox, primsCentroids[primIndex]);
+				} else {
+					rightChildBbox = Union(rightChildBbox, primsBboxes[primIndex]);
+					rightChildCentroidsBbox = Union(rightChildCentroidsBbox, primsCentroids[primIndex]);
+				}
+			}
+		}
+	}
+
+	bool scatter;
+	u_int start, end;
+	int axis;
+	float splitPos;
+	const u_int *primsIndexes;
+	const BBox *primsBboxes;
+	const Point *primsCentroids;
+	u_int *sortedIndexes;
+
+	u_int nbLeft, leftOffset, rightOffset;
+	BBox leftChildBbox, rightChildBbox;
+	BBox leftChildCentroidsBbox, rightChildCentroidsBbox;
+};
+
+// Create the QuadTriangles of a slice of the leaves
+class SwizzleJob {
+public:
+	void operator()() {
+		for (size_t l = first; l < last; ++l) {
+			// The last quad is padded with the last primitive of the leaf
+			const u_int *leafPrims = &primsIndexes[leaves[l].primOffset];
+			const u_int lastPrim = leaves[l].nbPrims - 1;
+			for (u_int q = 0; q < leaves[l].nbQuads; ++q) {
+				const u_int p = 4 * q;
+				if (indexedPrims)
+					new (&indexedPrims[leaves[l].firstQuad + q]) IndexedQuad(
+							leafPrims[min(p, lastPrim)], leafPrims[min(p + 1, lastPrim)],
+							leafPrims[min(p + 2, lastPrim)], leafPrims[min(p + 3, lastPrim)]);
+				else
+					new (&prims[leaves[l].firstQuad + q]) QuadTriangle(triangles, vertices,
+							leafPrims[min(p, lastPrim)], leafPrims[min(p + 1, lastPrim)],
+							leafPrims[min(p + 2, lastPrim)], leafPrims[min(p + 3, lastPrim)]);
+			}
+		}
+	}
+
+	size_t first, last;
+	const QBVHAccel::SwizzleTask *leaves;
+	const u_int *primsIndexes;
+	const Triangle *triangles;
+	const Point *vertices;
+	QuadTriangle *prims;
+	IndexedQuad *indexedPrims;
+};
+
+/***************************************************/
+
+static u_int EstimateNodeCount(const u_int nPrims, const u_int maxPrimsPerLeaf) {
 	// The number of nodes depends on the number of primitives,
 	// and is bounded by 2 * nPrims - 1.
 	// Even if there will normally have at least 4 primitives per leaf,
 	// it is not always the case => continue to use the normal bounds.
+	u_int count = 1;
+	for (u_int layer = ((nPrims + maxPrimsPerLeaf - 1) / maxPrimsPerLeaf + 3) / 4; layer > 1; layer = (layer + 3) / 4)
+		count += layer;
+
+	return count;
+}
+
+QBVHAccel::BuildNodes::BuildNodes(const u_int initialSize) {
 	nNodes = 0;
-	maxNodes = 1;
-	for (u_int layer = ((nPrims + maxPrimsPerLeaf - 1) / maxPrimsPerLeaf + 3) / 4; layer != 1; layer = (layer + 3) / 4)
-		maxNodes += layer;
+	maxNodes = max(initialSize, 1u);
 	nodes = AllocAligned<QBVHNode>(maxNodes);
 	for (u_int i = 0; i < maxNodes; ++i)
 		nodes[i] = QBVHNode();
+	nQuads = 0;
+}
+
+QBVHAccel::BuildNodes::~BuildNodes() {
+	FreeAligned(nodes);
+}
+
+/***************************************************/
+
+QBVHAccel::QBVHAccel(const unsigned int triangleCount, const Triangle *tris, const Point *verts,
+		u_int mp, u_int fst, u_int sf, const BuilderType builder, const bool compressNodes,
+		const std::string &cacheFileName, const u_int treeletPasses, const u_int nbBins,
+		const float traversalCost, const bool allAxes, const bool hugePages,
+		const bool indexedLeaves) : prims(NULL), indexedPrims(NULL), compressedNodes(NULL), instances(NULL), nInstances(0), leaves(NULL),
+		nLeaves(0), cacheRegion(NULL), fullSweepThreshold(fst), skipFactor(sf), maxPrimsPerLeaf(mp),
+		nbBins(Clamp(nbBins, 2u, (u_int)QBVH_MAX_BINS)), allAxes(allAxes),
+		traversalCost(max(traversalCost, 0.f)), treeletPasses(treeletPasses),
+		hugePages(hugePages), indexedLeaves(indexedLeaves) {
+	const double startTime = WallClockTime();
+
+	// Initialize primitives for _BVHAccel_
+	nPrims = triangleCount;
+	vertices = verts;
+	triangles = tris;
+	buildThreadCount = max(boost::thread::hardware_concurrency(), 1u);
+	builderType = builder;
+
+	if (cacheFileName.empty())
+		Build(builder);
+	else {
+		const boost::uint64_t key = CacheKey(builder);
+		if (!LoadCache(cacheFileName, key)) {
+			Build(builder);
+			SaveCache(cacheFileName, key);
+		}
+	}
+	buildSAHCost = SAHCost();
+	PrintBuildReport(WallClockTime() - startTime);
+
+	refitFirstNode = 0;
+	refitLastNode = nNodes;
+	refitFirstQuad = 0;
+	refitLastQuad = nQuads;
+
+	if (compressNodes) {
+		CompressNodes();
+		cerr << "QBVH compressed nodes: " << (sizeof(QBVHCompressedNode) * nNodes / 1024) <<
+				"Kb (" << (sizeof(QBVHNode) * nNodes / 1024) << "Kb uncompressed)" << endl;
+	}
+}
+
+void QBVHAccel::Build(const BuilderType builder) {
+	const double startTime = WallClockTime();
+
+	// Temporary data for building
+	u_int *primsIndexes = new u_int[nPrims];
 
 	// The arrays that will contain
 	// - the bounding boxes for all triangles
@@ -55,14 +258,15 @@ QBVHAccel::QBVHAccel(const unsigned int triangleCount, const Triangle *tris, con
 	Point *primsCentroids = new Point[nPrims];
 	// The bouding volume of all the centroids
 	BBox centroidsBbox;
+	worldBound = BBox();
 
 	// Fill each base array
-	for (u_int i = 0; i < triangleCount; ++i) {
+	for (u_int i = 0; i < nPrims; ++i) {
 		// This array will be reorganized during construction. 
 		primsIndexes[i] = i;
 
 		// Compute the bounding box for the triangle
-		primsBboxes[i] = triangles[i].WorldBound(verts);
+		primsBboxes[i] = triangles[i].WorldBound(vertices);
 		primsBboxes[i].Expand(RAY_EPSILON);
 		primsCentroids[i] = (primsBboxes[i].pMin + primsBboxes[i].pMax) * .5f;
 
@@ -71,23 +275,105 @@ QBVHAccel::QBVHAccel(const unsigned int triangleCount, const Triangle *tris, con
 		centroidsBbox = Union(centroidsBbox, primsCentroids[i]);
 	}
 
-	// Arbitrarily take the last primitive for the last 3
-	primsIndexes[nPrims] = nPrims - 1;
-	primsIndexes[nPrims + 1] = nPrims - 1;
-	primsIndexes[nPrims + 2] = nPrims - 1;
+	const char *builderName = (builder == SPLIT_BVH) ? "SBVH" :
+			((builder == LBVH) ? "LBVH" : "QBVH");
+	cerr << "Building " << builderName <<
+			", primitives: " << nPrims << ", threads: " << buildThreadCount << endl;
+
+	std::vector<BuildTask> tasks;
+	SBVHBuildState sbvhState;
+	const u_int *leavesPrimsIndexes = primsIndexes;
+	u_int leavesPrimsCount = nPrims;
+	if (builder == SPLIT_BVH) {
+		// The split BVH is built by a single thread, the leaves
+		// reference the primitives through their own array
+		BuildNodes top(EstimateNodeCount(nPrims, maxPrimsPerLeaf));
+		BuildSBVH(top, primsBboxes, sbvhState);
+		MergeTree(top, tasks);
+		leavesPrimsIndexes = &sbvhState.leafPrims[0];
+		leavesPrimsCount = sbvhState.leafPrims.size();
+	} else if (builder == LBVH) {
+		// The linear BVH sorts the primitives with all the threads, the
+		// tree is then built by a single one in a single pass
+		BuildNodes top(EstimateNodeCount(nPrims, maxPrimsPerLeaf));
+		BuildLBVH(top, primsIndexes, primsBboxes, primsCentroids, centroidsBbox);
+		MergeTree(top, tasks);
+	} else {
+		// Build the top of the tree, the subtrees are only collected
+		// in the tasks list
+		BuildNodes top(64);
+		BuildTree(top, 0, nPrims, primsIndexes, primsBboxes, primsCentroids,
+				worldBound, centroidsBbox, -1, 0, 0, &tasks);
+
+		// Build all the subtrees in parallel
+		u_int nextTask = 0;
+		boost::mutex taskMutex;
+		if (buildThreadCount == 1)
+			BuildTasksThread(this, &tasks, &nextTask, &taskMutex, primsIndexes, primsBboxes, primsCentroids);
+		else {
+			boost::thread_group threads;
+			for (u_int i = 0; i < buildThreadCount; ++i)
+				threads.create_thread(boost::bind(QBVHAccel::BuildTasksThread, this, &tasks,
+						&nextTask, &taskMutex, primsIndexes, primsBboxes, primsCentroids));
+			threads.join_all();
+		}
 
-	// Recursively build the tree
-	cerr << "Building QBVH, primitives: " << nPrims << ", initial nodes: " << maxNodes << endl;
+		MergeTree(top, tasks);
+	}
 
-	nQuads = 0;
-	BuildTree(0, nPrims, primsIndexes, primsBboxes, primsCentroids,
-			worldBound, centroidsBbox, -1, 0, 0);
+	if (treeletPasses > 0)
+		OptimizeTreelets();
+	ReorderNodes();
 
-	prims = AllocAligned<QuadTriangle>(nQuads);
+	// Convert the leaves
+	if (indexedLeaves)
+		indexedPrims = AllocArray<IndexedQuad>(nQuads);
+	else
+		prims = AllocArray<QuadTriangle>(nQuads);
 	nQuads = 0;
-	PreSwizzle(0, primsIndexes);
+	std::vector<SwizzleTask> swizzleTasks;
+	PreSwizzle(swizzleTasks);
+
+	// The leaves cover consecutive ranges of the primitive indices, the
+	// number of primitives of a leaf is the distance to the next range.
+	// Only the leaf primitives are used in the quads, so Refit() can
+	// compute the same bounding boxes of the build.
+	std::vector<u_int> leafOffsets(swizzleTasks.size());
+	for (size_t i = 0; i < swizzleTasks.size(); ++i)
+		leafOffsets[i] = swizzleTasks[i].primOffset;
+	std::sort(leafOffsets.begin(), leafOffsets.end());
+	for (size_t i = 0; i < swizzleTasks.size(); ++i) {
+		SwizzleTask &task = swizzleTasks[i];
+		const std::vector<u_int>::const_iterator next = std::upper_bound(
+				leafOffsets.begin(), leafOffsets.end(), task.primOffset);
+		const u_int end = (next == leafOffsets.end()) ? leavesPrimsCount : *next;
+		task.nbPrims = min(end - task.primOffset, 4 * task.nbQuads);
+	}
 
-	cerr << "QBVH completed with " << nNodes << "/" << maxNodes << " nodes" << endl;
+	const size_t jobCount = min<size_t>(buildThreadCount, max<size_t>(swizzleTasks.size(), 1));
+	std::vector<SwizzleJob> swizzleJobs(jobCount);
+	for (size_t i = 0; i < jobCount; ++i) {
+		swizzleJobs[i].first = swizzleTasks.size() * i / jobCount;
+		swizzleJobs[i].last = swizzleTasks.size() * (i + 1) / jobCount;
+		swizzleJobs[i].leaves = swizzleTasks.empty() ? NULL : &swizzleTasks[0];
+		swizzleJobs[i].primsIndexes = leavesPrimsIndexes;
+		swizzleJobs[i].triangles = triangles;
+		swizzleJobs[i].vertices = vertices;
+		swizzleJobs[i].prims = prims;
+		swizzleJobs[i].indexedPrims = indexedPrims;
+	}
+	RunJobs(swizzleJobs);
+
+	const double buildTime = WallClockTime() - startTime;
+	if (builder == SPLIT_BVH)
+		cerr << "SBVH completed with " << nNodes << " nodes, " << sbvhState.nRefs <<
+				" references and " << sbvhState.nSpatialSplits << " spatial splits in " <<
+				buildTime << " secs" << endl;
+	else if (builder == LBVH)
+		cerr << "LBVH completed with " << nNodes << " nodes in " << buildTime << " secs" << endl;
+	else
+		cerr << "QBVH completed with " << nNodes << " nodes and " << tasks.size() <<
+				" subtrees in " << buildTime << " secs" << endl;
 
 	// Release temporary memory
 	delete[] primsBboxes;
@@ -97,195 +383,410 @@ QBVHAccel::QBVHAccel(const unsigned int triangleCount, const Triangle *tris, con
 
 /***************************************************/
 
-void QBVHAccel::BuildTree(u_int start, u_int end, u_int *primsIndexes,
-		BBox *primsBboxes, Point *primsCentroids, const BBox &nodeBbox,
-		const BBox &centroidsBbox, int32_t parentIndex, int32_t childIndex, int depth) {
-	// Create a leaf ?
-	//********
-	if (end - start <= maxPrimsPerLeaf) {
-		CreateTempLeaf(parentIndex, childIndex, start, end, nodeBbox);
-		return;
-	}
+void QBVHAccel::BuildTasksThread(QBVHAccel *qbvh, std::vector<BuildTask> *tasks,
+		u_int *nextTask, boost::mutex *taskMutex, u_int *primsIndexes,
+		BBox *primsBboxes, Point *primsCentroids) {
+	for (;;) {
+		u_int taskIndex;
+		{
+			boost::mutex::scoped_lock lock(*taskMutex);
+			if (*nextTask >= tasks->size())
+				return;
+			taskIndex = (*nextTask)++;
+		}
 
-	int32_t currentNode = parentIndex;
-	int32_t leftChildIndex = childIndex;
-	int32_t rightChildIndex = childIndex + 1;
+		BuildTask &task = (*tasks)[taskIndex];
+		task.nodes = new BuildNodes(EstimateNodeCount(task.end - task.start,
+				qbvh->maxPrimsPerLeaf));
+		// The root of the subtree is always the node 0
+		qbvh->BuildTree(*task.nodes, task.start, task.end, primsIndexes, primsBboxes,
+				primsCentroids, task.nodeBbox, task.centroidsBbox, -1, 0, 0, NULL);
+	}
+}
 
-	// Number of primitives in each bin
-	int bins[NB_BINS];
-	// Bbox of the primitives in the bin
-	BBox binsBbox[NB_BINS];
-
-	//--------------
-	// Fill in the bins, considering all the primitives when a given
-	// threshold is reached, else considering only a portion of the
-	// primitives for the binned-SAH process. Also compute the bins bboxes
-	// for the primitives. 
-
-	for (u_int i = 0; i < NB_BINS; ++i)
-		bins[i] = 0;
-
-	u_int step = (end - start < fullSweepThreshold) ? 1 : skipFactor;
-
-	// Choose the split axis, taking the axis of maximum extent for the
-	// centroids (else weird cases can occur, where the maximum extent axis
-	// for the nodeBbox is an axis of 0 extent for the centroids one.).
-	const int axis = centroidsBbox.MaximumExtent();
-
-	// Precompute values that are constant with respect to the current
-	// primitive considered.
-	const float k0 = centroidsBbox.pMin[axis];
-	const float k1 = NB_BINS / (centroidsBbox.pMax[axis] - k0);
-
-	// If the bbox is a point, create a leaf, hoping there are not more
-	// than 64 primitives that share the same center.
-	if (k1 == INFINITY) {
-		if (end - start > 64)
-			cerr << "QBVH unable to handle geometry, too many primitives with the same centroid" << endl;
-		CreateTempLeaf(parentIndex, childIndex, start, end, nodeBbox);
-		return;
+void QBVHAccel::MergeTree(BuildNodes &top, std::vector<BuildTask> &tasks) {
+	nNodes = top.nNodes;
+	nQuads = top.nQuads;
+	nLeaves = top.leaves.size();
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		nNodes += tasks[i].nodes->nNodes;
+		nQuads += tasks[i].nodes->nQuads;
+		nLeaves += tasks[i].nodes->leaves.size();
 	}
 
-	// Create an intermediate node if the depth indicates to do so.
-	// Register the split axis.
-	if (depth % 2 == 0) {
-		currentNode = CreateIntermediateNode(parentIndex, childIndex, nodeBbox);
-		leftChildIndex = 0;
-		rightChildIndex = 2;
+	maxNodes = nNodes;
+	nodes = AllocAligned<QBVHNode>(maxNodes);
+	memcpy(nodes, top.nodes, sizeof(QBVHNode) * top.nNodes);
+	leaves = AllocAligned<QBVHLeaf>(max(nLeaves, 1u));
+	std::copy(top.leaves.begin(), top.leaves.end(), leaves);
+
+	u_int offset = top.nNodes;
+	u_int leafOffset = top.leaves.size();
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		BuildNodes *bn = tasks[i].nodes;
+		memcpy(&nodes[offset], bn->nodes, sizeof(QBVHNode) * bn->nNodes);
+		std::copy(bn->leaves.begin(), bn->leaves.end(), &leaves[leafOffset]);
+
+		// Relocate the references to the subtree nodes and leaves (the
+		// leaves are still referencing the primsIndexes array)
+		for (u_int n = offset; n < offset + bn->nNodes; ++n) {
+			for (int c = 0; c < 4; ++c) {
+				if (!nodes[n].ChildIsLeaf(c))
+					nodes[n].children[c] += offset;
+				else if (!nodes[n].LeafIsEmpty(c))
+					nodes[n].InitializeLeafIndex(c,
+							QBVHNode::LeafIndex(nodes[n].children[c]) + leafOffset);
+			}
+		}
+
+		// Attach the subtree to the top of the tree (the bounding box
+		// has been already set)
+		if (tasks[i].parentIndex >= 0)
+			nodes[tasks[i].parentIndex].children[tasks[i].childIndex] = offset;
+
+		offset += bn->nNodes;
+		leafOffset += bn->leaves.size();
+		delete bn;
 	}
+}
 
-	for (u_int i = start; i < end; i += step) {
-		u_int primIndex = primsIndexes[i];
+void QBVHAccel::ReorderNodes() {
+	// The old index of each node in the new order
+	std::vector<int32_t> order;
+	order.reserve(nNodes);
+
+	std::vector<int32_t> clusterRoots(1, 0);
+	std::vector<int32_t> cluster, nextRoots;
+	while (!clusterRoots.empty()) {
+		cluster.assign(1, clusterRoots.back());
+		clusterRoots.pop_back();
+
+		// Breadth first inside the cluster, the children that don't fit
+		// are the roots of the next clusters
+		nextRoots.clear();
+		for (size_t i = 0; i < cluster.size(); ++i) {
+			const QBVHNode &node = nodes[cluster[i]];
+			order.push_back(cluster[i]);
+			for (int c = 0; c < 4; ++c) {
+				if (node.ChildIsLeaf(c))
+					continue;
+				if (cluster.size() < QBVH_CLUSTER_NODES)
+					cluster.push_back(node.children[c]);
+				else
+					nextRoots.push_back(node.children[c]);
+			}
+		}
 
-		// Binning is relative to the centroids bbox and to the
-		// primitives' centroid.
-		const int binId = min(NB_BINS - 1, Floor2Int(k1 * (primsCentroids[primIndex][axis] - k0)));
+		// The first child is on the top of the stack, depth first order
+		clusterRoots.insert(clusterRoots.end(), nextRoots.rbegin(), nextRoots.rend());
+	}
+
+	std::vector<int32_t> newIndex(nNodes, -1);
+	for (size_t i = 0; i < order.size(); ++i)
+		newIndex[order[i]] = static_cast<int32_t>(i);
 
-		bins[binId]++;
-		binsBbox[binId] = Union(binsBbox[binId], primsBboxes[primIndex]);
+	QBVHNode *newNodes = AllocArray<QBVHNode>(order.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		newNodes[i] = nodes[order[i]];
+		for (int c = 0; c < 4; ++c) {
+			if (!newNodes[i].ChildIsLeaf(c))
+				newNodes[i].children[c] = newIndex[newNodes[i].children[c]];
+		}
 	}
 
-	//--------------
-	// Evaluate where to split.
+	FreeAligned(nodes);
+	nodes = newNodes;
+	nNodes = order.size();
+	maxNodes = nNodes;
+}
 
-	// Cumulative number of primitives in the bins from the first to the
-	// ith, and from the last to the ith.
-	int nbPrimsLeft[NB_BINS];
-	int nbPrimsRight[NB_BINS];
-	// The corresponding cumulative bounding boxes.
-	BBox bboxesLeft[NB_BINS];
-	BBox bboxesRight[NB_BINS];
+/***************************************************/
 
-	// The corresponding volumes.
-	float vLeft[NB_BINS];
-	float vRight[NB_BINS];
+void QBVHAccel::BuildTree(BuildNodes &bn, u_int start, u_int end, u_int *primsIndexes,
+		BBox *primsBboxes, Point *primsCentroids, const BBox &nodeBbox,
+		const BBox &centroidsBbox, int32_t parentIndex, int32_t childIndex, int depth,
+		std::vector<BuildTask> *tasks) {
+	// Create a leaf ?
+	//********
+	if (end - start <= maxPrimsPerLeaf) {
+		CreateTempLeaf(bn, parentIndex, childIndex, start, end, nodeBbox);
+		return;
+	}
 
-	BBox currentBboxLeft, currentBboxRight;
-	int currentNbLeft = 0, currentNbRight = 0;
+	// Leave the subtree to the thread pool ? It must start with a
+	// new node in order to be built separately.
+	if (tasks && (depth % 2 == 0) &&
+			(end - start <= max(nPrims / 64, (u_int)PARALLEL_SUBTREE_MIN_PRIMS))) {
+		BuildTask task;
+		task.start = start;
+		task.end = end;
+		task.nodeBbox = nodeBbox;
+		task.centroidsBbox = centroidsBbox;
+		task.parentIndex = parentIndex;
+		task.childIndex = childIndex;
+		task.nodes = NULL;
+		tasks->push_back(task);
+
+		if (parentIndex >= 0)
+			bn.nodes[parentIndex].SetBBox(childIndex, nodeBbox);
+		return;
+	}
 
-	for (int i = 0; i < NB_BINS; ++i) {
-		//-----
-		// Left side
-		// Number of prims
-		currentNbLeft += bins[i];
-		nbPrimsLeft[i] = currentNbLeft;
-		// Prims bbox
-		currentBboxLeft = Union(currentBboxLeft, binsBbox[i]);
-		bboxesLeft[i] = currentBboxLeft;
-		// Surface area
-		vLeft[i] = currentBboxLeft.SurfaceArea();
+	// Note: it doesn't depend on the number of threads, in order to always
+	// produce the same tree
+	const bool parallelSplit = tasks && (end - start > PARALLEL_SPLIT_THRESHOLD);
 
+	const u_int step = (end - start < fullSweepThreshold) ? 1 : skipFactor;
+	float splitPos, splitCost;
+	const int axis = FindBinnedSplit(start, end, step, primsIndexes, primsBboxes,
+			primsCentroids, centroidsBbox, parallelSplit, &splitPos, &splitCost);
 
-		//-----
-		// Right side
-		// Number of prims
-		int rightIndex = NB_BINS - 1 - i;
-		currentNbRight += bins[rightIndex];
-		nbPrimsRight[rightIndex] = currentNbRight;
-		// Prims bbox
-		currentBboxRight = Union(currentBboxRight, binsBbox[rightIndex]);
-		bboxesRight[rightIndex] = currentBboxRight;
-		// Surface area
-		vRight[rightIndex] = currentBboxRight.SurfaceArea();
+	// If the bbox is a point, create a leaf. With more than 64
+	// primitives sharing the same center, the leaves table is used.
+	if (axis < 0) {
+		CreateTempLeaf(bn, parentIndex, childIndex, start, end, nodeBbox);
+		return;
 	}
 
-	int minBin = -1;
-	float minCost = INFINITY;
-	// Find the best split axis,
-	// there must be at least a bin on the right side
-	for (int i = 0; i < NB_BINS - 1; ++i) {
-		float cost = vLeft[i] * nbPrimsLeft[i] +
-				vRight[i + 1] * nbPrimsRight[i + 1];
-		if (cost < minCost) {
-			minBin = i;
-			minCost = cost;
+	// Create a leaf if it is cheaper than the split, the costs are
+	// relative to the intersection of a quad
+	if ((traversalCost > 0.f) && (end - start <= QBVH_SAH_MAX_LEAF_PRIMS)) {
+		const float nodeArea = nodeBbox.SurfaceArea();
+		if (nodeArea * (end - start) <= 4.f * traversalCost * nodeArea + step * splitCost) {
+			CreateTempLeaf(bn, parentIndex, childIndex, start, end, nodeBbox);
+			return;
 		}
 	}
 
-	//-----------------
-	// Make the partition, in a "quicksort partitioning" way,
-	// the pivot being the position of the split plane
-	// (no more binId computation)
-	// track also the bboxes (primitives and centroids)
-	// for the left and right halves.
+	int32_t currentNode = parentIndex;
+	int32_t leftChildIndex = childIndex;
+	int32_t rightChildIndex = childIndex + 1;
 
-	// The split plane coordinate is the coordinate of the end of
-	// the chosen bin along the split axis
-	float splitPos = centroidsBbox.pMin[axis] + (minBin + 1) *
-			(centroidsBbox.pMax[axis] - centroidsBbox.pMin[axis]) / NB_BINS;
+	// Create an intermediate node if the depth indicates to do so.
+	// Register the split axis.
+	if (depth % 2 == 0) {
+		currentNode = CreateIntermediateNode(bn, parentIndex, childIndex, nodeBbox);
+		leftChildIndex = 0;
+		rightChildIndex = 2;
+
+		bn.nodes[currentNode].axisMain = axis;
+	} else if (childIndex == 0)
+		bn.nodes[currentNode].axisSubLeft = axis;
+	else
+		bn.nodes[currentNode].axisSubRight = axis;
 
 
 	BBox leftChildBbox, rightChildBbox;
 	BBox leftChildCentroidsBbox, rightChildCentroidsBbox;
 
 	u_int storeIndex = start;
-	for (u_int i = start; i < end; ++i) {
-		u_int primIndex = primsIndexes[i];
-
-		if (primsCentroids[primIndex][axis] <= splitPos) {
-			// Swap
-			primsIndexes[i] = primsIndexes[storeIndex];
-			primsIndexes[storeIndex] = primIndex;
-			++storeIndex;
-
-			// Update the bounding boxes,
-			// this triangle is on the left side
-			leftChildBbox = Union(leftChildBbox, primsBboxes[primIndex]);
-			leftChildCentroidsBbox = Union(leftChildCentroidsBbox, primsCentroids[primIndex]);
-		} else {
-			// Update the bounding boxes,
-			// this triangle is on the right side.
-			rightChildBbox = Union(rightChildBbox, primsBboxes[primIndex]);
-			rightChildCentroidsBbox = Union(rightChildCentroidsBbox, primsCentroids[primIndex]);
+	if (parallelSplit) {
+		// Use a stable partition, the result doesn't depend on how the
+		// primitives are distributed among the threads
+		std::vector<PartitionJob> jobs(buildThreadCount);
+		for (u_int j = 0; j < buildThreadCount; ++j) {
+			jobs[j].scatter = false;
+			jobs[j].start = start + (end - start) * j / buildThreadCount;
+			jobs[j].end = start + (end - start) * (j + 1) / buildThreadCount;
+			jobs[j].axis = axis;
+			jobs[j].splitPos = splitPos;
+			jobs[j].primsIndexes = primsIndexes;
+			jobs[j].primsBboxes = primsBboxes;
+			jobs[j].primsCentroids = primsCentroids;
+		}
+		RunJobs(jobs);
+
+		u_int nbLeft = 0;
+		for (u_int j = 0; j < buildThreadCount; ++j)
+			nbLeft += jobs[j].nbLeft;
+
+		u_int *sortedIndexes = new u_int[end - start];
+		u_int leftOffset = 0;
+		u_int rightOffset = nbLeft;
+		for (u_int j = 0; j < buildThreadCount; ++j) {
+			jobs[j].scatter = true;
+			jobs[j].sortedIndexes = sortedIndexes;
+			jobs[j].leftOffset = leftOffset;
+			jobs[j].rightOffset = rightOffset;
+			leftOffset += jobs[j].nbLeft;
+			rightOffset += (jobs[j].end - jobs[j].start) - jobs[j].nbLeft;
+
+			leftChildBbox = Union(leftChildBbox, jobs[j].leftChildBbox);
+			leftChildCentroidsBbox = Union(leftChildCentroidsBbox, jobs[j].leftChildCentroidsBbox);
+			rightChildBbox = Union(rightChildBbox, jobs[j].rightChildBbox);
+			rightChildCentroidsBbox = Union(rightChildCentroidsBbox, jobs[j].rightChildCentroidsBbox);
+		}
+		RunJobs(jobs);
+
+		memcpy(&primsIndexes[start], sortedIndexes, sizeof(u_int) * (end - start));
+		delete[] sortedIndexes;
+		storeIndex = start + nbLeft;
+	} else {
+		for (u_int i = start; i < end; ++i) {
+			u_int primIndex = primsIndexes[i];
+
+			if (primsCentroids[primIndex][axis] <= splitPos) {
+				// Swap
+				primsIndexes[i] = primsIndexes[storeIndex];
+				primsIndexes[storeIndex] = primIndex;
+				++storeIndex;
+
+				// Update the bounding boxes,
+				// this triangle is on the left side
+				leftChildBbox = Union(leftChildBbox, primsBboxes[primIndex]);
+				leftChildCentroidsBbox = Union(leftChildCentroidsBbox, primsCentroids[primIndex]);
+			} else {
+				// Update the bounding boxes,
+				// this triangle is on the right side.
+				rightChildBbox = Union(rightChildBbox, primsBboxes[primIndex]);
+				rightChildCentroidsBbox = Union(rightChildCentroidsBbox, primsCentroids[primIndex]);
+			}
 		}
 	}
 
 	// Build recursively
-	BuildTree(start, storeIndex, primsIndexes, primsBboxes, primsCentroids,
+	BuildTree(bn, start, storeIndex, primsIndexes, primsBboxes, primsCentroids,
 			leftChildBbox, leftChildCentroidsBbox, currentNode,
-			leftChildIndex, depth + 1);
-	BuildTree(storeIndex, end, primsIndexes, primsBboxes, primsCentroids,
+			leftChildIndex, depth + 1, tasks);
+	BuildTree(bn, storeIndex, end, primsIndexes, primsBboxes, primsCentroids,
 			rightChildBbox, rightChildCentroidsBbox, currentNode,
-			rightChildIndex, depth + 1);
+			rightChildIndex, depth + 1, tasks);
 }
 
 /***************************************************/
 
-void QBVHAccel::CreateTempLeaf(int32_t parentIndex, int32_t childIndex,
+int QBVHAccel::FindBinnedSplit(u_int start, u_int end, u_int step,
+		const u_int *primsIndexes, const BBox *primsBboxes,
+		const Point *primsCentroids, const BBox &centroidsBbox,
+		const bool parallelSplit, float *splitPos, float *splitCost) const {
+	int bestAxis = -1;
+	*splitCost = INFINITY;
+
+	// Try the axis of maximum extent for the centroids (else weird cases
+	// can occur, where the maximum extent axis for the nodeBbox is an axis
+	// of 0 extent for the centroids one.), or all the axes
+	const int maxAxis = centroidsBbox.MaximumExtent();
+	for (int axis = 0; axis < 3; ++axis) {
+		if (!allAxes && (axis != maxAxis))
+			continue;
+
+		// Precompute values that are constant with respect to the current
+		// primitive considered.
+		const float k0 = centroidsBbox.pMin[axis];
+		const float k1 = nbBins / (centroidsBbox.pMax[axis] - k0);
+		if (k1 == INFINITY)
+			continue;
+
+		// Number of primitives in each bin
+		int bins[QBVH_MAX_BINS];
+		// Bbox of the primitives in the bin
+		BBox binsBbox[QBVH_MAX_BINS];
+
+		//--------------
+		// Fill in the bins, considering all the primitives when a given
+		// threshold is reached, else considering only a portion of the
+		// primitives for the binned-SAH process. Also compute the bins bboxes
+		// for the primitives.
+
+		for (u_int i = 0; i < nbBins; ++i)
+			bins[i] = 0;
+
+		if (parallelSplit) {
+			// Each job starts with a multiple of step in order to
+			// sample the same primitives of the serial version
+			const u_int sampleCount = (end - start + step - 1) / step;
+			std::vector<BinningJob> jobs(buildThreadCount);
+			for (u_int j = 0; j < buildThreadCount; ++j) {
+				jobs[j].start = start + step * (sampleCount * j / buildThreadCount);
+				jobs[j].end = min(end, start + step * (sampleCount * (j + 1) / buildThreadCount));
+				jobs[j].step = step;
+				jobs[j].axis = axis;
+				jobs[j].nbBins = nbBins;
+				jobs[j].k0 = k0;
+				jobs[j].k1 = k1;
+				jobs[j].primsIndexes = primsIndexes;
+				jobs[j].primsBboxes = primsBboxes;
+				jobs[j].primsCentroids = primsCentroids;
+			}
+			RunJobs(jobs);
+
+			for (u_int j = 0; j < buildThreadCount; ++j) {
+				for (u_int i = 0; i < nbBins; ++i) {
+					bins[i] += jobs[j].bins[i];
+					binsBbox[i] = Union(binsBbox[i], jobs[j].binsBbox[i]);
+				}
+			}
+		} else {
+			for (u_int i = start; i < end; i += step) {
+				u_int primIndex = primsIndexes[i];
+
+				// Binning is relative to the centroids bbox and to the
+				// primitives' centroid.
+				const int binId = min(static_cast<int>(nbBins) - 1,
+						Floor2Int(k1 * (primsCentroids[primIndex][axis] - k0)));
+
+				bins[binId]++;
+				binsBbox[binId] = Union(binsBbox[binId], primsBboxes[primIndex]);
+			}
+		}
+
+		//--------------
+		// Evaluate where to split.
+
+		// The surface area multiplied by the cumulative number of
+		// primitives in the bins from the last to the ith
+		float costsRight[QBVH_MAX_BINS];
+		BBox currentBboxRight;
+		int currentNbRight = 0;
+		for (int i = nbBins - 1; i > 0; --i) {
+			currentNbRight += bins[i];
+			currentBboxRight = Union(currentBboxRight, binsBbox[i]);
+			costsRight[i] = currentNbRight ?
+				(currentBboxRight.SurfaceArea() * currentNbRight) : INFINITY;
+		}
+
+		// Find the best split position, there must be at least a bin on
+		// each side
+		BBox currentBboxLeft;
+		int currentNbLeft = 0;
+		for (u_int i = 0; i < nbBins - 1; ++i) {
+			currentNbLeft += bins[i];
+			currentBboxLeft = Union(currentBboxLeft, binsBbox[i]);
+			if (currentNbLeft == 0)
+				continue;
+
+			const float cost = currentBboxLeft.SurfaceArea() * currentNbLeft +
+					costsRight[i + 1];
+			if (cost < *splitCost) {
+				bestAxis = axis;
+				*splitCost = cost;
+				// The split plane coordinate is the coordinate of the end
+				// of the chosen bin along the split axis
+				*splitPos = k0 + (i + 1) * (centroidsBbox.pMax[axis] - k0) / nbBins;
+			}
+		}
+	}
+
+	return bestAxis;
+}
+
+/***************************************************/
+
+void QBVHAccel::CreateTempLeaf(BuildNodes &bn, int32_t parentIndex, int32_t childIndex,
 		u_int start, u_int end, const BBox &nodeBbox) {
 	// The leaf is directly encoded in the intermediate node.
 	if (parentIndex < 0) {
 		// The entire tree is a leaf
-		nNodes = 1;
+		bn.nNodes = 1;
 		parentIndex = 0;
 	}
 
-	// Encode the leaf in the original way,
+	// The leaf is stored in the table with its range of primitives,
 	// it will be transformed to a preswizzled format in a post-process.
 
 	u_int nbPrimsTotal = end - start;
 
-	QBVHNode &node = nodes[parentIndex];
+	QBVHNode &node = bn.nodes[parentIndex];
 
 	node.SetBBox(childIndex, nodeBbox);
 
@@ -293,41 +794,92 @@ void QBVHAccel::CreateTempLeaf(int32_t parentIndex, int32_t childIndex,
 	// Next multiple of 4, divided by 4
 	u_int quads = (nbPrimsTotal + 3) / 4;
 
-	// Use the same encoding as the final one, but with a different meaning.
-	node.InitializeLeaf(childIndex, quads, start);
+	if (quads == 0)
+		node.children[childIndex] = QBVHNode::emptyLeafNode;
+	else {
+		QBVHLeaf leaf;
+		leaf.firstQuad = start;
+		leaf.nbQuads = quads;
+		node.InitializeLeafIndex(childIndex, bn.leaves.size());
+		bn.leaves.push_back(leaf);
+	}
 
-	nQuads += quads;
+	bn.nQuads += quads;
 }
 
-void QBVHAccel::PreSwizzle(int32_t nodeIndex, u_int *primsIndexes) {
-	for (int i = 0; i < 4; ++i) {
-		if (nodes[nodeIndex].ChildIsLeaf(i))
-			CreateSwizzledLeaf(nodeIndex, i, primsIndexes);
-		else
-			PreSwizzle(nodes[nodeIndex].children[i], primsIndexes);
+void QBVHAccel::PreSwizzle(std::vector<SwizzleTask> &swizzleTasks) {
+	// The leaves are encoded in the nodes when the index of the first
+	// quad and the number of quads fit in the 31 bits
+	size_t totalQuads = 0;
+	bool compact = true;
+	for (u_int n = 0; n < nNodes; ++n) {
+		for (int i = 0; i < 4; ++i) {
+			if (!nodes[n].ChildIsLeaf(i) || nodes[n].LeafIsEmpty(i))
+				continue;
+
+			const u_int nbQuads = leaves[QBVHNode::LeafIndex(nodes[n].children[i])].nbQuads;
+			totalQuads += nbQuads;
+			compact &= (nbQuads <= QBVH_COMPACT_LEAF_MAX_QUADS);
+		}
 	}
+	compact &= (totalQuads <= QBVH_COMPACT_MAX_QUADS);
+
+	std::vector<QBVHLeaf> table;
+	for (u_int n = 0; n < nNodes; ++n) {
+		for (int i = 0; i < 4; ++i) {
+			if (nodes[n].ChildIsLeaf(i))
+				CreateSwizzledLeaf(n, i, swizzleTasks, compact ? NULL : &table);
+		}
+	}
+
+	SetLeaves(compact ? NULL : &table);
+	if (!compact)
+		cerr << "QBVH leaves table used for " << nLeaves << " leaves" << endl;
 }
 
 void QBVHAccel::CreateSwizzledLeaf(int32_t parentIndex, int32_t childIndex,
-		u_int *primsIndexes) {
+		std::vector<SwizzleTask> &swizzleTasks, std::vector<QBVHLeaf> *table) {
 	QBVHNode &node = nodes[parentIndex];
 	if (node.LeafIsEmpty(childIndex))
 		return;
 	const u_int startQuad = nQuads;
-	const u_int nbQuads = node.NbQuadsInLeaf(childIndex);
+	const QBVHLeaf &leaf = leaves[QBVHNode::LeafIndex(node.children[childIndex])];
+	const u_int nbQuads = leaf.nbQuads;
 
-	u_int primOffset = node.FirstQuadIndexForLeaf(childIndex);
-	u_int primNum = nQuads;
+	// The QuadTriangles are created later, in parallel
+	SwizzleTask task;
+	task.firstQuad = startQuad;
+	task.nbQuads = nbQuads;
+	task.primOffset = leaf.firstQuad;
+	swizzleTasks.push_back(task);
 
-	for (u_int q = 0; q < nbQuads; ++q) {
-		new (&prims[primNum]) QuadTriangle(triangles, vertices, primsIndexes[primOffset],
-				primsIndexes[primOffset + 1], primsIndexes[primOffset + 2], primsIndexes[primOffset + 3]);
+	nQuads += nbQuads;
+	EncodeLeaf(node, childIndex, startQuad, nbQuads, table);
+}
 
-		++primNum;
-		primOffset += 4;
+void QBVHAccel::EncodeLeaf(QBVHNode &node, int i, u_int firstQuad, u_int nbQuads,
+		std::vector<QBVHLeaf> *table) {
+	if (!table || (nbQuads == 0))
+		node.InitializeLeaf(i, nbQuads, firstQuad);
+	else {
+		QBVHLeaf leaf;
+		leaf.firstQuad = firstQuad;
+		leaf.nbQuads = nbQuads;
+		node.InitializeLeafIndex(i, table->size());
+		table->push_back(leaf);
+	}
+}
+
+void QBVHAccel::SetLeaves(const std::vector<QBVHLeaf> *table) {
+	FreeAligned(leaves);
+	if (table) {
+		nLeaves = table->size();
+		leaves = AllocAligned<QBVHLeaf>(max(nLeaves, 1u));
+		std::copy(table->begin(), table->end(), leaves);
+	} else {
+		nLeaves = 0;
+		leaves = NULL;
 	}
-	nQuads += nbQuads;
-	node.InitializeLeaf(childIndex, nbQuads, startQuad);
 }
 
 int32_t QBVHNode::BBoxIntersect(const QuadRay &ray4, const __m128 invDir[3],
@@ -357,9 +909,247 @@ int32_t QBVHNode::BBoxIntersect(const QuadRay &ray4, const __m128 invDir[3],
 	return _mm_movemask_ps(_mm_cmpge_ps(tMax, tMin));
 }
 
+int32_t QBVHNode::FrustumIntersect(const __m128 orig[3],
+		const __m128 invDirMin[3], const __m128 invDirMax[3],
+		const int sign[3], const __m128 &mint, const __m128 &maxt) const {
+	__m128 tMin = mint;
+	__m128 tMax = maxt;
+
+	// The entry distance of each ray is at least the smallest one of the
+	// frustum, the exit distance at most the largest one
+	for (int axis = 0; axis < 3; ++axis) {
+		const __m128 nearDist = _mm_sub_ps(bboxes[sign[axis]][axis], orig[axis]);
+		const __m128 farDist = _mm_sub_ps(bboxes[1 - sign[axis]][axis], orig[axis]);
+
+		tMin = _mm_max_ps(tMin, _mm_min_ps(_mm_mul_ps(nearDist, invDirMin[axis]),
+				_mm_mul_ps(nearDist, invDirMax[axis])));
+		tMax = _mm_min_ps(tMax, _mm_max_ps(_mm_mul_ps(farDist, invDirMin[axis]),
+				_mm_mul_ps(farDist, invDirMax[axis])));
+	}
+
+	//return the visit flags
+	return _mm_movemask_ps(_mm_cmpge_ps(tMax, tMin));
+}
+
+/***************************************************/
+
+QBVHCompressedNode::QBVHCompressedNode(const QBVHNode &node) {
+	for (int i = 0; i < 4; ++i)
+		children[i] = node.children[i];
+	axisMain = static_cast<unsigned char>(node.axisMain);
+	axisSubLeft = static_cast<unsigned char>(node.axisSubLeft);
+	axisSubRight = static_cast<unsigned char>(node.axisSubRight);
+	for (int i = 0; i < 6; ++i)
+		pad[i] = 0;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const float *pMin = reinterpret_cast<const float *>(&(node.bboxes[0][axis]));
+		const float *pMax = reinterpret_cast<const float *>(&(node.bboxes[1][axis]));
+
+		// The grid covers the union of the children
+		float lo = INFINITY;
+		float hi = -INFINITY;
+		for (int i = 0; i < 4; ++i) {
+			if (node.ChildIsLeaf(i) && node.LeafIsEmpty(i))
+				continue;
+			lo = min(lo, pMin[i]);
+			hi = max(hi, pMax[i]);
+		}
+		if (lo > hi)
+			lo = hi = 0.f;
+
+		// The smallest power of 2 cell size covering the node with
+		// 255 cells, checked with the same arithmetic of the decoding
+		int e = -126;
+		if (hi > lo) {
+			frexpf((hi - lo) / 255.f, &e);
+			e = max(e, -126);
+		}
+		while ((e < 127) && (lo + 255.f * ldexpf(1.f, e) < hi))
+			++e;
+
+		origin[axis] = lo;
+		exponent[axis] = static_cast<boost::int8_t>(e);
+		const float scale = ldexpf(1.f, e);
+
+		for (int i = 0; i < 4; ++i) {
+			if (node.ChildIsLeaf(i) && node.LeafIsEmpty(i)) {
+				qbboxes[0][axis][i] = 255;
+				qbboxes[1][axis][i] = 0;
+				continue;
+			}
+
+			// Round outward, the decoded box must contain the original one
+			int qMin = Clamp(Floor2Int((pMin[i] - lo) / scale), 0, 255);
+			while ((qMin > 0) && (lo + qMin * scale > pMin[i]))
+				--qMin;
+			int qMax = Clamp(Ceil2Int((pMax[i] - lo) / scale), qMin, 255);
+			while ((qMax < 255) && (lo + qMax * scale < pMax[i]))
+				++qMax;
+
+			qbboxes[0][axis][i] = static_cast<unsigned char>(qMin);
+			qbboxes[1][axis][i] = static_cast<unsigned char>(qMax);
+		}
+	}
+}
+
+void QBVHCompressedNode::Decompress(QBVHNode *node) const {
+	*node = QBVHNode();
+	for (int i = 0; i < 4; ++i)
+		node->children[i] = children[i];
+	node->axisMain = axisMain;
+	node->axisSubLeft = axisSubLeft;
+	node->axisSubRight = axisSubRight;
+
+	for (int i = 0; i < 4; ++i) {
+		if (node->ChildIsLeaf(i) && node->LeafIsEmpty(i))
+			continue;
+
+		BBox bbox;
+		for (int axis = 0; axis < 3; ++axis) {
+			const float scale = ldexpf(1.f, exponent[axis]);
+			bbox.pMin[axis] = origin[axis] + qbboxes[0][axis][i] * scale;
+			bbox.pMax[axis] = origin[axis] + qbboxes[1][axis][i] * scale;
+		}
+		node->SetBBox(i, bbox);
+	}
+}
+
+// Decode 4 grid coordinates: origin + q * 2^exponent
+static inline __m128 DecodeCoords(const unsigned char q[4], const float origin,
+		const boost::int8_t exponent) {
+	// A single 32 bit load, without aliasing q as an int32_t
+	int32_t packed;
+	memcpy(&packed, q, sizeof(int32_t));
+
+	const __m128i zero = _mm_setzero_si128();
+	__m128i qi = _mm_cvtsi32_si128(packed);
+	qi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(qi, zero), zero);
+	const __m128 scale = _mm_castsi128_ps(_mm_set1_epi32((exponent + 127) << 23));
+
+	return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(qi), scale));
+}
+
+int32_t QBVHCompressedNode::BBoxIntersect(const QuadRay &ray4, const __m128 invDir[3],
+		const int sign[3]) const {
+	__m128 tMin = ray4.mint;
+	__m128 tMax = ray4.maxt;
+
+	// X coordinate
+	tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[sign[0]][0],
+			origin[0], exponent[0]), ray4.ox), invDir[0]));
+	tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[1 - sign[0]][0],
+			origin[0], exponent[0]), ray4.ox), invDir[0]));
+
+	// Y coordinate
+	tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[sign[1]][1],
+			origin[1], exponent[1]), ray4.oy), invDir[1]));
+	tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[1 - sign[1]][1],
+			origin[1], exponent[1]), ray4.oy), invDir[1]));
+
+	// Z coordinate
+	tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[sign[2]][2],
+			origin[2], exponent[2]), ray4.oz), invDir[2]));
+	tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(DecodeCoords(qbboxes[1 - sign[2]][2],
+			origin[2], exponent[2]), ray4.oz), invDir[2]));
+
+	//return the visit flags
+	return _mm_movemask_ps(_mm_cmpge_ps(tMax, tMin));
+}
+
+void QBVHAccel::CompressNodes() {
+	FreeAligned(compressedNodes);
+	compressedNodes = AllocArray<QBVHCompressedNode>(nNodes);
+	for (u_int i = 0; i < nNodes; ++i)
+		compressedNodes[i] = QBVHCompressedNode(nodes[i]);
+
+	// The nodes loaded from a cache are in the mapped file, their pages
+	// are never read again
+	if (!cacheRegion)
+		FreeAligned(nodes);
+	nodes = NULL;
+}
+
+void QBVHAccel::DecompressNodes() {
+	nodes = AllocAligned<QBVHNode>(nNodes);
+	for (u_int i = 0; i < nNodes; ++i)
+		compressedNodes[i].Decompress(&nodes[i]);
+}
+
+void QBVHAccel::RecompressNodes() {
+	// The decoded boxes are larger than the refitted ones, only the
+	// compressed nodes can tell what changed
+	const u_int firstNode = refitFirstNode;
+	const u_int lastNode = refitLastNode;
+	refitFirstNode = nNodes;
+	refitLastNode = 0;
+	for (u_int i = firstNode; i < lastNode; ++i) {
+		const QBVHCompressedNode node(nodes[i]);
+		if (memcmp(&node, &compressedNodes[i], sizeof(QBVHCompressedNode)) != 0) {
+			compressedNodes[i] = node;
+			refitFirstNode = min(refitFirstNode, i);
+			refitLastNode = i + 1;
+		}
+	}
+
+	FreeAligned(nodes);
+	nodes = NULL;
+}
+
 /***************************************************/
 
-void QBVHAccel::Intersect(const Ray &ray, RayHit *rayHit) const {
+#if defined(QBVH_TRAVERSAL_STATS)
+// Count the visit of an inner node, after its children have been pushed
+template<class NodeType> static inline void CountNodeVisit(const NodeType &node,
+		const int todoNode, QBVHTraversalStats *stats) {
+	++stats->nodesVisited;
+	for (int i = 0; i < 4; ++i) {
+		if (!QBVHNode::IsEmpty(node.children[i]))
+			++stats->boxesTested;
+	}
+	stats->maxStackDepth = max(stats->maxStackDepth, static_cast<u_int>(todoNode + 1));
+}
+#endif
+
+void QBVHAccel::Intersect(const Ray &ray, RayHit *rayHit,
+		QBVHTraversalStats *stats) const {
+#if defined(QBVH_TRAVERSAL_STATS)
+	if (stats)
+		++stats->rayCount;
+#endif
+
+	if (instances) {
+		if (compressedNodes)
+			IntersectInstancesTree(compressedNodes, ray, rayHit, stats);
+		else
+			IntersectInstancesTree(nodes, ray, rayHit, stats);
+	} else if (compressedNodes)
+		IntersectTree(compressedNodes, 0, ray, rayHit, stats);
+	else
+		IntersectTree(nodes, 0, ray, rayHit, stats);
+}
+
+bool QBVHAccel::IntersectP(const Ray &ray, RayHit *rayHit,
+		QBVHTraversalStats *stats) const {
+#if defined(QBVH_TRAVERSAL_STATS)
+	if (stats)
+		++stats->rayCount;
+#endif
+
+	if (instances) {
+		if (compressedNodes)
+			return IntersectPInstancesTree(compressedNodes, ray, rayHit, stats);
+		else
+			return IntersectPInstancesTree(nodes, ray, rayHit, stats);
+	} else if (compressedNodes)
+		return IntersectPTree(compressedNodes, 0, ray, rayHit, stats);
+	else
+		return IntersectPTree(nodes, 0, ray, rayHit, stats);
+}
+
+template<class NodeType> void QBVHAccel::IntersectTree(const NodeType *treeNodes,
+		const int32_t rootNode, const Ray &ray, RayHit *rayHit,
+		QBVHTraversalStats *stats) const {
 	//------------------------------
 	// Prepare the ray for intersection
 	QuadRay ray4(ray);
@@ -375,82 +1165,346 @@ void QBVHAccel::Intersect(const Ray &ray, RayHit *rayHit) const {
 	// Main loop
 	int todoNode = 0; // the index in the stack
 	int32_t nodeStack[64];
-	nodeStack[0] = 0; // first node to handle: root node
+	nodeStack[0] = rootNode; // first node to handle: root node
 
 	while (todoNode >= 0) {
 		// Leaves are identified by a negative index
 		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
-			QBVHNode &node = nodes[nodeStack[todoNode]];
+			const NodeType &node = treeNodes[nodeStack[todoNode]];
 			--todoNode;
 
 
 			// It is quite strange but checking here for empty nodes sloaws down the rendering
 			const int32_t visit = node.BBoxIntersect(ray4, invDir, signs);
 
-			switch (visit) {
-				case (0x1 | 0x0 | 0x0 | 0x0):
-					nodeStack[++todoNode] = node.children[0];
-					break;
-				case (0x0 | 0x2 | 0x0 | 0x0):
-					nodeStack[++todoNode] = node.children[1];
-					break;
-				case (0x1 | 0x2 | 0x0 | 0x0):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[1];
-					break;
-				case (0x0 | 0x0 | 0x4 | 0x0):
-					nodeStack[++todoNode] = node.children[2];
-					break;
-				case (0x1 | 0x0 | 0x4 | 0x0):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[2];
-					break;
-				case (0x0 | 0x2 | 0x4 | 0x0):
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[2];
-					break;
-				case (0x1 | 0x2 | 0x4 | 0x0):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[2];
+			// Push the children farthest first, so the nearest one is
+			// visited next and ray.maxt shrinks as soon as possible
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
 					break;
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
+			}
+#if defined(QBVH_TRAVERSAL_STATS)
+			if (stats)
+				CountNodeVisit(node, todoNode, stats);
+#endif
+		} else {
+			//----------------------
+			// It is a leaf,
+			// all the informations are encoded in the index
+			const int32_t leafData = nodeStack[todoNode];
+			--todoNode;
 
-				case (0x0 | 0x0 | 0x0 | 0x8):
-					nodeStack[++todoNode] = node.children[3];
-					break;
-				case (0x1 | 0x0 | 0x0 | 0x8):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[3];
-					break;
-				case (0x0 | 0x2 | 0x0 | 0x8):
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[3];
-					break;
-				case (0x1 | 0x2 | 0x0 | 0x8):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[3];
-					break;
-				case (0x0 | 0x0 | 0x4 | 0x8):
-					nodeStack[++todoNode] = node.children[2];
-					nodeStack[++todoNode] = node.children[3];
+			if (QBVHNode::IsEmpty(leafData))
+				continue;
+
+			// Perform intersection
+			u_int offset, nbQuadPrimitives;
+			DecodeLeaf(leafData, &offset, &nbQuadPrimitives);
+			QuadTriangle quad;
+#if defined(QBVH_TRAVERSAL_STATS)
+			if (stats)
+				stats->quadsTested += nbQuadPrimitives;
+#endif
+
+			for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber)
+				LeafQuad(primNumber, &quad).Intersect(ray4, ray, rayHit);
+		}//end of the else
+	}
+}
+
+/***************************************************/
+
+template<class NodeType> bool QBVHAccel::IntersectPTree(const NodeType *treeNodes,
+		const int32_t rootNode, const Ray &ray, RayHit *rayHit,
+		QBVHTraversalStats *stats) const {
+	//------------------------------
+	// Prepare the ray for intersection
+	QuadRay ray4(ray);
+	__m128 invDir[3];
+	invDir[0] = _mm_set1_ps(1.f / ray.d.x);
+	invDir[1] = _mm_set1_ps(1.f / ray.d.y);
+	invDir[2] = _mm_set1_ps(1.f / ray.d.z);
+
+	int signs[3];
+	ray.GetDirectionSigns(signs);
+
+	//------------------------------
+	// Main loop
+	int todoNode = 0; // the index in the stack
+	int32_t nodeStack[64];
+	nodeStack[0] = rootNode; // first node to handle: root node
+
+	while (todoNode >= 0) {
+		// Leaves are identified by a negative index
+		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
+			const NodeType &node = treeNodes[nodeStack[todoNode]];
+			--todoNode;
+
+			const int32_t visit = node.BBoxIntersect(ray4, invDir, signs);
+
+			// The front to back order is still useful to find an
+			// occluder sooner
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
 					break;
-				case (0x1 | 0x0 | 0x4 | 0x8):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[2];
-					nodeStack[++todoNode] = node.children[3];
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
+			}
+#if defined(QBVH_TRAVERSAL_STATS)
+			if (stats)
+				CountNodeVisit(node, todoNode, stats);
+#endif
+		} else {
+			//----------------------
+			// It is a leaf,
+			// all the informations are encoded in the index
+			const int32_t leafData = nodeStack[todoNode];
+			--todoNode;
+
+			if (QBVHNode::IsEmpty(leafData))
+				continue;
+
+			// Perform intersection
+			u_int offset, nbQuadPrimitives;
+			DecodeLeaf(leafData, &offset, &nbQuadPrimitives);
+			QuadTriangle quad;
+
+			for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber) {
+#if defined(QBVH_TRAVERSAL_STATS)
+				if (stats)
+					++stats->quadsTested;
+#endif
+				if (LeafQuad(primNumber, &quad).IntersectP(ray4, rayHit))
+					return true;
+			}
+		}//end of the else
+	}
+
+	return false;
+}
+
+/***************************************************/
+
+template<class NodeType> void QBVHAccel::IntersectInstancesTree(const NodeType *treeNodes,
+		const Ray &ray, RayHit *rayHit, QBVHTraversalStats *stats) const {
+	QuadRay ray4(ray);
+	__m128 invDir[3];
+	invDir[0] = _mm_set1_ps(1.f / ray.d.x);
+	invDir[1] = _mm_set1_ps(1.f / ray.d.y);
+	invDir[2] = _mm_set1_ps(1.f / ray.d.z);
+
+	int signs[3];
+	ray.GetDirectionSigns(signs);
+
+	int todoNode = 0;
+	int32_t nodeStack[64];
+	nodeStack[0] = 0;
+
+	while (todoNode >= 0) {
+		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
+			const NodeType &node = treeNodes[nodeStack[todoNode]];
+			--todoNode;
+
+			const int32_t visit = node.BBoxIntersect(ray4, invDir, signs);
+
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
 					break;
-				case (0x0 | 0x2 | 0x4 | 0x8):
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[2];
-					nodeStack[++todoNode] = node.children[3];
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
+			}
+#if defined(QBVH_TRAVERSAL_STATS)
+			if (stats)
+				CountNodeVisit(node, todoNode, stats);
+#endif
+		} else {
+			// A leaf of the top level, with a range of instances
+			const int32_t leafData = nodeStack[todoNode];
+			--todoNode;
+
+			if (QBVHNode::IsEmpty(leafData))
+				continue;
+
+			u_int offset, nbInstances;
+			DecodeLeaf(leafData, &offset, &nbInstances);
+
+			for (u_int i = offset; i < offset + nbInstances; ++i) {
+				const QBVHInstance &instance = instances[i];
+
+				// The distances are the same in the instance space, so
+				// the local ray is clipped by the closest hit found so far
+				const Ray localRay = instance.ToLocal(ray);
+				RayHit localHit;
+				localHit.index = 0xffffffffu;
+				IntersectTree(treeNodes, instance.rootNode, localRay, &localHit, stats);
+
+				if (localHit.index != 0xffffffffu) {
+					*rayHit = localHit;
+					rayHit->index += instance.triangleOffset;
+					ray.maxt = localRay.maxt;
+					ray4.maxt = _mm_set1_ps(ray.maxt);
+				}
+			}
+		}
+	}
+}
+
+template<class NodeType> bool QBVHAccel::IntersectPInstancesTree(const NodeType *treeNodes,
+		const Ray &ray, RayHit *rayHit, QBVHTraversalStats *stats) const {
+	QuadRay ray4(ray);
+	__m128 invDir[3];
+	invDir[0] = _mm_set1_ps(1.f / ray.d.x);
+	invDir[1] = _mm_set1_ps(1.f / ray.d.y);
+	invDir[2] = _mm_set1_ps(1.f / ray.d.z);
+
+	int signs[3];
+	ray.GetDirectionSigns(signs);
+
+	int todoNode = 0;
+	int32_t nodeStack[64];
+	nodeStack[0] = 0;
+
+	while (todoNode >= 0) {
+		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
+			const NodeType &node = treeNodes[nodeStack[todoNode]];
+			--todoNode;
+
+			const int32_t visit = node.BBoxIntersect(ray4, invDir, signs);
+
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
 					break;
-				case (0x1 | 0x2 | 0x4 | 0x8):
-					nodeStack[++todoNode] = node.children[0];
-					nodeStack[++todoNode] = node.children[1];
-					nodeStack[++todoNode] = node.children[2];
-					nodeStack[++todoNode] = node.children[3];
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
+			}
+#if defined(QBVH_TRAVERSAL_STATS)
+			if (stats)
+				CountNodeVisit(node, todoNode, stats);
+#endif
+		} else {
+			const int32_t leafData = nodeStack[todoNode];
+			--todoNode;
+
+			if (QBVHNode::IsEmpty(leafData))
+				continue;
+
+			u_int offset, nbInstances;
+			DecodeLeaf(leafData, &offset, &nbInstances);
+
+			for (u_int i = offset; i < offset + nbInstances; ++i) {
+				const QBVHInstance &instance = instances[i];
+				if (IntersectPTree(treeNodes, instance.rootNode, instance.ToLocal(ray), rayHit, stats)) {
+					rayHit->index += instance.triangleOffset;
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+/***************************************************/
+
+bool QBVHAccel::CoherentRays(const Ray &ray0, const Ray &ray1) {
+	if ((ray0.o.x != ray1.o.x) || (ray0.o.y != ray1.o.y) || (ray0.o.z != ray1.o.z))
+		return false;
+
+	if (((ray0.d.x < 0.f) != (ray1.d.x < 0.f)) ||
+			((ray0.d.y < 0.f) != (ray1.d.y < 0.f)) ||
+			((ray0.d.z < 0.f) != (ray1.d.z < 0.f)))
+		return false;
+
+	// The directions don't need to be normalized
+	const float cosLength = Dot(ray0.d, ray1.d);
+	return (cosLength > 0.f) && (cosLength * cosLength >= PACKET_MIN_COS * PACKET_MIN_COS *
+			ray0.d.LengthSquared() * ray1.d.LengthSquared());
+}
+
+// Compute the frustum of a packet of coherent rays
+static void PacketFrustum(const Ray *rays, const u_int count, __m128 orig[3],
+		__m128 invDirMin[3], __m128 invDirMax[3], __m128 *mint, __m128 *maxt) {
+	float invMin[3], invMax[3];
+	float minT = rays[0].mint;
+	float maxT = rays[0].maxt;
+	for (int axis = 0; axis < 3; ++axis)
+		invMin[axis] = invMax[axis] = 1.f / rays[0].d[axis];
+	for (u_int r = 1; r < count; ++r) {
+		for (int axis = 0; axis < 3; ++axis) {
+			const float inv = 1.f / rays[r].d[axis];
+			invMin[axis] = min(invMin[axis], inv);
+			invMax[axis] = max(invMax[axis], inv);
+		}
+		minT = min(minT, rays[r].mint);
+		maxT = max(maxT, rays[r].maxt);
+	}
+
+	for (int axis = 0; axis < 3; ++axis) {
+		orig[axis] = _mm_set1_ps(rays[0].o[axis]);
+		invDirMin[axis] = _mm_set1_ps(invMin[axis]);
+		invDirMax[axis] = _mm_set1_ps(invMax[axis]);
+	}
+	*mint = _mm_set1_ps(minT);
+	*maxt = _mm_set1_ps(maxT);
+}
+
+void QBVHAccel::IntersectPacket(const Ray *rays, RayHit *hits, const u_int count) const {
+	//------------------------------
+	// Prepare the packet for intersection
+	__m128 orig[3], invDirMin[3], invDirMax[3], mint, maxt;
+	PacketFrustum(rays, count, orig, invDirMin, invDirMax, &mint, &maxt);
+
+	int signs[3];
+	rays[0].GetDirectionSigns(signs);
+
+	//------------------------------
+	// Main loop
+	int todoNode = 0; // the index in the stack
+	int32_t nodeStack[64];
+	nodeStack[0] = 0; // first node to handle: root node
+
+	while (todoNode >= 0) {
+		// Leaves are identified by a negative index
+		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
+			QBVHNode &node = nodes[nodeStack[todoNode]];
+			--todoNode;
+
+			const int32_t visit = node.FrustumIntersect(orig, invDirMin,
+					invDirMax, signs, mint, maxt);
+
+			// All the rays have the same direction signs
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
 					break;
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
 			}
 		} else {
 			//----------------------
@@ -462,22 +1516,437 @@ void QBVHAccel::Intersect(const Ray &ray, RayHit *rayHit) const {
 			if (QBVHNode::IsEmpty(leafData))
 				continue;
 
-			// Perform intersection
-			const u_int nbQuadPrimitives = QBVHNode::NbQuadPrimitives(leafData);
+			// Perform intersection with each ray
+			u_int offset, nbQuadPrimitives;
+			DecodeLeaf(leafData, &offset, &nbQuadPrimitives);
+			QuadTriangle quad;
+
+			float maxT = 0.f;
+			for (u_int r = 0; r < count; ++r) {
+				QuadRay ray4(rays[r]);
+				for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber)
+					LeafQuad(primNumber, &quad).Intersect(ray4, rays[r], &hits[r]);
+				maxT = max(maxT, rays[r].maxt);
+			}
 
-			const u_int offset = QBVHNode::FirstQuadIndex(leafData);
+			// Shrink the frustum
+			maxt = _mm_set1_ps(maxT);
+		}//end of the else
+	}
+}
 
-			for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber)
-				prims[primNumber].Intersect(ray4, ray, rayHit);
+void QBVHAccel::IntersectPPacket(const Ray *rays, RayHit *hits, const u_int count) const {
+	//------------------------------
+	// Prepare the packet for intersection
+	__m128 orig[3], invDirMin[3], invDirMax[3], mint, maxt;
+	PacketFrustum(rays, count, orig, invDirMin, invDirMax, &mint, &maxt);
+
+	int signs[3];
+	rays[0].GetDirectionSigns(signs);
+
+	bool occluded[PACKET_MAX_RAYS];
+	for (u_int r = 0; r < count; ++r)
+		occluded[r] = false;
+	u_int occludedCount = 0;
+
+	//------------------------------
+	// Main loop
+	int todoNode = 0; // the index in the stack
+	int32_t nodeStack[64];
+	nodeStack[0] = 0; // first node to handle: root node
+
+	while (todoNode >= 0) {
+		// Leaves are identified by a negative index
+		if (!QBVHNode::IsLeaf(nodeStack[todoNode])) {
+			QBVHNode &node = nodes[nodeStack[todoNode]];
+			--todoNode;
+
+			const int32_t visit = node.FrustumIntersect(orig, invDirMin,
+					invDirMax, signs, mint, maxt);
+
+			boost::int16_t order = pathTable[(visit << 3) |
+					(signs[node.axisMain] << 2) |
+					(signs[node.axisSubLeft] << 1) |
+					signs[node.axisSubRight]];
+			for (int i = 0; i < 4; ++i) {
+				const int32_t child = order & 0xf;
+				if (child == 4)
+					break;
+				nodeStack[++todoNode] = node.children[child];
+				order >>= 4;
+			}
+		} else {
+			//----------------------
+			// It is a leaf,
+			// all the informations are encoded in the index
+			const int32_t leafData = nodeStack[todoNode];
+			--todoNode;
+
+			if (QBVHNode::IsEmpty(leafData))
+				continue;
+
+			// Perform intersection with each ray not yet occluded
+			u_int offset, nbQuadPrimitives;
+			DecodeLeaf(leafData, &offset, &nbQuadPrimitives);
+			QuadTriangle quad;
+
+			for (u_int r = 0; r < count; ++r) {
+				if (occluded[r])
+					continue;
+
+				QuadRay ray4(rays[r]);
+				for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber) {
+					if (LeafQuad(primNumber, &quad).IntersectP(ray4, &hits[r])) {
+						occluded[r] = true;
+						++occludedCount;
+						break;
+					}
+				}
+			}
+
+			if (occludedCount == count)
+				return;
 		}//end of the else
 	}
 }
 
 /***************************************************/
 
+// The state of a ray of a stream
+class StreamRay {
+public:
+	QuadRay ray4;
+	__m128 invDir[3];
+	int signs[3];
+	u_int rayIndex;
+	int todoNode;
+	int32_t nodeStack[64];
+};
+
+// Load the next node or leaf of a ray of a stream in the cache
+template<class NodeType> static inline void PrefetchNext(const QBVHAccel *qbvh,
+		const NodeType *treeNodes, const int32_t next) {
+	if (!QBVHNode::IsLeaf(next)) {
+		const char *p = reinterpret_cast<const char *>(&treeNodes[next]);
+		for (size_t line = 0; line < sizeof(NodeType); line += 64)
+			_mm_prefetch(p + line, _MM_HINT_T0);
+	} else if (!QBVHNode::IsEmpty(next)) {
+		u_int offset, nbQuads;
+		qbvh->DecodeLeaf(next, &offset, &nbQuads);
+		if (qbvh->indexedPrims) {
+			_mm_prefetch(reinterpret_cast<const char *>(&qbvh->indexedPrims[offset]), _MM_HINT_T0);
+			return;
+		}
+		const char *p = reinterpret_cast<const char *>(&qbvh->prims[offset]);
+		_mm_prefetch(p, _MM_HINT_T0);
+		_mm_prefetch(p + 64, _MM_HINT_T0);
+		_mm_prefetch(p + 128, _MM_HINT_T0);
+	}
+}
+
+void QBVHAccel::IntersectStream(const Ray *rays, RayHit *hits, const u_int count) const {
+	if (compressedNodes)
+		TraceStream(compressedNodes, rays, hits, count, false);
+	else
+		TraceStream(nodes, rays, hits, count, false);
+}
+
+void QBVHAccel::IntersectPStream(const Ray *rays, RayHit *hits, const u_int count) const {
+	if (compressedNodes)
+		TraceStream(compressedNodes, rays, hits, count, true);
+	else
+		TraceStream(nodes, rays, hits, count, true);
+}
+
+template<class NodeType> void QBVHAccel::TraceStream(const NodeType *treeNodes,
+		const Ray *rays, RayHit *hits, const u_int count, const bool anyHit) const {
+	StreamRay stream[STREAM_RAYS];
+	u_int nextRay = 0;
+	u_int activeCount = 0;
+
+	// Start the first rays
+	for (u_int s = 0; s < STREAM_RAYS; ++s) {
+		stream[s].todoNode = -1;
+		if (nextRay < count) {
+			StreamRay &sr = stream[s];
+			const Ray &ray = rays[nextRay];
+			sr.ray4 = QuadRay(ray);
+			sr.invDir[0] = _mm_set1_ps(1.f / ray.d.x);
+			sr.invDir[1] = _mm_set1_ps(1.f / ray.d.y);
+			sr.invDir[2] = _mm_set1_ps(1.f / ray.d.z);
+			ray.GetDirectionSigns(sr.signs);
+			sr.rayIndex = nextRay++;
+			sr.todoNode = 0;
+			sr.nodeStack[0] = 0;
+			++activeCount;
+		}
+	}
+
+	while (activeCount > 0) {
+		for (u_int s = 0; s < STREAM_RAYS; ++s) {
+			StreamRay &sr = stream[s];
+			if (sr.todoNode < 0)
+				continue;
+
+			const Ray &ray = rays[sr.rayIndex];
+			const int32_t nodeData = sr.nodeStack[sr.todoNode];
+			--sr.todoNode;
+
+			// Do a single step of the traversal
+			if (!QBVHNode::IsLeaf(nodeData)) {
+				const NodeType &node = treeNodes[nodeData];
+				const int32_t visit = node.BBoxIntersect(sr.ray4, sr.invDir, sr.signs);
+
+				boost::int16_t order = pathTable[(visit << 3) |
+						(sr.signs[node.axisMain] << 2) |
+						(sr.signs[node.axisSubLeft] << 1) |
+						sr.signs[node.axisSubRight]];
+				for (int i = 0; i < 4; ++i) {
+					const int32_t child = order & 0xf;
+					if (child == 4)
+						break;
+					sr.nodeStack[++sr.todoNode] = node.children[child];
+					order >>= 4;
+				}
+			} else if (!QBVHNode::IsEmpty(nodeData)) {
+				u_int offset, nbQuadPrimitives;
+				DecodeLeaf(nodeData, &offset, &nbQuadPrimitives);
+				QuadTriangle quad;
+
+				if (anyHit) {
+					for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber) {
+						if (LeafQuad(primNumber, &quad).IntersectP(sr.ray4, &hits[sr.rayIndex])) {
+							sr.todoNode = -1;
+							break;
+						}
+					}
+				} else {
+					for (u_int primNumber = offset; primNumber < (offset + nbQuadPrimitives); ++primNumber)
+						LeafQuad(primNumber, &quad).Intersect(sr.ray4, ray, &hits[sr.rayIndex]);
+				}
+			}
+
+			if (sr.todoNode >= 0) {
+				PrefetchNext(this, treeNodes, sr.nodeStack[sr.todoNode]);
+				continue;
+			}
+
+			// The ray is done, replace it with the next one
+			if (nextRay < count) {
+				const Ray &newRay = rays[nextRay];
+				sr.ray4 = QuadRay(newRay);
+				sr.invDir[0] = _mm_set1_ps(1.f / newRay.d.x);
+				sr.invDir[1] = _mm_set1_ps(1.f / newRay.d.y);
+				sr.invDir[2] = _mm_set1_ps(1.f / newRay.d.z);
+				newRay.GetDirectionSigns(sr.signs);
+				sr.rayIndex = nextRay++;
+				sr.todoNode = 0;
+				sr.nodeStack[0] = 0;
+			} else
+				--activeCount;
+		}
+	}
+}
+
+/***************************************************/
+
+float QBVHAccel::SAHCost() const {
+	const float worldArea = worldBound.SurfaceArea();
+	if (!(worldArea > 0.f))
+		return 0.f;
+
+	// The root node is always visited
+	float cost = 1.f;
+	for (u_int n = 0; n < nNodes; ++n) {
+		const QBVHNode &node = nodes[n];
+		for (int c = 0; c < 4; ++c) {
+			if (node.ChildIsLeaf(c) && node.LeafIsEmpty(c))
+				continue;
+
+			BBox bbox;
+			for (int axis = 0; axis < 3; ++axis) {
+				bbox.pMin[axis] = reinterpret_cast<const float *>(&(node.bboxes[0][axis]))[c];
+				bbox.pMax[axis] = reinterpret_cast<const float *>(&(node.bboxes[1][axis]))[c];
+			}
+
+			// Probability to enter the child multiplied by its cost
+			const float p = bbox.SurfaceArea() / worldArea;
+			if (node.ChildIsLeaf(c)) {
+				u_int offset, nbQuads;
+				DecodeLeaf(node.children[c], &offset, &nbQuads);
+				cost += p * nbQuads;
+			} else
+				cost += p;
+		}
+	}
+
+	return cost;
+}
+
+void QBVHAccel::PrintBuildReport(const double buildTime) const {
+	u_int nbLeaves = 0;
+	u_int nEmptySlots = 0;
+	for (u_int n = 0; n < nNodes; ++n) {
+		for (int c = 0; c < 4; ++c) {
+			if (!nodes[n].ChildIsLeaf(c))
+				continue;
+			if (nodes[n].LeafIsEmpty(c))
+				++nEmptySlots;
+			else
+				++nbLeaves;
+		}
+	}
+
+	// The last quad of a leaf is padded with copies of its last primitive
+	size_t nPaddings = 0;
+	for (u_int q = 0; q < nQuads; ++q) {
+		for (int i = 1; i < 4; ++i) {
+			if (QuadPrimitive(q, i) == QuadPrimitive(q, i - 1))
+				++nPaddings;
+		}
+	}
+
+	const size_t nSlots = 4 * static_cast<size_t>(nQuads);
+	cerr << "QBVH report: " << nNodes << " nodes, " << nbLeaves << " leaves, " <<
+			nQuads << " quads" << (leaves ? " (leaves table)" : "") << endl;
+	cerr << "  Average leaf: " << (nbLeaves ? float(nSlots - nPaddings) / nbLeaves : 0.f) <<
+			" triangles in " << (nbLeaves ? float(nQuads) / nbLeaves : 0.f) << " quads" << endl;
+	cerr << "  Empty slots: " << (nSlots ? 100.f * nPaddings / nSlots : 0.f) <<
+			"% of the quads (padding), " << (nNodes ? 100.f * nEmptySlots / (4.f * nNodes) : 0.f) <<
+			"% of the nodes" << endl;
+	const size_t quadSize = indexedPrims ? sizeof(IndexedQuad) : sizeof(QuadTriangle);
+	cerr << "  Memory: " << (sizeof(QBVHNode) * static_cast<size_t>(nNodes) / 1024) <<
+			"Kb of nodes, " << (quadSize * nQuads / 1024) << "Kb of " <<
+			(indexedPrims ? "indexed quads" : "quads") << endl;
+	cerr << "  SAH cost: " << buildSAHCost << ", ready in " << buildTime << " secs" << endl;
+}
+
+/***************************************************/
+
+BBox QBVHAccel::RefitNode(const int32_t nodeIndex, const Triangle *tris,
+		const Point *verts) {
+	QBVHNode &node = nodes[nodeIndex];
+
+	BBox nodeBbox;
+	bool changed = false;
+	for (int c = 0; c < 4; ++c) {
+		BBox bbox;
+		if (node.ChildIsLeaf(c)) {
+			if (node.LeafIsEmpty(c))
+				continue;
+
+			u_int offset, nbQuads;
+			DecodeLeaf(node.children[c], &offset, &nbQuads);
+			for (u_int q = offset; q < offset + nbQuads; ++q)
+				bbox = Union(bbox, indexedPrims ? indexedPrims[q].WorldBound(tris, verts) :
+						prims[q].WorldBound(tris, verts));
+			// Same as the bounding boxes of the build
+			bbox.Expand(RAY_EPSILON);
+		} else
+			bbox = RefitNode(node.children[c], tris, verts);
+
+		for (int axis = 0; axis < 3; ++axis) {
+			changed |= (reinterpret_cast<float *>(&(node.bboxes[0][axis]))[c] != bbox.pMin[axis]) ||
+				(reinterpret_cast<float *>(&(node.bboxes[1][axis]))[c] != bbox.pMax[axis]);
+		}
+		node.SetBBox(c, bbox);
+		nodeBbox = Union(nodeBbox, bbox);
+	}
+
+	if (changed) {
+		refitFirstNode = min(refitFirstNode, static_cast<u_int>(nodeIndex));
+		refitLastNode = max(refitLastNode, static_cast<u_int>(nodeIndex) + 1);
+	}
+
+	return nodeBbox;
+}
+
+bool QBVHAccel::Refit() {
+	// The compressed nodes are refitted with their full precision version
+	if (compressedNodes)
+		DecompressNodes();
+
+	if (instances)
+		return RefitInstances();
+
+	const double startTime = WallClockTime();
+
+	// Update the quads in place, with the same triangles (the indexed
+	// leaves don't change, they always use the current vertices)
+	refitFirstQuad = nQuads;
+	refitLastQuad = 0;
+	for (u_int i = 0; (i < nQuads) && prims; ++i) {
+		const QuadTriangle quad(triangles, vertices,
+				prims[i].GetPrimitive(0), prims[i].GetPrimitive(1),
+				prims[i].GetPrimitive(2), prims[i].GetPrimitive(3));
+		if (memcmp(&quad, &prims[i], sizeof(QuadTriangle)) != 0) {
+			prims[i] = quad;
+			refitFirstQuad = min(refitFirstQuad, i);
+			refitLastQuad = i + 1;
+		}
+	}
+
+	refitFirstNode = nNodes;
+	refitLastNode = 0;
+	worldBound = RefitNode(0, triangles, vertices);
+
+	const float cost = SAHCost();
+	if (cost <= REFIT_MAX_SAH_RATIO * buildSAHCost) {
+		if (compressedNodes)
+			RecompressNodes();
+
+		cerr << "QBVH refit in " << (WallClockTime() - startTime) << " secs, SAH cost: " <<
+				cost << " (" << buildSAHCost << " after the build)" << endl;
+		return false;
+	}
+
+	cerr << "QBVH refit SAH cost: " << cost << " (" << buildSAHCost <<
+			" after the build), building the tree again" << endl;
+
+	// The decoded nodes are never in the mapped file
+	if (compressedNodes) {
+		FreeAligned(nodes);
+		nodes = NULL;
+	}
+	if (cacheRegion) {
+		delete cacheRegion;
+		cacheRegion = NULL;
+	} else {
+		FreeAligned(prims);
+		FreeAligned(indexedPrims);
+		FreeAligned(nodes);
+		FreeAligned(leaves);
+	}
+	prims = NULL;
+	indexedPrims = NULL;
+	leaves = NULL;
+	Build(builderType);
+	buildSAHCost = SAHCost();
+	if (compressedNodes)
+		CompressNodes();
+
+	refitFirstNode = 0;
+	refitLastNode = nNodes;
+	refitFirstQuad = 0;
+	refitLastQuad = nQuads;
+
+	return true;
+}
+
+/***************************************************/
+
 QBVHAccel::~QBVHAccel() {
-	FreeAligned(prims);
-	FreeAligned(nodes);
+	// The nodes and the quads loaded from a cache are in the mapped file
+	if (cacheRegion)
+		delete cacheRegion;
+	else {
+		FreeAligned(prims);
+		FreeAligned(indexedPrims);
+		FreeAligned(nodes);
+		FreeAligned(leaves);
+	}
+	FreeAligned(compressedNodes);
+	FreeAligned(instances);
 }
 
 /***************************************************/
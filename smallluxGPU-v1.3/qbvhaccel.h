@@ -28,18 +28,27 @@
 #include "point.h"
 #include "bbox.h"
 #include "triangle.h"
+#include "transform.h"
 #include "raybuffer.h"
 
+#include <string>
+#include <vector>
+#include <new>
 #include <xmmintrin.h>
+#include <emmintrin.h>
 #include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
 using boost::int32_t;
 
+namespace boost { namespace interprocess { class mapped_region; } }
+
 #if defined(WIN32) && !defined(__CYGWIN__)
 class __declspec(align(16)) QuadRay {
 #else
 class QuadRay {
 #endif
 public:
+	QuadRay() { }
 	QuadRay(const Ray &ray)
 	{
 		ox = _mm_set1_ps(ray.o.x);
@@ -66,6 +75,14 @@ static inline __m128 reciprocal(const __m128 x) {
 	return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(2.f), _mm_mul_ps(x, y)));
 }
 
+/**
+   Define QBVH_WOOP_TRIANGLES to store the QuadTriangles as the
+   transformations to the space of the unit triangle, see "Real Time Ray
+   Tracing and Interactive Global Illumination" by Ingo Wald (2004,
+   section 7.2.3). The test needs a single division instead of three and
+   the cross products with the ray direction, but 48 more bytes per quad.
+   The OpenCL kernel is compiled with the same layout.
+*/
 class QuadTriangle : public Aligned16 {
 public:
 
@@ -79,6 +96,52 @@ public:
 		primitives[2] = p3;
 		primitives[3] = p4;
 
+#if defined(QBVH_WOOP_TRIANGLES)
+		for (u_int i = 0; i < 4; ++i) {
+			const Triangle *t = &tris[primitives[i]];
+			const Point &p0 = verts[t->v[0]];
+			const Point &p1 = verts[t->v[1]];
+			const Point &p2 = verts[t->v[2]];
+			const double e1[3] = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+			const double e2[3] = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+			const double v0[3] = { p0.x, p0.y, p0.z };
+			const double n[3] = {
+				e1[1] * e2[2] - e1[2] * e2[1],
+				e1[2] * e2[0] - e1[0] * e2[2],
+				e1[0] * e2[1] - e1[1] * e2[0]
+			};
+			const double n2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+
+			// The rows of the inverse of the matrix with the columns e1,
+			// e2 and n: they give the coordinates along e1 (b1), e2 (b2)
+			// and n (0 on the plane of the triangle)
+			double rows[3][3] = {
+				{ e2[1] * n[2] - e2[2] * n[1], e2[2] * n[0] - e2[0] * n[2], e2[0] * n[1] - e2[1] * n[0] },
+				{ n[1] * e1[2] - n[2] * e1[1], n[2] * e1[0] - n[0] * e1[2], n[0] * e1[1] - n[1] * e1[0] },
+				{ n[0], n[1], n[2] }
+			};
+			double offsets[3];
+			for (int r = 0; r < 3; ++r) {
+				for (int c = 0; c < 3; ++c)
+					rows[r][c] = (n2 > 0.0) ? (rows[r][c] / n2) : 0.0;
+				offsets[r] = -(rows[r][0] * v0[0] + rows[r][1] * v0[1] + rows[r][2] * v0[2]);
+			}
+			// A degenerate triangle is never hit
+			if (!(n2 > 0.0))
+				offsets[0] = -1.0;
+
+			for (int c = 0; c < 3; ++c) {
+				reinterpret_cast<float *> (&b1Row[c])[i] = static_cast<float>(rows[0][c]);
+				reinterpret_cast<float *> (&b2Row[c])[i] = static_cast<float>(rows[1][c]);
+				reinterpret_cast<float *> (&planeRow[c])[i] = static_cast<float>(rows[2][c]);
+			}
+			reinterpret_cast<float *> (&b1Row[3])[i] = static_cast<float>(offsets[0]);
+			reinterpret_cast<float *> (&b2Row[3])[i] = static_cast<float>(offsets[1]);
+			// Negated, the test computes the distance from the origin
+			// to the plane
+			reinterpret_cast<float *> (&planeRow[3])[i] = static_cast<float>(-offsets[2]);
+		}
+#else
 		for (u_int i = 0; i < 4; ++i) {
 			const Triangle *t = &tris[primitives[i]];
 			reinterpret_cast<float *> (&origx)[i] = verts[t->v[0]].x;
@@ -91,6 +154,14 @@ public:
 			reinterpret_cast<float *> (&edge2y)[i] = verts[t->v[2]].y - verts[t->v[0]].y;
 			reinterpret_cast<float *> (&edge2z)[i] = verts[t->v[2]].z - verts[t->v[0]].z;
 		}
+#endif
+	}
+
+	/**
+	   Uninitialized, for the quads built during the traversal
+	   (see QBVHAccel::LeafQuad())
+	*/
+	QuadTriangle() {
 	}
 
 	~QuadTriangle() {
@@ -102,8 +173,43 @@ public:
 				Union(tris[primitives[2]].WorldBound(verts), tris[primitives[3]].WorldBound(verts)));
 	}
 
-	bool Intersect(const QuadRay &ray4, const Ray &ray, RayHit *rayHit) const {
+	/**
+	   Test the ray against the 4 triangles, return the mask of the
+	   triangles hit inside the [mint, maxt] range of the ray.
+	*/
+	inline __m128 Test(const QuadRay &ray4, __m128 *t, __m128 *b1,
+		__m128 *b2) const {
 		const __m128 zero = _mm_setzero_ps();
+#if defined(QBVH_WOOP_TRIANGLES)
+		// The ray in the space of the unit triangle, it is hit where the
+		// ray crosses the plane z = 0
+		const __m128 oz = _mm_sub_ps(planeRow[3], _mm_add_ps(_mm_mul_ps(ray4.ox, planeRow[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.oy, planeRow[1]), _mm_mul_ps(ray4.oz, planeRow[2]))));
+		const __m128 dz = _mm_add_ps(_mm_mul_ps(ray4.dx, planeRow[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.dy, planeRow[1]), _mm_mul_ps(ray4.dz, planeRow[2])));
+		*t = _mm_div_ps(oz, dz);
+		__m128 test = _mm_and_ps(_mm_cmpgt_ps(*t, ray4.mint),
+				_mm_cmplt_ps(*t, ray4.maxt));
+
+		const __m128 ox = _mm_add_ps(b1Row[3], _mm_add_ps(_mm_mul_ps(ray4.ox, b1Row[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.oy, b1Row[1]), _mm_mul_ps(ray4.oz, b1Row[2]))));
+		const __m128 dx = _mm_add_ps(_mm_mul_ps(ray4.dx, b1Row[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.dy, b1Row[1]), _mm_mul_ps(ray4.dz, b1Row[2])));
+		*b1 = _mm_add_ps(ox, _mm_mul_ps(*t, dx));
+		test = _mm_and_ps(test, _mm_cmpge_ps(*b1, zero));
+
+		const __m128 oy = _mm_add_ps(b2Row[3], _mm_add_ps(_mm_mul_ps(ray4.ox, b2Row[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.oy, b2Row[1]), _mm_mul_ps(ray4.oz, b2Row[2]))));
+		const __m128 dy = _mm_add_ps(_mm_mul_ps(ray4.dx, b2Row[0]),
+				_mm_add_ps(_mm_mul_ps(ray4.dy, b2Row[1]), _mm_mul_ps(ray4.dz, b2Row[2])));
+		*b2 = _mm_add_ps(oy, _mm_mul_ps(*t, dy));
+		const __m128 b0 = _mm_sub_ps(_mm_set1_ps(1.f),
+				_mm_add_ps(*b1, *b2));
+		test = _mm_and_ps(test, _mm_and_ps(_mm_cmpge_ps(*b2, zero),
+				_mm_cmpge_ps(b0, zero)));
+
+		return test;
+#else
 		const __m128 s1x = _mm_sub_ps(_mm_mul_ps(ray4.dy, edge2z),
 				_mm_mul_ps(ray4.dz, edge2y));
 		const __m128 s1y = _mm_sub_ps(_mm_mul_ps(ray4.dz, edge2x),
@@ -118,29 +224,38 @@ public:
 		const __m128 dx = _mm_sub_ps(ray4.ox, origx);
 		const __m128 dy = _mm_sub_ps(ray4.oy, origy);
 		const __m128 dz = _mm_sub_ps(ray4.oz, origz);
-		const __m128 b1 = _mm_div_ps(_mm_add_ps(_mm_mul_ps(dx, s1x),
+		*b1 = _mm_div_ps(_mm_add_ps(_mm_mul_ps(dx, s1x),
 				_mm_add_ps(_mm_mul_ps(dy, s1y), _mm_mul_ps(dz, s1z))),
 				divisor);
-		test = _mm_and_ps(test, _mm_cmpge_ps(b1, zero));
+		test = _mm_and_ps(test, _mm_cmpge_ps(*b1, zero));
 		const __m128 s2x = _mm_sub_ps(_mm_mul_ps(dy, edge1z),
 				_mm_mul_ps(dz, edge1y));
 		const __m128 s2y = _mm_sub_ps(_mm_mul_ps(dz, edge1x),
 				_mm_mul_ps(dx, edge1z));
 		const __m128 s2z = _mm_sub_ps(_mm_mul_ps(dx, edge1y),
 				_mm_mul_ps(dy, edge1x));
-		const __m128 b2 = _mm_div_ps(_mm_add_ps(_mm_mul_ps(ray4.dx, s2x),
+		*b2 = _mm_div_ps(_mm_add_ps(_mm_mul_ps(ray4.dx, s2x),
 				_mm_add_ps(_mm_mul_ps(ray4.dy, s2y), _mm_mul_ps(ray4.dz, s2z))),
 				divisor);
 		const __m128 b0 = _mm_sub_ps(_mm_set1_ps(1.f),
-				_mm_add_ps(b1, b2));
-		test = _mm_and_ps(test, _mm_and_ps(_mm_cmpge_ps(b2, zero),
+				_mm_add_ps(*b1, *b2));
+		test = _mm_and_ps(test, _mm_and_ps(_mm_cmpge_ps(*b2, zero),
 				_mm_cmpge_ps(b0, zero)));
-		const __m128 t = _mm_div_ps(_mm_add_ps(_mm_mul_ps(edge2x, s2x),
+		*t = _mm_div_ps(_mm_add_ps(_mm_mul_ps(edge2x, s2x),
 				_mm_add_ps(_mm_mul_ps(edge2y, s2y),
 				_mm_mul_ps(edge2z, s2z))), divisor);
 		test = _mm_and_ps(test,
-				_mm_and_ps(_mm_cmpgt_ps(t, ray4.mint),
-				_mm_cmplt_ps(t, ray4.maxt)));
+				_mm_and_ps(_mm_cmpgt_ps(*t, ray4.mint),
+				_mm_cmplt_ps(*t, ray4.maxt)));
+
+		return test;
+#endif
+	}
+
+	bool Intersect(const QuadRay &ray4, const Ray &ray, RayHit *rayHit) const {
+		__m128 t, b1, b2;
+		__m128 test = Test(ray4, &t, &b1, &b2);
+
 		u_int hit = 4;
 		for (u_int i = 0; i < 4; ++i) {
 			if (reinterpret_cast<int32_t *> (&test)[i] &&
@@ -164,10 +279,74 @@ public:
 		return true;
 	}
 
+	/**
+	   Any hit version of Intersect(), it stops at the first triangle
+	   hit without looking for the closest one.
+	*/
+	bool IntersectP(const QuadRay &ray4, RayHit *rayHit) const {
+		__m128 t, b1, b2;
+		const int mask = _mm_movemask_ps(Test(ray4, &t, &b1, &b2));
+		if (!mask)
+			return false;
+
+		u_int hit = 0;
+		while (!(mask & (1 << hit)))
+			++hit;
+
+		rayHit->t = reinterpret_cast<const float *> (&t)[hit];
+		rayHit->b1 = reinterpret_cast<const float *> (&b1)[hit];
+		rayHit->b2 = reinterpret_cast<const float *> (&b2)[hit];
+		rayHit->index = primitives[hit];
+
+		return true;
+	}
+
+	unsigned int GetPrimitive(const u_int i) const {
+		return primitives[i];
+	}
+
 private:
+#if defined(QBVH_WOOP_TRIANGLES)
+	// The x, y, z and offset of the transformation rows giving b1, b2 and
+	// the negated distance to the plane of the triangles
+	__m128 b1Row[4];
+	__m128 b2Row[4];
+	__m128 planeRow[4];
+#else
 	__m128 origx, origy, origz;
 	__m128 edge1x, edge1y, edge1z;
 	__m128 edge2x, edge2y, edge2z;
+#endif
+	unsigned int primitives[4];
+};
+
+/**
+   The 4 triangle indices of a quad, stored instead of the QuadTriangle
+   by the trees built with indexed leaves: 16 bytes instead of 160. The
+   QuadTriangle is built from the vertices of the mesh when the leaf
+   is intersected.
+*/
+class IndexedQuad {
+public:
+	IndexedQuad(const unsigned int p1, const unsigned int p2,
+			const unsigned int p3, const unsigned int p4) {
+		primitives[0] = p1;
+		primitives[1] = p2;
+		primitives[2] = p3;
+		primitives[3] = p4;
+	}
+
+	BBox WorldBound(const Triangle *tris, const Point *verts) const {
+		return Union(
+				Union(tris[primitives[0]].WorldBound(verts), tris[primitives[1]].WorldBound(verts)),
+				Union(tris[primitives[2]].WorldBound(verts), tris[primitives[3]].WorldBound(verts)));
+	}
+
+	unsigned int GetPrimitive(const u_int i) const {
+		return primitives[i];
+	}
+
+private:
 	unsigned int primitives[4];
 };
 
@@ -179,10 +358,110 @@ private:
 */
 
 /**
-   the number of bins for construction
+   the default number of bins for construction
 */
 #define NB_BINS 8
 
+/**
+   The maximum number of bins for construction
+*/
+#define QBVH_MAX_BINS 64
+
+/**
+   The largest leaves created when they are cheaper than a split (see
+   QBVHAccel::traversalCost), 16 quads
+*/
+#define QBVH_SAH_MAX_LEAF_PRIMS 64
+
+/**
+   Ranges of primitives larger than this are binned and partitioned
+   by all the build threads
+*/
+#define PARALLEL_SPLIT_THRESHOLD 65536
+
+/**
+   The minimum number of primitives of the subtrees built in parallel
+   by the thread pool (the top of the tree is split until the ranges
+   are smaller than the maximum of this value and nPrims / 64)
+*/
+#define PARALLEL_SUBTREE_MIN_PRIMS 4096
+
+/**
+   The number of bins used by the split BVH builder, for both the
+   object and the spatial splits
+*/
+#define SBVH_NB_BINS 32
+
+/**
+   Spatial splits are only tried when the children of the best object
+   split overlap by more than this fraction of the root surface area
+*/
+#define SBVH_ALPHA 1e-5f
+
+/**
+   The split BVH can't reference more than this multiple of the
+   number of primitives
+*/
+#define SBVH_MAX_REFERENCES_FACTOR 2
+
+/**
+   The linear BVH builder uses 30 bit Morton codes (10 bits per axis)
+   below this number of primitives, 63 bit codes (21 bits per axis)
+   otherwise
+*/
+#define LBVH_30BIT_MAX_PRIMS (1 << 20)
+
+/**
+   The maximum number of leaves of the treelets restructured by
+   QBVHAccel::OptimizeTreelets()
+*/
+#define TREELET_LEAVES 7
+
+/**
+   The SAH cost of a node of the binary hierarchy, relative to the one
+   of a quad: a QBVH node holds 2 levels of the binary hierarchy
+*/
+#define TREELET_NODE_COST 0.5f
+
+/**
+   The number of nodes of the clusters of QBVHAccel::ReorderNodes(),
+   a 4KB page
+*/
+#define QBVH_CLUSTER_NODES 32
+
+/**
+   The size limits of the packets of rays traced together
+   (see QBVHAccel::IntersectPacket())
+*/
+#define PACKET_MIN_RAYS 4
+#define PACKET_MAX_RAYS 16
+
+/**
+   The minimum cosine of the angle between the directions of
+   2 rays of the same packet
+*/
+#define PACKET_MIN_COS 0.9f
+
+/**
+   The number of rays traversing the tree in lockstep in
+   QBVHAccel::IntersectStream()
+*/
+#define STREAM_RAYS 8
+
+/**
+   QBVHAccel::Refit() builds the tree again when its SAH cost becomes
+   larger than this multiple of the cost after the build
+*/
+#define REFIT_MAX_SAH_RATIO 1.5f
+
+/**
+   The leaves of a tree with more quads than this, or with a leaf of
+   more than QBVH_COMPACT_LEAF_MAX_QUADS quads, can't be encoded in
+   the nodes and are stored in the leaves table (see QBVHLeaf)
+*/
+#define QBVH_COMPACT_MAX_QUADS (1u << 27)
+#define QBVH_COMPACT_LEAF_MAX_QUADS 16
+
 /**
    The QBVH node structure, 128 bytes long (perfect for cache)
 */
@@ -208,9 +487,20 @@ public:
 	   the 4 next bits will code the number of primitives in the leaf
 	   (more exactly, nbPrimitives = 4 * (p + 1), where p is the integer
 	   interpretation of the 4 bits), and the 27 remaining bits the index
-	   of the first quad of the node
+	   of the first quad of the node. When the tree has a leaves table
+	   (see QBVHAccel::leaves), the 31 bits after the sign are the
+	   index of the leaf in the table instead.
 	*/
 	int32_t children[4];
+
+	/**
+	   The split axes used to build the node: the main one separates
+	   children 0-1 from children 2-3, the left one separates child 0 from
+	   child 1 and the right one child 2 from child 3. They are used to
+	   visit the children in front to back order (see pathTable).
+	*/
+	int32_t axisMain, axisSubLeft, axisSubRight;
+	int32_t pad; // Padding to 128 bytes
 	
 	/**
 	   Base constructor, init correct bounding boxes and a "root" node
@@ -225,6 +515,11 @@ public:
 		// All children are empty leaves by default
 		for (int i = 0; i < 4; ++i)
 			children[i] = emptyLeafNode;
+
+		axisMain = 0;
+		axisSubLeft = 0;
+		axisSubRight = 0;
+		pad = 0;
 	}
 
 	/**
@@ -326,6 +621,23 @@ public:
 		}
 	}
 
+	/**
+	   Initialize the ith child as the leaf leafIndex of the leaves table
+	   @param i
+	   @param leafIndex
+	*/
+	inline void InitializeLeafIndex(int i, u_int leafIndex) {
+		children[i] = 0x80000000 | (static_cast<int32_t>(leafIndex) & 0x7fffffff);
+	}
+
+	/**
+	   The index in the leaves table, directly from the index.
+	   @param index
+	*/
+	inline static u_int LeafIndex(int32_t index) {
+		return index & 0x7fffffff;
+	}
+
 	/**
 	   Set the bounding box for the ith child.
 	   @param i
@@ -346,16 +658,215 @@ public:
 	*/
 	int32_t inline BBoxIntersect(const QuadRay &ray4, const __m128 invDir[3],
 		const int sign[3]) const;
+
+	/**
+	   Intersect the frustum of a packet of rays with the same origin
+	   with the 4 bounding boxes of the node. invDirMin and invDirMax
+	   bound the inverse directions of the rays, the result is
+	   conservative: a box is visited if any ray can hit it.
+	*/
+	int32_t inline FrustumIntersect(const __m128 orig[3],
+		const __m128 invDirMin[3], const __m128 invDirMax[3],
+		const int sign[3], const __m128 &mint, const __m128 &maxt) const;
+};
+
+/**
+   The compressed QBVH node, 64 bytes long. The bounding boxes of the
+   children are stored as 8 bit coordinates on a grid local to the
+   node: the grid starts at origin and its cells are 2^exponent long
+   along each axis, so the decoded boxes are exact and the coordinates
+   are rounded outward to always contain the original boxes.
+*/
+class QBVHCompressedNode {
+public:
+	/**
+	   The 4 children, with the same encoding of QBVHNode::children
+	*/
+	int32_t children[4];
+
+	float origin[3];
+
+	/**
+	   The 4 bounding boxes in grid coordinates, in SoA form. The empty
+	   children have inverted boxes (min 255, max 0).
+	*/
+	unsigned char qbboxes[2][3][4];
+
+	boost::int8_t exponent[3];
+
+	/**
+	   The split axes, same as QBVHNode
+	*/
+	unsigned char axisMain, axisSubLeft, axisSubRight;
+	unsigned char pad[6]; // Padding to 64 bytes
+
+	QBVHCompressedNode() { }
+
+	/**
+	   Compress a QBVH node
+	*/
+	QBVHCompressedNode(const QBVHNode &node);
+
+	/**
+	   Decode the node, the boxes contain the original ones
+	*/
+	void Decompress(QBVHNode *node) const;
+
+	/**
+	   Same as QBVHNode::BBoxIntersect(), with the decoded boxes
+	*/
+	int32_t inline BBoxIntersect(const QuadRay &ray4, const __m128 invDir[3],
+		const int sign[3]) const;
+};
+
+/**
+   An instance of a two level QBVH, 64 bytes long. The leaves of the
+   top level tree reference the instances instead of quads, each
+   instance is a prototype tree stored in the same nodes array with
+   the transformation from world to prototype space.
+*/
+class QBVHInstance {
+public:
+	/**
+	   The first 3 rows of the world to prototype space matrix
+	*/
+	float worldToLocal[3][4];
+
+	/**
+	   The root node of the prototype tree
+	*/
+	int32_t rootNode;
+
+	/**
+	   Added to the prototype triangle indices of the hits
+	*/
+	u_int triangleOffset;
+
+	u_int pad[2]; // Padding to 64 bytes
+
+	/**
+	   Transform the ray in prototype space. The direction isn't
+	   normalized, so the distances along the ray are the same.
+	*/
+	Ray ToLocal(const Ray &ray) const {
+		const float *m0 = worldToLocal[0];
+		const float *m1 = worldToLocal[1];
+		const float *m2 = worldToLocal[2];
+		return Ray(Point(
+				m0[0] * ray.o.x + m0[1] * ray.o.y + m0[2] * ray.o.z + m0[3],
+				m1[0] * ray.o.x + m1[1] * ray.o.y + m1[2] * ray.o.z + m1[3],
+				m2[0] * ray.o.x + m2[1] * ray.o.y + m2[2] * ray.o.z + m2[3]),
+			Vector(
+				m0[0] * ray.d.x + m0[1] * ray.d.y + m0[2] * ray.d.z,
+				m1[0] * ray.d.x + m1[1] * ray.d.y + m1[2] * ray.d.z,
+				m2[0] * ray.d.x + m2[1] * ray.d.y + m2[2] * ray.d.z),
+			ray.mint, ray.maxt);
+	}
+};
+
+/**
+   A leaf of the leaves table, used instead of the encoding in the
+   nodes by the trees too large for it: 32 bits for both the index of
+   the first quad and the number of quads. During the build, the
+   leaves of all the trees are in the table and reference the ranges
+   of primitives instead of the quads.
+*/
+class QBVHLeaf {
+public:
+	u_int firstQuad, nbQuads;
+};
+
+/**
+   The counters of the single ray traversals, only updated when
+   QBVH_TRAVERSAL_STATS is defined. Each thread has its own counters,
+   they are added for the reports.
+*/
+class QBVHTraversalStats {
+public:
+	QBVHTraversalStats() {
+		Reset();
+	}
+
+	void Reset() {
+		rayCount = 0;
+		nodesVisited = 0;
+		boxesTested = 0;
+		quadsTested = 0;
+		maxStackDepth = 0;
+	}
+
+	void Add(const QBVHTraversalStats &stats) {
+		rayCount += stats.rayCount;
+		nodesVisited += stats.nodesVisited;
+		boxesTested += stats.boxesTested;
+		quadsTested += stats.quadsTested;
+		if (stats.maxStackDepth > maxStackDepth)
+			maxStackDepth = stats.maxStackDepth;
+	}
+
+	/**
+	   The work of the traversals, the nodes visited and the quads tested
+	*/
+	boost::uint64_t Cost() const {
+		return nodesVisited + quadsTested;
+	}
+
+	boost::uint64_t rayCount;
+	// The inner nodes visited and their non empty children boxes
+	boost::uint64_t nodesVisited, boxesTested;
+	boost::uint64_t quadsTested;
+	u_int maxStackDepth;
 };
 
 /***************************************************/
 class QBVHAccel {
 public:
 	/**
-	   Normal constructor.
+	   The algorithms available to build the tree.
+	*/
+	enum BuilderType {
+		BINNED_SAH = 0,
+		SPLIT_BVH = 1,
+		LBVH = 2
+	};
+
+	/**
+	   Normal constructor. If cacheFileName isn't empty, the tree is
+	   loaded from this file when it has been built from the same
+	   triangles with the same parameters, otherwise it is built and
+	   saved in the file. The tree is improved by treeletPasses passes
+	   of OptimizeTreelets() after the build. The binned SAH uses nbBins
+	   bins along all the axes if allAxes is true, only along the one of
+	   maximum extent otherwise. traversalCost is the cost of a node
+	   relative to the one of a quad, when it isn't 0 the leaves are
+	   created as soon as they are cheaper than the split. The nodes and
+	   the quads are allocated in huge pages if hugePages is true. With
+	   indexedLeaves, the quads only store the triangle indices (see
+	   IndexedQuad).
 	*/
 	QBVHAccel(const unsigned int triangleCount, const Triangle *tris,
-			const Point *verts,	u_int mp, u_int fst, u_int sf);
+			const Point *verts,	u_int mp, u_int fst, u_int sf,
+			const BuilderType builder = BINNED_SAH,
+			const bool compressNodes = false,
+			const std::string &cacheFileName = "",
+			const u_int treeletPasses = 0, const u_int nbBins = NB_BINS,
+			const float traversalCost = 0.f, const bool allAxes = true,
+			const bool hugePages = false, const bool indexedLeaves = false);
+
+	/**
+	   Two level constructor: the top level tree is built over the
+	   instances of the prototypes, the nodes and the quads of the
+	   prototypes are copied after the ones of the top level. The
+	   triangle indices of the instance i are offset by
+	   triangleOffsets[i] in the hits. The quads of the prototypes with
+	   indexed leaves are built, the two level tree has no mesh to
+	   fetch their vertices from.
+	*/
+	QBVHAccel(const std::vector<const QBVHAccel *> &prototypes,
+			const std::vector<u_int> &instancePrototypes,
+			const std::vector<Transform> &instanceTransforms,
+			const std::vector<u_int> &triangleOffsets,
+			const bool compressNodes = false);
 
 	/**
 	   to free the memory.
@@ -370,9 +881,91 @@ public:
 
 	/**
 	   Intersect a ray in world space against the
-	   primitive and fills in an Intersection object.
+	   primitive and fills in an Intersection object. The traversal
+	   is counted in *stats when QBVH_TRAVERSAL_STATS is defined.
+	*/
+	void Intersect(const Ray &ray, RayHit *hit,
+		QBVHTraversalStats *stats = NULL) const;
+
+	/**
+	   Check if a ray in world space is occluded, stopping at the first
+	   primitive found (the hit is not the closest one).
+	   @return true if something was hit
+	*/
+	bool IntersectP(const Ray &ray, RayHit *hit,
+		QBVHTraversalStats *stats = NULL) const;
+
+	/**
+	   Check if 2 rays can be traced in the same packet: they must have
+	   the same origin and close directions in the same octant.
+	*/
+	static bool CoherentRays(const Ray &ray0, const Ray &ray1);
+
+	/**
+	   Intersect a packet of up to PACKET_MAX_RAYS rays, all coherent
+	   with the first one. The nodes are tested with the frustum of
+	   the packet, the leaves with each ray. Not available for the
+	   two level trees and with the compressed nodes.
+	*/
+	void IntersectPacket(const Ray *rays, RayHit *hits, const u_int count) const;
+
+	/**
+	   Any hit version of IntersectPacket()
+	*/
+	void IntersectPPacket(const Ray *rays, RayHit *hits, const u_int count) const;
+
+	/**
+	   Intersect a stream of incoherent rays. STREAM_RAYS rays are
+	   traversed in lockstep, each one does a step in turn after having
+	   prefetched its next node or leaf, so the cache misses of a ray
+	   are hidden by the work on the other ones. Not available for
+	   the two level trees.
+	*/
+	void IntersectStream(const Ray *rays, RayHit *hits, const u_int count) const;
+
+	/**
+	   Any hit version of IntersectStream()
+	*/
+	void IntersectPStream(const Ray *rays, RayHit *hits, const u_int count) const;
+
+	/**
+	   The first quad and the number of quads of a leaf, from the
+	   leaves table if the tree has one, from the leaf index otherwise
 	*/
-	void Intersect(const Ray &ray, RayHit *hit) const;
+	inline void DecodeLeaf(const int32_t leafData, u_int *firstQuad, u_int *nbQuads) const {
+		if (leaves) {
+			const QBVHLeaf &leaf = leaves[QBVHNode::LeafIndex(leafData)];
+			*firstQuad = leaf.firstQuad;
+			*nbQuads = leaf.nbQuads;
+		} else {
+			*firstQuad = QBVHNode::FirstQuadIndex(leafData);
+			*nbQuads = QBVHNode::NbQuadPrimitives(leafData);
+		}
+	}
+
+	/**
+	   Compute the SAH cost of the tree: the expected number of nodes
+	   visited plus the expected number of quads tested by a random ray
+	   hitting the world bounding box.
+	*/
+	float SAHCost() const;
+
+	/**
+	   (Re)build the compressed copy of the nodes, used for the
+	   traversal instead of the full precision ones, and free the full
+	   precision nodes. Refit() decodes them again while it runs.
+	*/
+	void CompressNodes();
+
+	/**
+	   Update the tree after the vertices have been moved: the bounding
+	   boxes are computed again bottom-up and the quads are updated in
+	   place, the topology doesn't change. The tree is built again if
+	   its SAH cost becomes too large (see REFIT_MAX_SAH_RATIO).
+	   @return true if the tree has been built again, the number of
+	   nodes and quads can be different
+	*/
+	bool Refit();
 
 	/**
 	   the actual number of quads
@@ -389,7 +982,36 @@ public:
 	QuadTriangle *prims;
 
 	/**
-	   The nodes of the QBVH.
+	   The triangle indices of each quad, instead of prims for the trees
+	   built with indexed leaves (prims is then NULL)
+	*/
+	IndexedQuad *indexedPrims;
+
+	/**
+	   The quad q of the leaves: a reference in prims, or the quad built
+	   in *quad from the vertices of the mesh with indexed leaves
+	*/
+	inline const QuadTriangle &LeafQuad(const u_int q, QuadTriangle *quad) const {
+		if (!indexedPrims)
+			return prims[q];
+
+		const IndexedQuad &indices = indexedPrims[q];
+		new (quad) QuadTriangle(triangles, vertices,
+				indices.GetPrimitive(0), indices.GetPrimitive(1),
+				indices.GetPrimitive(2), indices.GetPrimitive(3));
+		return *quad;
+	}
+
+	/**
+	   The triangle index i of the quad q, with both leaf formats
+	*/
+	inline u_int QuadPrimitive(const u_int q, const u_int i) const {
+		return indexedPrims ? indexedPrims[q].GetPrimitive(i) : prims[q].GetPrimitive(i);
+	}
+
+	/**
+	   The nodes of the QBVH, NULL once they are compressed (see
+	   compressedNodes).
 	*/
 	QBVHNode *nodes;
 
@@ -398,58 +1020,391 @@ public:
 	*/
 	u_int nNodes, maxNodes;
 
+	/**
+	   The compressed nodes, NULL if they are not used. They have the
+	   same indices of the nodes.
+	*/
+	QBVHCompressedNode *compressedNodes;
+
+	/**
+	   The instances of a two level tree, NULL otherwise. The leaves of
+	   the top level tree index this array instead of the quads.
+	*/
+	QBVHInstance *instances;
+	u_int nInstances;
+
+	/**
+	   The leaves table, NULL when all the leaves are encoded in the
+	   nodes. It is used when there are more than QBVH_COMPACT_MAX_QUADS
+	   quads or a leaf with more than QBVH_COMPACT_LEAF_MAX_QUADS quads.
+	*/
+	QBVHLeaf *leaves;
+	u_int nLeaves;
+
+	/**
+	   The ranges of nodes [refitFirstNode, refitLastNode) and quads
+	   modified by the last Refit(), the only ones to upload again
+	*/
+	u_int refitFirstNode, refitLastNode;
+	u_int refitFirstQuad, refitLastQuad;
+
 private:
+	/**
+	   The nodes of a tree under construction. The top of the tree and
+	   each subtree built in parallel have their own array, they are
+	   merged in the final nodes array at the end of the build.
+	*/
+	class BuildNodes {
+	public:
+		BuildNodes(const u_int initialSize);
+		~BuildNodes();
+
+		QBVHNode *nodes;
+		u_int nNodes, maxNodes;
+		u_int nQuads;
+		std::vector<QBVHLeaf> leaves;
+	};
+
+	/**
+	   A subtree to build in parallel, attached to the children
+	   childIndex of the parentIndex node of the top of the tree
+	*/
+	class BuildTask {
+	public:
+		u_int start, end;
+		BBox nodeBbox, centroidsBbox;
+		int32_t parentIndex, childIndex;
+		BuildNodes *nodes;
+	};
+
+	/**
+	   A leaf to convert in the pre-swizzled layout
+	*/
+	class SwizzleTask {
+	public:
+		u_int firstQuad, nbQuads, primOffset, nbPrims;
+	};
+	friend class SwizzleJob;
+
+	/**
+	   A reference to a primitive used by the split BVH builder. The
+	   same primitive can be referenced by several leaves, each reference
+	   with the part of the primitive bounding box inside its node.
+	*/
+	class SBVHReference {
+	public:
+		u_int primIndex;
+		BBox bbox;
+	};
+
+	/**
+	   The state shared by all the nodes of a split BVH build
+	*/
+	class SBVHBuildState {
+	public:
+		std::vector<u_int> leafPrims;
+		float rootArea;
+		u_int nRefs, maxRefs, nSpatialSplits;
+	};
+
+	/**
+	   Build the nodes and the quads
+	*/
+	void Build(const BuilderType builder);
+
+	/**
+	   The hash of the triangles and of the build parameters, a cache
+	   file is used only if it has been saved with the same key
+	*/
+	boost::uint64_t CacheKey(const BuilderType builder) const;
+
+	/**
+	   Map the nodes and the quads of a cache file in memory
+	   @return false if the file doesn't exist or has another key
+	*/
+	bool LoadCache(const std::string &fileName, const boost::uint64_t key);
+
+	void SaveCache(const std::string &fileName, const boost::uint64_t key) const;
+
+	/**
+	   A prototype of a two level tree, with the ranges of its
+	   nodes and quads in the arrays
+	*/
+	class PrototypeRange {
+	public:
+		const Triangle *triangles;
+		const Point *vertices;
+		int32_t rootNode;
+		u_int firstQuad, nQuads;
+	};
+
+	/**
+	   Compute again the bounding boxes of the children of a node and
+	   of its subtree, return the bounding box of the node
+	*/
+	BBox RefitNode(const int32_t nodeIndex, const Triangle *tris,
+		const Point *verts);
+
+	/**
+	   Decode the compressed nodes in nodes, for Refit()
+	*/
+	void DecompressNodes();
+
+	/**
+	   Compress again the nodes changed by Refit() and free the decoded
+	   ones. The refit range is reduced to the compressed nodes that are
+	   really different.
+	*/
+	void RecompressNodes();
+
+	/**
+	   Refit() of a two level tree: the prototypes are refitted, then
+	   the top level with the new bounding boxes of the instances
+	*/
+	bool RefitInstances();
+
+	BBox RefitTopNode(const int32_t nodeIndex, const std::vector<BBox> &prototypeBounds);
+
+	/**
+	   Add the nodes and the quads of a prototype after the ones
+	   already in the arrays, return the root of its tree
+	*/
+	int32_t AppendPrototype(const QBVHAccel &prototype, u_int *nodeOffset,
+		u_int *quadOffset, std::vector<QBVHLeaf> *table);
+
+	/**
+	   Encode a leaf of the final tree in the ith child of a node: in
+	   the node if table is NULL, as an index of a new leaf appended to
+	   table otherwise
+	*/
+	static void EncodeLeaf(QBVHNode &node, int i, u_int firstQuad, u_int nbQuads,
+		std::vector<QBVHLeaf> *table);
+
+	/**
+	   Replace the leaves table with a copy of table, or remove it if
+	   table is NULL
+	*/
+	void SetLeaves(const std::vector<QBVHLeaf> *table);
+
 	/**
 	   Build the tree that will contain the primitives indexed from start
-	   to end in the primsIndexes array.
+	   to end in the primsIndexes array. If tasks isn't NULL, the subtrees
+	   small enough are not built but added to the list of tasks.
 	*/
-	void BuildTree(u_int start, u_int end, u_int *primsIndexes, BBox *primsBboxes,
-		Point *primsCentroids, const BBox &nodeBbox,
+	void BuildTree(BuildNodes &bn, u_int start, u_int end, u_int *primsIndexes,
+		BBox *primsBboxes, Point *primsCentroids, const BBox &nodeBbox,
 		const BBox &centroidsBbox, int32_t parentIndex, int32_t childIndex,
+		int depth, std::vector<BuildTask> *tasks);
+
+	/**
+	   Find the binned SAH split of the primitives indexed from start to
+	   end, sampling one every step. Return the split axis, or -1 if the
+	   centroids are all in the same point, and set the split position
+	   and its cost (the sum of the areas multiplied by the number of
+	   sampled primitives of the children).
+	*/
+	int FindBinnedSplit(u_int start, u_int end, u_int step,
+		const u_int *primsIndexes, const BBox *primsBboxes,
+		const Point *primsCentroids, const BBox &centroidsBbox,
+		const bool parallelSplit, float *splitPos, float *splitCost) const;
+
+	/**
+	   Print the node count, the filling of the leaves and the SAH cost
+	*/
+	void PrintBuildReport(const double buildTime) const;
+
+	/**
+	   Build the tree with spatial splits (SBVH). The leaves index the
+	   leafPrims array of the state instead of primsIndexes.
+	*/
+	void BuildSBVH(BuildNodes &bn, const BBox *primsBboxes, SBVHBuildState &state);
+
+	void BuildSBVHTree(BuildNodes &bn, std::vector<SBVHReference> &refs,
+		const BBox &nodeBbox, int32_t parentIndex, int32_t childIndex,
+		int depth, SBVHBuildState &state);
+
+	/**
+	   Build the tree from the Morton codes of the centroids (linear
+	   BVH): the primitives are sorted along the Morton curve and each
+	   node is split at the highest bit that differs in its range.
+	   primsIndexes is sorted in the order of the leaves.
+	*/
+	void BuildLBVH(BuildNodes &bn, u_int *primsIndexes, const BBox *primsBboxes,
+		const Point *primsCentroids, const BBox &centroidsBbox);
+
+	/**
+	   Build the tree of the sorted primitives from start to end,
+	   return its bounding box
+	*/
+	BBox BuildLBVHTree(BuildNodes &bn, u_int start, u_int end,
+		const boost::uint64_t *codes, const u_int *primsIndexes,
+		const BBox *primsBboxes, int32_t parentIndex, int32_t childIndex,
 		int depth);
-	
+
+	/**
+	   A node of the binary hierarchy restructured by OptimizeTreelets(),
+	   its leaves are the temporary leaves of the QBVH
+	*/
+	class TreeletNode {
+	public:
+		BBox bbox;
+		int32_t children[2];
+		int32_t leafData;
+		u_int nbLeaves;
+		// The SAH cost of the subtree, not divided by the root area
+		float cost;
+	};
+
+	/**
+	   Restructure the treelets of the tree, see "Fast Parallel
+	   Construction of High-Quality Bounding Volume Hierarchies" by
+	   Karras and Aila (HPG 2013). The QBVH nodes are expanded in a binary
+	   hierarchy, the treelets of up to TREELET_LEAVES leaves are replaced
+	   with their optimal topology, bottom-up, then the hierarchy is
+	   collapsed again in QBVH nodes. The leaves don't change, it must be
+	   called before the pre-swizzle.
+	*/
+	void OptimizeTreelets();
+
+	/**
+	   Add the binary hierarchy of a QBVH node, return its root
+	*/
+	int32_t TreeletFromQBVH(std::vector<TreeletNode> &tree, const int32_t nodeIndex) const;
+
+	int32_t TreeletPair(std::vector<TreeletNode> &tree, const int32_t left,
+		const int32_t right) const;
+
+	/**
+	   Optimize the treelets of a subtree, bottom-up. The subtrees whose
+	   root is marked in done are not visited.
+	*/
+	static void OptimizeTreeletSubtree(std::vector<TreeletNode> &tree,
+		const int32_t root, const std::vector<char> *done);
+
+	/**
+	   Replace the treelet starting at root with its optimal topology
+	*/
+	static void OptimizeTreelet(std::vector<TreeletNode> &tree, const int32_t root);
+
+	/**
+	   The body of the threads optimizing the subtrees in parallel
+	*/
+	static void TreeletTasksThread(std::vector<TreeletNode> *tree,
+		const std::vector<int32_t> *tasks, u_int *nextTask, boost::mutex *taskMutex);
+
+	void TreeletToQBVH(BuildNodes &bn, const std::vector<TreeletNode> &tree,
+		const int32_t node, int32_t parentIndex, int32_t childIndex, int depth);
+
 	/**
-	   Create a leaf using the traditional QBVH layout
+	   The body of the build threads, they build the subtrees
+	   in the tasks list until there is nothing left to do
 	*/
-	void CreateTempLeaf(int32_t parentIndex, int32_t childIndex, u_int start, u_int end,
-		const BBox &nodeBbox);
+	static void BuildTasksThread(QBVHAccel *qbvh, std::vector<BuildTask> *tasks,
+		u_int *nextTask, boost::mutex *taskMutex, u_int *primsIndexes,
+		BBox *primsBboxes, Point *primsCentroids);
+
+	/**
+	   Create a leaf in the leaves table of the nodes under construction,
+	   referencing the primitives indexed from start to end
+	*/
+	void CreateTempLeaf(BuildNodes &bn, int32_t parentIndex, int32_t childIndex,
+		u_int start, u_int end, const BBox &nodeBbox);
 
 	/**
 	   Create an intermediate node
 	*/
-	inline int32_t CreateIntermediateNode(int32_t parentIndex, int32_t childIndex,
-		const BBox &nodeBbox) {
-		int32_t index = nNodes++; // increment after assignment
-		if (nNodes >= maxNodes) {
-			QBVHNode *newNodes = AllocAligned<QBVHNode>(2 * maxNodes);
-			memcpy(newNodes, nodes, sizeof(QBVHNode) * maxNodes);
-			for (u_int i = 0; i < maxNodes; ++i)
-				newNodes[maxNodes + i] = QBVHNode();
-			FreeAligned(nodes);
-			nodes = newNodes;
-			maxNodes *= 2;
+	inline int32_t CreateIntermediateNode(BuildNodes &bn, int32_t parentIndex,
+		int32_t childIndex, const BBox &nodeBbox) {
+		int32_t index = bn.nNodes++; // increment after assignment
+		if (bn.nNodes >= bn.maxNodes) {
+			QBVHNode *newNodes = AllocAligned<QBVHNode>(2 * bn.maxNodes);
+			memcpy(newNodes, bn.nodes, sizeof(QBVHNode) * bn.maxNodes);
+			for (u_int i = 0; i < bn.maxNodes; ++i)
+				newNodes[bn.maxNodes + i] = QBVHNode();
+			FreeAligned(bn.nodes);
+			bn.nodes = newNodes;
+			bn.maxNodes *= 2;
 		}
 
 		if (parentIndex >= 0) {
-			nodes[parentIndex].children[childIndex] = index;
-			nodes[parentIndex].SetBBox(childIndex, nodeBbox);
+			bn.nodes[parentIndex].children[childIndex] = index;
+			bn.nodes[parentIndex].SetBBox(childIndex, nodeBbox);
 		}
 		return index;
 	}
 
 	/**
-	   switch a node and its subnodes from the
+	   Copy the top of the tree and all the subtrees in the final
+	   nodes array, in the order of the tasks list
+	*/
+	void MergeTree(BuildNodes &top, std::vector<BuildTask> &tasks);
+
+	/**
+	   Lay out the nodes in clusters of QBVH_CLUSTER_NODES, each one
+	   filled breadth first from its root, the clusters in depth first
+	   order. A ray visits a few clusters, and the 4 children of a node
+	   are usually next to each other.
+	*/
+	void ReorderNodes();
+
+	/**
+	   Allocate the final arrays, in huge pages if they are enabled
+	*/
+	template<class T> T *AllocArray(const size_t size) const {
+		return hugePages ? AllocHugePages<T>(size) : AllocAligned<T>(size);
+	}
+
+	/**
+	   switch the nodes from the
 	   traditional form of QBVH to the pre-swizzled one.
+	   The QuadTriangle are then created in parallel from the
+	   list of swizzle tasks. The quads are in the order of the
+	   nodes, next to the ones of the sibling leaves. The leaves
+	   are encoded in the nodes when possible, the leaves table
+	   is kept only for the trees too large for it.
 	*/
-	void PreSwizzle(int32_t nodeIndex, u_int *primsIndexes);
+	void PreSwizzle(std::vector<SwizzleTask> &swizzleTasks);
 
 	/**
 	   Create a leaf using the pre-swizzled layout,
-	   using the informations stored in the node that
-	   are organized following the traditional layout
+	   using the informations stored in the leaves table
+	   during the build
+	*/
+	void CreateSwizzledLeaf(int32_t parentIndex, int32_t childIndex,
+		std::vector<SwizzleTask> &swizzleTasks, std::vector<QBVHLeaf> *table);
+
+	/**
+	   The body of Intersect() and IntersectP() for both node formats
+	*/
+	template<class NodeType> void IntersectTree(const NodeType *treeNodes,
+		const int32_t rootNode, const Ray &ray, RayHit *hit,
+		QBVHTraversalStats *stats) const;
+	template<class NodeType> bool IntersectPTree(const NodeType *treeNodes,
+		const int32_t rootNode, const Ray &ray, RayHit *hit,
+		QBVHTraversalStats *stats) const;
+
+	/**
+	   The body of Intersect() and IntersectP() for the two level
+	   trees: the leaves of the top level are tested with the
+	   prototype trees in the instance space
+	*/
+	template<class NodeType> void IntersectInstancesTree(const NodeType *treeNodes,
+		const Ray &ray, RayHit *hit, QBVHTraversalStats *stats) const;
+	template<class NodeType> bool IntersectPInstancesTree(const NodeType *treeNodes,
+		const Ray &ray, RayHit *hit, QBVHTraversalStats *stats) const;
+
+	/**
+	   The body of IntersectStream() and IntersectPStream()
+	*/
+	template<class NodeType> void TraceStream(const NodeType *treeNodes,
+		const Ray *rays, RayHit *hits, const u_int count,
+		const bool anyHit) const;
+
+	/**
+	   The mapped cache file, NULL if the tree has been built. The
+	   nodes and the quads point inside it when it is used.
 	*/
-	void CreateSwizzledLeaf(int32_t parentIndex, int32_t childIndex, 
-		u_int *primsIndexes);
+	boost::interprocess::mapped_region *cacheRegion;
 
 	/**
 	   The number of primitives
@@ -463,6 +1418,21 @@ private:
 	*/
 	BBox worldBound;
 
+	/**
+	   The prototypes and the instances of a two level tree, used
+	   by Refit()
+	*/
+	std::vector<PrototypeRange> prototypeRanges;
+	std::vector<u_int> instancePrototypes;
+	std::vector<Transform> instanceTransforms;
+
+	/**
+	   The algorithm used to build the tree and the SAH cost
+	   after the build, used by Refit()
+	*/
+	BuilderType builderType;
+	float buildSAHCost;
+
 	/**
 	   The number of primitives in the node that makes switch
 	   to full sweep for binning
@@ -479,6 +1449,39 @@ private:
 	*/
 	u_int maxPrimsPerLeaf;
 
+	/**
+	   The number of bins of the binned SAH, and if all the axes are
+	   evaluated or only the one of maximum extent
+	*/
+	u_int nbBins;
+	bool allAxes;
+
+	/**
+	   The cost of a node relative to the one of a quad, 0 to always
+	   split the nodes with more than maxPrimsPerLeaf primitives
+	*/
+	float traversalCost;
+
+	/**
+	   The number of threads used to build the tree
+	*/
+	u_int buildThreadCount;
+
+	/**
+	   The number of passes of OptimizeTreelets() after the build
+	*/
+	u_int treeletPasses;
+
+	/**
+	   If the nodes and the quads are allocated in huge pages
+	*/
+	bool hugePages;
+
+	/**
+	   If the leaves store the triangle indices instead of the quads
+	*/
+	bool indexedLeaves;
+
 	
 	// Adapted from Robin Bourianes (robin.bourianes@free.fr)
 	// Array indicating the order of visit
@@ -491,11 +1494,11 @@ private:
 	//                     bbox[1].IntersectP(ray) << 1 |
 	//                     bbox[2].IntersectP(ray) << 2 |
 	//                     bbox[3].IntersectP(ray) << 3;
-	// const u_int finalIdx = visit * 32 + idx * 4;
+	// const u_int finalIdx = visit * 8 + idx;
 	// It contains bounding box indices sorted by distance from the ray
-	// origin.
-	// 4 bits per index, stored in 32bit int. 4 means no intersection.
-	// 16 visit * 8 idx * 4 bbox = 128 * ints = 512bytes
+	// origin, the farthest first because they are pushed on a stack.
+	// 4 bits per index, stored in 16bit int. 4 means no more intersection.
+	// 16 visit * 8 idx = 128 * shorts = 256bytes
 	static const boost::int16_t pathTable[128];
 };
 
@@ -0,0 +1,216 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+// On disk cache of the QBVH. The file contains a header, the nodes, the
+// quads (or their triangle indices) and the leaves table if there is one,
+// as they are in memory. It is memory mapped when it is loaded, the pages
+// are shared with the OS file cache and only read when they are used.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+#if defined(WIN32) && !defined(__CYGWIN__)
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "qbvhaccel.h"
+
+using namespace boost::interprocess;
+
+// Change the last character when the layout of the file changes
+static const char cacheMagic[8] = { 'S', 'L', 'G', 'Q', 'B', 'V', 'H', '3' };
+
+// 64 bytes long, so the nodes and the quads that follow it are aligned
+// to the cache lines (the mapped file starts at a page boundary)
+class QBVHCacheHeader {
+public:
+	char magic[8];
+	boost::uint64_t key;
+	u_int nNodes, nQuads;
+	u_int nodeSize, quadSize;
+	float worldBound[6];
+	u_int nLeaves;
+	u_int pad;
+};
+
+// FNV-1a hash, on 32 bits words
+static inline boost::uint64_t HashWords(boost::uint64_t hash, const void *data,
+		const size_t wordCount) {
+	const u_int *words = static_cast<const u_int *>(data);
+	for (size_t i = 0; i < wordCount; ++i)
+		hash = (hash ^ words[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+/***************************************************/
+
+boost::uint64_t QBVHAccel::CacheKey(const BuilderType builder) const {
+	boost::uint64_t hash = 14695981039346656037ULL;
+
+	const u_int params[9] = {
+		nPrims, maxPrimsPerLeaf, fullSweepThreshold, skipFactor,
+		static_cast<u_int>(builder), treeletPasses, nbBins, allAxes ? 1u : 0u,
+		indexedLeaves ? 1u : 0u
+	};
+	hash = HashWords(hash, params, 9);
+	hash = HashWords(hash, &traversalCost, 1);
+
+	// The triangles and the positions of their vertices, the other
+	// vertices don't change the tree
+	for (u_int i = 0; i < nPrims; ++i) {
+		const Triangle &tri = triangles[i];
+		hash = HashWords(hash, tri.v, 3);
+		for (int j = 0; j < 3; ++j)
+			hash = HashWords(hash, &vertices[tri.v[j]], 3);
+	}
+
+	return hash;
+}
+
+bool QBVHAccel::LoadCache(const std::string &fileName, const boost::uint64_t key) {
+	// The pages are private, the tree can still be modified in memory
+	try {
+		file_mapping mapping(fileName.c_str(), read_only);
+		cacheRegion = new mapped_region(mapping, copy_on_write);
+	} catch (interprocess_exception &err) {
+		cerr << "Unable to map the QBVH cache file " << fileName << ": " << err.what() << endl;
+		return false;
+	}
+
+	const char *base = static_cast<const char *>(cacheRegion->get_address());
+	const size_t quadSize = indexedLeaves ? sizeof(IndexedQuad) : sizeof(QuadTriangle);
+	QBVHCacheHeader header;
+	bool valid = (cacheRegion->get_size() >= sizeof(QBVHCacheHeader));
+	if (valid) {
+		memcpy(&header, base, sizeof(QBVHCacheHeader));
+		valid = (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0) &&
+				(header.key == key) &&
+				(header.nodeSize == sizeof(QBVHNode)) &&
+				(header.quadSize == quadSize) &&
+				(cacheRegion->get_size() >= sizeof(QBVHCacheHeader) +
+					sizeof(QBVHNode) * static_cast<size_t>(header.nNodes) +
+					quadSize * static_cast<size_t>(header.nQuads) +
+					sizeof(QBVHLeaf) * static_cast<size_t>(header.nLeaves));
+	}
+	if (!valid) {
+		cerr << "The QBVH cache file " << fileName << " is out of date" << endl;
+		delete cacheRegion;
+		cacheRegion = NULL;
+		return false;
+	}
+
+	nNodes = header.nNodes;
+	maxNodes = header.nNodes;
+	nQuads = header.nQuads;
+	nodes = reinterpret_cast<QBVHNode *>(static_cast<char *>(cacheRegion->get_address()) +
+			sizeof(QBVHCacheHeader));
+	char *quads = reinterpret_cast<char *>(nodes + nNodes);
+	if (indexedLeaves)
+		indexedPrims = reinterpret_cast<IndexedQuad *>(quads);
+	else
+		prims = reinterpret_cast<QuadTriangle *>(quads);
+	nLeaves = header.nLeaves;
+	leaves = (nLeaves > 0) ? reinterpret_cast<QBVHLeaf *>(quads + quadSize * nQuads) : NULL;
+	worldBound = BBox(Point(header.worldBound[0], header.worldBound[1], header.worldBound[2]),
+			Point(header.worldBound[3], header.worldBound[4], header.worldBound[5]));
+
+	cerr << "QBVH loaded from the cache file " << fileName << " with " << nNodes << " nodes" << endl;
+
+	return true;
+}
+
+void QBVHAccel::SaveCache(const std::string &fileName, const boost::uint64_t key) const {
+	QBVHCacheHeader header;
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.key = key;
+	header.nNodes = nNodes;
+	header.nQuads = nQuads;
+	header.nodeSize = sizeof(QBVHNode);
+	header.quadSize = indexedPrims ? sizeof(IndexedQuad) : sizeof(QuadTriangle);
+	for (int axis = 0; axis < 3; ++axis) {
+		header.worldBound[axis] = worldBound.pMin[axis];
+		header.worldBound[3 + axis] = worldBound.pMax[axis];
+	}
+	header.nLeaves = leaves ? nLeaves : 0;
+	header.pad = 0;
+
+	// Write a temporary file and rename it, so the other processes
+	// rendering the same scene never map a partial file. Its name is
+	// unique, the processes saving the cache at the same time don't write
+	// the same file.
+	const std::string tmpFileTemplate = fileName + ".XXXXXX";
+	std::vector<char> tmpFileBuff(tmpFileTemplate.begin(), tmpFileTemplate.end());
+	tmpFileBuff.push_back('\0');
+#if defined(WIN32) && !defined(__CYGWIN__)
+	const bool tmpFileCreated = (_mktemp_s(&tmpFileBuff[0], tmpFileBuff.size()) == 0);
+#else
+	const int tmpFile = mkstemp(&tmpFileBuff[0]);
+	if (tmpFile != -1) {
+		// mkstemp() creates the file readable only by its owner
+		fchmod(tmpFile, 0644);
+		close(tmpFile);
+	}
+	const bool tmpFileCreated = (tmpFile != -1);
+#endif
+	if (!tmpFileCreated) {
+		cerr << "Unable to create a temporary file for the QBVH cache file " << fileName << endl;
+		return;
+	}
+	const std::string tmpFileName(&tmpFileBuff[0]);
+
+	{
+		std::ofstream file(tmpFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char *>(&header), sizeof(QBVHCacheHeader));
+		file.write(reinterpret_cast<const char *>(nodes), sizeof(QBVHNode) * nNodes);
+		if (indexedPrims)
+			file.write(reinterpret_cast<const char *>(indexedPrims), sizeof(IndexedQuad) * nQuads);
+		else
+			file.write(reinterpret_cast<const char *>(prims), sizeof(QuadTriangle) * nQuads);
+		if (leaves)
+			file.write(reinterpret_cast<const char *>(leaves), sizeof(QBVHLeaf) * nLeaves);
+		if (!file) {
+			cerr << "Unable to write the QBVH cache file " << tmpFileName << endl;
+			file.close();
+			remove(tmpFileName.c_str());
+			return;
+		}
+	}
+
+#if defined(WIN32)
+	// rename() doesn't replace an existing file on Windows
+	remove(fileName.c_str());
+#endif
+	if (rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+		cerr << "Unable to rename the QBVH cache file " << tmpFileName << endl;
+		remove(tmpFileName.c_str());
+		return;
+	}
+
+	cerr << "QBVH saved in the cache file " << fileName << endl;
+}
@@ -0,0 +1,310 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+// Two level QBVH. The top level tree is built over the bounding boxes of
+// the instances, each one of its leaves references a range of instances
+// instead of quads. The prototype trees are copied after the top level in
+// the same nodes and quads arrays, so the traversal code and the OpenCL
+// buffers are the same of a single level tree.
+
+#include <algorithm>
+
+#include "qbvhaccel.h"
+
+QBVHAccel::QBVHAccel(const std::vector<const QBVHAccel *> &prototypes,
+		const std::vector<u_int> &instPrototypes,
+		const std::vector<Transform> &instTransforms,
+		const std::vector<u_int> &triangleOffsets,
+		const bool compressNodes) : prims(NULL), indexedPrims(NULL),
+		compressedNodes(NULL), instances(NULL),
+		leaves(NULL), nLeaves(0), cacheRegion(NULL), fullSweepThreshold(0), skipFactor(1), maxPrimsPerLeaf(1),
+		nbBins(NB_BINS), allAxes(true), traversalCost(0.f), treeletPasses(0),
+		hugePages(false), indexedLeaves(false) {
+	const double startTime = WallClockTime();
+
+	nInstances = instPrototypes.size();
+	nPrims = nInstances;
+	vertices = NULL;
+	triangles = NULL;
+	buildThreadCount = 1;
+	builderType = BINNED_SAH;
+	instancePrototypes = instPrototypes;
+	instanceTransforms = instTransforms;
+
+	//--------------------------------------------------------------------------
+	// Build the top level tree, with an instance per leaf when possible
+	//--------------------------------------------------------------------------
+
+	u_int *primsIndexes = new u_int[nInstances];
+	BBox *primsBboxes = new BBox[nInstances];
+	Point *primsCentroids = new Point[nInstances];
+	BBox centroidsBbox;
+	worldBound = BBox();
+	for (u_int i = 0; i < nInstances; ++i) {
+		primsIndexes[i] = i;
+		primsBboxes[i] = instanceTransforms[i](prototypes[instancePrototypes[i]]->WorldBound());
+		primsCentroids[i] = (primsBboxes[i].pMin + primsBboxes[i].pMax) * .5f;
+
+		worldBound = Union(worldBound, primsBboxes[i]);
+		centroidsBbox = Union(centroidsBbox, primsCentroids[i]);
+	}
+
+	cerr << "Building QBVH top level, instances: " << nInstances <<
+			", prototypes: " << prototypes.size() << endl;
+
+	std::vector<BuildTask> tasks;
+	BuildNodes top(64);
+	BuildTree(top, 0, nInstances, primsIndexes, primsBboxes, primsCentroids,
+			worldBound, centroidsBbox, -1, 0, 0, NULL);
+	MergeTree(top, tasks);
+	const u_int nTopNodes = nNodes;
+
+	// The instances are stored in the order of primsIndexes, so the
+	// temporary leaves already reference their range. The number of
+	// instances of a leaf is the distance to the next range.
+	std::vector<u_int> leafOffsets(nLeaves);
+	for (u_int l = 0; l < nLeaves; ++l)
+		leafOffsets[l] = leaves[l].firstQuad;
+	std::sort(leafOffsets.begin(), leafOffsets.end());
+	std::vector<u_int> leafCounts(nLeaves);
+	for (u_int l = 0; l < nLeaves; ++l) {
+		const std::vector<u_int>::const_iterator next = std::upper_bound(
+				leafOffsets.begin(), leafOffsets.end(), leaves[l].firstQuad);
+		const u_int end = (next == leafOffsets.end()) ? nInstances : *next;
+		leafCounts[l] = end - leaves[l].firstQuad;
+	}
+
+	u_int totalNodes = nTopNodes;
+	u_int totalQuads = 0;
+	for (size_t p = 0; p < prototypes.size(); ++p) {
+		totalNodes += prototypes[p]->nNodes;
+		totalQuads += prototypes[p]->nQuads;
+	}
+
+	// The whole tree uses the leaves table if the top level or one of
+	// the prototypes can't be encoded in the nodes
+	bool compact = (totalQuads <= QBVH_COMPACT_MAX_QUADS) &&
+			(nInstances <= QBVH_COMPACT_MAX_QUADS);
+	for (u_int l = 0; l < nLeaves; ++l)
+		compact &= (leafCounts[l] <= QBVH_COMPACT_LEAF_MAX_QUADS);
+	for (size_t p = 0; p < prototypes.size(); ++p)
+		compact &= (prototypes[p]->leaves == NULL);
+
+	std::vector<QBVHLeaf> table;
+	for (u_int n = 0; n < nTopNodes; ++n) {
+		for (int c = 0; c < 4; ++c) {
+			if (!nodes[n].ChildIsLeaf(c) || nodes[n].LeafIsEmpty(c))
+				continue;
+
+			const u_int l = QBVHNode::LeafIndex(nodes[n].children[c]);
+			EncodeLeaf(nodes[n], c, leaves[l].firstQuad, leafCounts[l],
+					compact ? NULL : &table);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Copy the prototype trees after the top level
+	//--------------------------------------------------------------------------
+
+	QBVHNode *topNodes = nodes;
+	maxNodes = totalNodes;
+	nodes = AllocAligned<QBVHNode>(maxNodes);
+	memcpy(nodes, topNodes, sizeof(QBVHNode) * nTopNodes);
+	FreeAligned(topNodes);
+	prims = AllocAligned<QuadTriangle>(max(totalQuads, 1u));
+
+	u_int nodeOffset = nTopNodes;
+	u_int quadOffset = 0;
+	prototypeRanges.resize(prototypes.size());
+	for (size_t p = 0; p < prototypes.size(); ++p) {
+		prototypeRanges[p].triangles = prototypes[p]->triangles;
+		prototypeRanges[p].vertices = prototypes[p]->vertices;
+		prototypeRanges[p].firstQuad = quadOffset;
+		prototypeRanges[p].nQuads = prototypes[p]->nQuads;
+		prototypeRanges[p].rootNode = AppendPrototype(*prototypes[p], &nodeOffset, &quadOffset,
+				compact ? NULL : &table);
+	}
+	nNodes = nodeOffset;
+	nQuads = quadOffset;
+	SetLeaves(compact ? NULL : &table);
+	if (!compact)
+		cerr << "QBVH leaves table used for " << nLeaves << " leaves" << endl;
+
+	instances = AllocAligned<QBVHInstance>(nInstances);
+	for (u_int i = 0; i < nInstances; ++i) {
+		const u_int index = primsIndexes[i];
+		const Matrix4x4 worldToLocal = instanceTransforms[index].GetInverse().GetMatrix();
+
+		QBVHInstance &instance = instances[i];
+		for (int row = 0; row < 3; ++row) {
+			for (int col = 0; col < 4; ++col)
+				instance.worldToLocal[row][col] = worldToLocal.m[row][col];
+		}
+		instance.rootNode = prototypeRanges[instancePrototypes[index]].rootNode;
+		instance.triangleOffset = triangleOffsets[index];
+		instance.pad[0] = 0;
+		instance.pad[1] = 0;
+	}
+
+	// Refit() uses the instances in the same order
+	std::vector<u_int> sortedPrototypes(nInstances);
+	std::vector<Transform> sortedTransforms(nInstances);
+	for (u_int i = 0; i < nInstances; ++i) {
+		sortedPrototypes[i] = instancePrototypes[primsIndexes[i]];
+		sortedTransforms[i] = instanceTransforms[primsIndexes[i]];
+	}
+	instancePrototypes.swap(sortedPrototypes);
+	instanceTransforms.swap(sortedTransforms);
+
+	delete[] primsBboxes;
+	delete[] primsCentroids;
+	delete[] primsIndexes;
+
+	cerr << "QBVH top level completed with " << nTopNodes << " nodes in " <<
+			(WallClockTime() - startTime) << " secs, total: " << nNodes <<
+			" nodes and " << nQuads << " quads" << endl;
+
+	// The cost of the top level alone isn't comparable with the one of
+	// a single level tree, Refit() never builds the tree again
+	buildSAHCost = 0.f;
+
+	refitFirstNode = 0;
+	refitLastNode = nNodes;
+	refitFirstQuad = 0;
+	refitLastQuad = nQuads;
+
+	if (compressNodes) {
+		CompressNodes();
+		cerr << "QBVH compressed nodes: " << (sizeof(QBVHCompressedNode) * nNodes / 1024) <<
+				"Kb (" << (sizeof(QBVHNode) * nNodes / 1024) << "Kb uncompressed)" << endl;
+	}
+}
+
+int32_t QBVHAccel::AppendPrototype(const QBVHAccel &prototype, u_int *nodeOffset,
+		u_int *quadOffset, std::vector<QBVHLeaf> *table) {
+	const int32_t rootNode = *nodeOffset;
+
+	memcpy(&nodes[*nodeOffset], prototype.nodes, sizeof(QBVHNode) * prototype.nNodes);
+	for (u_int q = 0; q < prototype.nQuads; ++q) {
+		// The quads of the indexed leaves are built in place
+		QuadTriangle &quad = prims[*quadOffset + q];
+		if (prototype.indexedPrims)
+			prototype.LeafQuad(q, &quad);
+		else
+			quad = prototype.prims[q];
+	}
+
+	// Relocate the references to the nodes and to the quads
+	for (u_int n = *nodeOffset; n < *nodeOffset + prototype.nNodes; ++n) {
+		QBVHNode &node = nodes[n];
+		for (int c = 0; c < 4; ++c) {
+			if (!node.ChildIsLeaf(c))
+				node.children[c] += *nodeOffset;
+			else if (!node.LeafIsEmpty(c)) {
+				u_int offset, nbQuads;
+				prototype.DecodeLeaf(node.children[c], &offset, &nbQuads);
+				EncodeLeaf(node, c, offset + *quadOffset, nbQuads, table);
+			}
+		}
+	}
+
+	*nodeOffset += prototype.nNodes;
+	*quadOffset += prototype.nQuads;
+
+	return rootNode;
+}
+
+/***************************************************/
+
+BBox QBVHAccel::RefitTopNode(const int32_t nodeIndex,
+		const std::vector<BBox> &prototypeBounds) {
+	QBVHNode &node = nodes[nodeIndex];
+
+	BBox nodeBbox;
+	bool changed = false;
+	for (int c = 0; c < 4; ++c) {
+		BBox bbox;
+		if (node.ChildIsLeaf(c)) {
+			if (node.LeafIsEmpty(c))
+				continue;
+
+			u_int offset, nbInstances;
+			DecodeLeaf(node.children[c], &offset, &nbInstances);
+			for (u_int i = offset; i < offset + nbInstances; ++i)
+				bbox = Union(bbox, instanceTransforms[i](prototypeBounds[instancePrototypes[i]]));
+		} else
+			bbox = RefitTopNode(node.children[c], prototypeBounds);
+
+		for (int axis = 0; axis < 3; ++axis) {
+			changed |= (reinterpret_cast<float *>(&(node.bboxes[0][axis]))[c] != bbox.pMin[axis]) ||
+				(reinterpret_cast<float *>(&(node.bboxes[1][axis]))[c] != bbox.pMax[axis]);
+		}
+		node.SetBBox(c, bbox);
+		nodeBbox = Union(nodeBbox, bbox);
+	}
+
+	if (changed) {
+		refitFirstNode = min(refitFirstNode, static_cast<u_int>(nodeIndex));
+		refitLastNode = max(refitLastNode, static_cast<u_int>(nodeIndex) + 1);
+	}
+
+	return nodeBbox;
+}
+
+bool QBVHAccel::RefitInstances() {
+	const double startTime = WallClockTime();
+
+	refitFirstQuad = nQuads;
+	refitLastQuad = 0;
+	refitFirstNode = nNodes;
+	refitLastNode = 0;
+
+	// Refit the prototypes, each one with its own triangles
+	std::vector<BBox> prototypeBounds(prototypeRanges.size());
+	for (size_t p = 0; p < prototypeRanges.size(); ++p) {
+		const PrototypeRange &range = prototypeRanges[p];
+		for (u_int i = range.firstQuad; i < range.firstQuad + range.nQuads; ++i) {
+			const QuadTriangle quad(range.triangles, range.vertices,
+					prims[i].GetPrimitive(0), prims[i].GetPrimitive(1),
+					prims[i].GetPrimitive(2), prims[i].GetPrimitive(3));
+			if (memcmp(&quad, &prims[i], sizeof(QuadTriangle)) != 0) {
+				prims[i] = quad;
+				refitFirstQuad = min(refitFirstQuad, i);
+				refitLastQuad = max(refitLastQuad, i + 1);
+			}
+		}
+
+		prototypeBounds[p] = RefitNode(range.rootNode, range.triangles, range.vertices);
+	}
+
+	// The transformations don't change, only the bounding boxes of the
+	// top level are computed again
+	worldBound = RefitTopNode(0, prototypeBounds);
+
+	if (compressedNodes)
+		RecompressNodes();
+
+	cerr << "QBVH refit of " << prototypeRanges.size() << " prototypes and " <<
+			nInstances << " instances in " << (WallClockTime() - startTime) << " secs" << endl;
+
+	return false;
+}
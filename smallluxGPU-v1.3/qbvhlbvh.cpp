@@ -0,0 +1,270 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+// Linear BVH builder for the QBVH, see "Fast BVH Construction on GPUs" by
+// Lauterbach et al. (Eurographics 2009). The primitives are sorted along
+// the Morton curve of their centroids with a parallel radix sort, the
+// binary hierarchy given by the bits of the codes is collapsed in the
+// usual QBVH nodes. The tree is worse than the SAH one but it is built
+// in a fraction of the time, useful for the interactive scene loading.
+
+#include <boost/thread.hpp>
+#include <boost/ref.hpp>
+
+#include "qbvhaccel.h"
+
+/***************************************************/
+
+// Spread the lowest 21 bits of v, with 2 zero bits between them
+static inline boost::uint64_t ExpandBits(boost::uint64_t v) {
+	v &= 0x1fffffULL;
+	v = (v | (v << 32)) & 0x1f00000000ffffULL;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
+
+// The bit 3 * i + 2 of a code is a bit of x, 3 * i + 1 of y and 3 * i of z
+static inline int BitAxis(const int bit) {
+	return 2 - bit % 3;
+}
+
+template<class T> static void RunLBVHJobs(std::vector<T> &jobs) {
+	if (jobs.size() == 1) {
+		jobs[0]();
+		return;
+	}
+
+	boost::thread_group threads;
+	for (size_t i = 0; i < jobs.size(); ++i)
+		threads.create_thread(boost::ref(jobs[i]));
+	threads.join_all();
+}
+
+// Compute the Morton codes of a slice of the primitives
+class MortonJob {
+public:
+	void operator()() {
+		const float cells = static_cast<float>(1u << bitsPerAxis);
+		const u_int maxCell = (1u << bitsPerAxis) - 1;
+		float scale[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			const float extent = centroidsBbox.pMax[axis] - centroidsBbox.pMin[axis];
+			scale[axis] = (extent > 0.f) ? (cells / extent) : 0.f;
+		}
+
+		for (u_int i = start; i < end; ++i) {
+			u_int cell[3];
+			for (int axis = 0; axis < 3; ++axis)
+				cell[axis] = min(maxCell, static_cast<u_int>(max(0.f,
+						(primsCentroids[i][axis] - centroidsBbox.pMin[axis]) * scale[axis])));
+
+			codes[i] = (ExpandBits(cell[0]) << 2) | (ExpandBits(cell[1]) << 1) |
+					ExpandBits(cell[2]);
+			primsIndexes[i] = i;
+		}
+	}
+
+	u_int start, end;
+	int bitsPerAxis;
+	BBox centroidsBbox;
+	const Point *primsCentroids;
+	boost::uint64_t *codes;
+	u_int *primsIndexes;
+};
+
+// A pass of the radix sort over a slice of the codes: the first step counts
+// the digits, the second one copies the codes and the indices at their
+// position in the output arrays (starting at the offsets of the slice)
+class RadixSortJob {
+public:
+	void operator()() {
+		if (scatter) {
+			for (u_int i = start; i < end; ++i) {
+				const u_int digit = static_cast<u_int>(codes[i] >> shift) & 0xff;
+				const u_int dest = offsets[digit]++;
+				sortedCodes[dest] = codes[i];
+				sortedIndexes[dest] = primsIndexes[i];
+			}
+		} else {
+			for (u_int i = 0; i < 256; ++i)
+				offsets[i] = 0;
+			for (u_int i = start; i < end; ++i)
+				++offsets[static_cast<u_int>(codes[i] >> shift) & 0xff];
+		}
+	}
+
+	bool scatter;
+	u_int start, end;
+	int shift;
+	const boost::uint64_t *codes;
+	const u_int *primsIndexes;
+	boost::uint64_t *sortedCodes;
+	u_int *sortedIndexes;
+
+	u_int offsets[256];
+};
+
+/***************************************************/
+
+void QBVHAccel::BuildLBVH(BuildNodes &bn, u_int *primsIndexes, const BBox *primsBboxes,
+		const Point *primsCentroids, const BBox &centroidsBbox) {
+	const int bitsPerAxis = (nPrims < LBVH_30BIT_MAX_PRIMS) ? 10 : 21;
+	const size_t jobCount = min<size_t>(buildThreadCount, max(nPrims / 4096, 1u));
+
+	boost::uint64_t *codes = new boost::uint64_t[nPrims];
+	boost::uint64_t *sortedCodes = new boost::uint64_t[nPrims];
+	u_int *sortedIndexes = new u_int[nPrims];
+
+	std::vector<MortonJob> mortonJobs(jobCount);
+	for (size_t j = 0; j < jobCount; ++j) {
+		mortonJobs[j].start = static_cast<u_int>(nPrims * j / jobCount);
+		mortonJobs[j].end = static_cast<u_int>(nPrims * (j + 1) / jobCount);
+		mortonJobs[j].bitsPerAxis = bitsPerAxis;
+		mortonJobs[j].centroidsBbox = centroidsBbox;
+		mortonJobs[j].primsCentroids = primsCentroids;
+		mortonJobs[j].codes = codes;
+		mortonJobs[j].primsIndexes = primsIndexes;
+	}
+	RunLBVHJobs(mortonJobs);
+
+	// LSD radix sort, 8 bits per pass. The sort is stable, so the tree
+	// doesn't depend on the number of threads.
+	std::vector<RadixSortJob> sortJobs(jobCount);
+	for (int shift = 0; shift < 3 * bitsPerAxis; shift += 8) {
+		for (size_t j = 0; j < jobCount; ++j) {
+			sortJobs[j].scatter = false;
+			sortJobs[j].start = static_cast<u_int>(nPrims * j / jobCount);
+			sortJobs[j].end = static_cast<u_int>(nPrims * (j + 1) / jobCount);
+			sortJobs[j].shift = shift;
+			sortJobs[j].codes = codes;
+			sortJobs[j].primsIndexes = primsIndexes;
+			sortJobs[j].sortedCodes = sortedCodes;
+			sortJobs[j].sortedIndexes = sortedIndexes;
+		}
+		RunLBVHJobs(sortJobs);
+
+		// Skip the passes where all the codes have the same digit
+		bool sameDigit = false;
+		for (u_int d = 0; d < 256; ++d) {
+			u_int count = 0;
+			for (size_t j = 0; j < jobCount; ++j)
+				count += sortJobs[j].offsets[d];
+			if (count == nPrims)
+				sameDigit = true;
+		}
+		if (sameDigit)
+			continue;
+
+		// The slices of a digit follow each other in the job order
+		u_int offset = 0;
+		for (u_int d = 0; d < 256; ++d) {
+			for (size_t j = 0; j < jobCount; ++j) {
+				const u_int count = sortJobs[j].offsets[d];
+				sortJobs[j].offsets[d] = offset;
+				offset += count;
+			}
+		}
+		for (size_t j = 0; j < jobCount; ++j)
+			sortJobs[j].scatter = true;
+		RunLBVHJobs(sortJobs);
+
+		std::swap(codes, sortedCodes);
+		memcpy(primsIndexes, sortedIndexes, sizeof(u_int) * nPrims);
+	}
+
+	BuildLBVHTree(bn, 0, nPrims, codes, primsIndexes, primsBboxes, -1, 0, 0);
+
+	delete[] sortedIndexes;
+	delete[] sortedCodes;
+	delete[] codes;
+}
+
+BBox QBVHAccel::BuildLBVHTree(BuildNodes &bn, u_int start, u_int end,
+		const boost::uint64_t *codes, const u_int *primsIndexes,
+		const BBox *primsBboxes, int32_t parentIndex, int32_t childIndex,
+		int depth) {
+	if (end - start <= maxPrimsPerLeaf) {
+		BBox nodeBbox;
+		for (u_int i = start; i < end; ++i)
+			nodeBbox = Union(nodeBbox, primsBboxes[primsIndexes[i]]);
+		CreateTempLeaf(bn, parentIndex, childIndex, start, end, nodeBbox);
+		return nodeBbox;
+	}
+
+	// Split at the highest bit that differs in the range, all the codes
+	// before the split have it at 0. The primitives with the same code
+	// are split in the middle.
+	u_int split;
+	int axis;
+	const boost::uint64_t diff = codes[start] ^ codes[end - 1];
+	if (diff == 0) {
+		split = (start + end) / 2;
+		axis = 0;
+	} else {
+		int bit = 63;
+		while (!((diff >> bit) & 1))
+			--bit;
+		axis = BitAxis(bit);
+
+		u_int first = start;
+		u_int last = end - 1;
+		while (last - first > 1) {
+			const u_int middle = (first + last) / 2;
+			if ((codes[middle] >> bit) & 1)
+				last = middle;
+			else
+				first = middle;
+		}
+		split = last;
+	}
+
+	// Same layout of BuildTree(): a node every 2 levels of the binary
+	// hierarchy. The bounding boxes are known only after the children
+	// have been built.
+	int32_t currentNode = parentIndex;
+	int32_t leftChildIndex = childIndex;
+	int32_t rightChildIndex = childIndex + 1;
+	if (depth % 2 == 0) {
+		currentNode = CreateIntermediateNode(bn, parentIndex, childIndex, BBox());
+		leftChildIndex = 0;
+		rightChildIndex = 2;
+
+		bn.nodes[currentNode].axisMain = axis;
+	} else if (childIndex == 0)
+		bn.nodes[currentNode].axisSubLeft = axis;
+	else
+		bn.nodes[currentNode].axisSubRight = axis;
+
+	const BBox leftBbox = BuildLBVHTree(bn, start, split, codes, primsIndexes,
+			primsBboxes, currentNode, leftChildIndex, depth + 1);
+	const BBox rightBbox = BuildLBVHTree(bn, split, end, codes, primsIndexes,
+			primsBboxes, currentNode, rightChildIndex, depth + 1);
+
+	const BBox nodeBbox = Union(leftBbox, rightBbox);
+	if ((depth % 2 == 0) && (parentIndex >= 0))
+		bn.nodes[parentIndex].SetBBox(childIndex, nodeBbox);
+
+	return nodeBbox;
+}
@@ -0,0 +1,369 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+// Split BVH builder for the QBVH, see "Spatial Splits in Bounding Volume
+// Hierarchies" by Stich, Friedrich and Dietrich (HPG 2009).
+// The binary splits are collapsed in the usual QBVH nodes, a primitive
+// straddling a spatial split is referenced by both children.
+
+#include "qbvhaccel.h"
+
+/***************************************************/
+
+static bool IsEmpty(const BBox &bbox) {
+	return (bbox.pMin.x > bbox.pMax.x) || (bbox.pMin.y > bbox.pMax.y) ||
+			(bbox.pMin.z > bbox.pMax.z);
+}
+
+static BBox Intersection(const BBox &b1, const BBox &b2) {
+	BBox ret;
+	ret.pMin = Point(max(b1.pMin.x, b2.pMin.x), max(b1.pMin.y, b2.pMin.y),
+			max(b1.pMin.z, b2.pMin.z));
+	ret.pMax = Point(min(b1.pMax.x, b2.pMax.x), min(b1.pMax.y, b2.pMax.y),
+			min(b1.pMax.z, b2.pMax.z));
+	return ret;
+}
+
+// The bounding box of the part of a triangle between the planes lo and hi
+// along the axis
+static BBox ClipTriangle(const Point *p, const int axis,
+		const float lo, const float hi) {
+	BBox ret;
+	for (int i = 0; i < 3; ++i) {
+		const Point &a = p[i];
+		const Point &b = p[(i + 1) % 3];
+		const float va = a[axis];
+		const float vb = b[axis];
+
+		if ((va >= lo) && (va <= hi))
+			ret = Union(ret, a);
+
+		// Add the points where the edge crosses the planes
+		if ((va < lo && vb > lo) || (vb < lo && va > lo)) {
+			Point c = a + (b - a) * ((lo - va) / (vb - va));
+			c[axis] = lo;
+			ret = Union(ret, c);
+		}
+		if ((va < hi && vb > hi) || (vb < hi && va > hi)) {
+			Point c = a + (b - a) * ((hi - va) / (vb - va));
+			c[axis] = hi;
+			ret = Union(ret, c);
+		}
+	}
+
+	return ret;
+}
+
+// The part of a reference between the planes lo and hi along the axis
+static BBox ClipReference(const Triangle *triangles, const Point *vertices,
+		const u_int primIndex, const BBox &refBbox, const int axis,
+		const float lo, const float hi) {
+	const Triangle &tri = triangles[primIndex];
+	const Point p[3] = { vertices[tri.v[0]], vertices[tri.v[1]], vertices[tri.v[2]] };
+
+	BBox ret = ClipTriangle(p, axis, lo, hi);
+	if (IsEmpty(ret))
+		return ret;
+
+	// Keep the same margin of the primitive bounding boxes
+	ret.Expand(RAY_EPSILON);
+	return Intersection(ret, refBbox);
+}
+
+/***************************************************/
+
+void QBVHAccel::BuildSBVH(BuildNodes &bn, const BBox *primsBboxes,
+		SBVHBuildState &state) {
+	std::vector<SBVHReference> refs(nPrims);
+	for (u_int i = 0; i < nPrims; ++i) {
+		refs[i].primIndex = i;
+		refs[i].bbox = primsBboxes[i];
+	}
+
+	state.leafPrims.reserve(nPrims + nPrims / 2);
+	state.rootArea = worldBound.SurfaceArea();
+	state.nRefs = nPrims;
+	// The references are indexed on 32 bits
+	state.maxRefs = static_cast<u_int>(min<unsigned long long>(
+			SBVH_MAX_REFERENCES_FACTOR * static_cast<unsigned long long>(nPrims), 0xffffffffull));
+	state.nSpatialSplits = 0;
+
+	BuildSBVHTree(bn, refs, worldBound, -1, 0, 0, state);
+}
+
+void QBVHAccel::BuildSBVHTree(BuildNodes &bn, std::vector<SBVHReference> &refs,
+		const BBox &nodeBbox, int32_t parentIndex, int32_t childIndex, int depth,
+		SBVHBuildState &state) {
+	const u_int nbRefs = refs.size();
+
+	//--------------
+	// Look for the best object split, on all the axes
+
+	BBox centroidsBbox;
+	for (u_int i = 0; i < nbRefs; ++i)
+		centroidsBbox = Union(centroidsBbox, (refs[i].bbox.pMin + refs[i].bbox.pMax) * .5f);
+
+	int objectAxis = -1;
+	int objectBin = -1;
+	float objectCost = INFINITY;
+	BBox objectLeftBbox, objectRightBbox;
+	if (nbRefs > maxPrimsPerLeaf) {
+		for (int axis = 0; axis < 3; ++axis) {
+			const float k0 = centroidsBbox.pMin[axis];
+			const float k1 = SBVH_NB_BINS / (centroidsBbox.pMax[axis] - k0);
+			if (k1 == INFINITY)
+				continue;
+
+			int bins[SBVH_NB_BINS];
+			BBox binsBbox[SBVH_NB_BINS];
+			for (u_int i = 0; i < SBVH_NB_BINS; ++i)
+				bins[i] = 0;
+
+			for (u_int i = 0; i < nbRefs; ++i) {
+				const float centroid = (refs[i].bbox.pMin[axis] + refs[i].bbox.pMax[axis]) * .5f;
+				const int binId = min(SBVH_NB_BINS - 1, Floor2Int(k1 * (centroid - k0)));
+
+				bins[binId]++;
+				binsBbox[binId] = Union(binsBbox[binId], refs[i].bbox);
+			}
+
+			// The bounding boxes from the last bin to the ith
+			BBox bboxesRight[SBVH_NB_BINS];
+			int nbRight[SBVH_NB_BINS];
+			BBox currentBbox;
+			int currentNb = 0;
+			for (int i = SBVH_NB_BINS - 1; i >= 0; --i) {
+				currentBbox = Union(currentBbox, binsBbox[i]);
+				currentNb += bins[i];
+				bboxesRight[i] = currentBbox;
+				nbRight[i] = currentNb;
+			}
+
+			currentBbox = BBox();
+			currentNb = 0;
+			for (int i = 0; i < SBVH_NB_BINS - 1; ++i) {
+				currentBbox = Union(currentBbox, binsBbox[i]);
+				currentNb += bins[i];
+				if ((currentNb == 0) || (nbRight[i + 1] == 0))
+					continue;
+
+				const float cost = currentBbox.SurfaceArea() * currentNb +
+						bboxesRight[i + 1].SurfaceArea() * nbRight[i + 1];
+				if (cost < objectCost) {
+					objectAxis = axis;
+					objectBin = i;
+					objectCost = cost;
+					objectLeftBbox = currentBbox;
+					objectRightBbox = bboxesRight[i + 1];
+				}
+			}
+		}
+	}
+
+	//--------------
+	// Look for the best spatial split, only if the children of the object
+	// split overlap enough and the references budget isn't exhausted
+
+	int spatialAxis = -1;
+	int spatialBin = -1;
+	float spatialCost = INFINITY;
+	if ((nbRefs > maxPrimsPerLeaf) && (state.nRefs < state.maxRefs)) {
+		const BBox overlap = Intersection(objectLeftBbox, objectRightBbox);
+		const bool tryIt = (objectAxis < 0) || (!IsEmpty(overlap) &&
+				(overlap.SurfaceArea() > SBVH_ALPHA * state.rootArea));
+
+		for (int axis = 0; tryIt && (axis < 3); ++axis) {
+			const float k0 = nodeBbox.pMin[axis];
+			const float binWidth = (nodeBbox.pMax[axis] - k0) / SBVH_NB_BINS;
+			const float k1 = 1.f / binWidth;
+			if (!(binWidth > 0.f) || (k1 == INFINITY))
+				continue;
+
+			// Number of references starting and ending in each bin
+			int entries[SBVH_NB_BINS];
+			int exits[SBVH_NB_BINS];
+			BBox binsBbox[SBVH_NB_BINS];
+			for (u_int i = 0; i < SBVH_NB_BINS; ++i) {
+				entries[i] = 0;
+				exits[i] = 0;
+			}
+
+			for (u_int i = 0; i < nbRefs; ++i) {
+				const SBVHReference &ref = refs[i];
+				const int firstBin = Clamp(Floor2Int(k1 * (ref.bbox.pMin[axis] - k0)), 0, SBVH_NB_BINS - 1);
+				const int lastBin = Clamp(Floor2Int(k1 * (ref.bbox.pMax[axis] - k0)), firstBin, SBVH_NB_BINS - 1);
+
+				// Chop the reference in the bins it overlaps
+				for (int b = firstBin; b <= lastBin; ++b) {
+					const float lo = (b == firstBin) ? ref.bbox.pMin[axis] : k0 + b * binWidth;
+					const float hi = (b == lastBin) ? ref.bbox.pMax[axis] : k0 + (b + 1) * binWidth;
+					binsBbox[b] = Union(binsBbox[b], ClipReference(triangles, vertices,
+							ref.primIndex, ref.bbox, axis, lo, hi));
+				}
+
+				entries[firstBin]++;
+				exits[lastBin]++;
+			}
+
+			BBox bboxesRight[SBVH_NB_BINS];
+			int nbRight[SBVH_NB_BINS];
+			BBox currentBbox;
+			int currentNb = 0;
+			for (int i = SBVH_NB_BINS - 1; i >= 0; --i) {
+				currentBbox = Union(currentBbox, binsBbox[i]);
+				currentNb += exits[i];
+				bboxesRight[i] = currentBbox;
+				nbRight[i] = currentNb;
+			}
+
+			currentBbox = BBox();
+			currentNb = 0;
+			for (int i = 0; i < SBVH_NB_BINS - 1; ++i) {
+				currentBbox = Union(currentBbox, binsBbox[i]);
+				currentNb += entries[i];
+				if ((currentNb == 0) || (nbRight[i + 1] == 0))
+					continue;
+
+				// A split duplicating all the references doesn't make
+				// any progress
+				const u_int duplicates = currentNb + nbRight[i + 1] - nbRefs;
+				if ((duplicates == nbRefs) || (state.nRefs + duplicates > state.maxRefs))
+					continue;
+
+				const float cost = currentBbox.SurfaceArea() * currentNb +
+						bboxesRight[i + 1].SurfaceArea() * nbRight[i + 1];
+				if (cost < spatialCost) {
+					spatialAxis = axis;
+					spatialBin = i;
+					spatialCost = cost;
+				}
+			}
+		}
+	}
+
+	//--------------
+	// Create a leaf ?
+
+	if ((nbRefs <= maxPrimsPerLeaf) || ((objectAxis < 0) && (spatialAxis < 0) && (nbRefs <= 64))) {
+		const u_int start = state.leafPrims.size();
+		for (u_int i = 0; i < nbRefs; ++i)
+			state.leafPrims.push_back(refs[i].primIndex);
+		// Fill the last quad with the primitives of this leaf
+		while (state.leafPrims.size() % 4)
+			state.leafPrims.push_back(state.leafPrims.back());
+
+		CreateTempLeaf(bn, parentIndex, childIndex, start, start + nbRefs, nodeBbox);
+		return;
+	}
+
+	//--------------
+	// Split the references
+
+	std::vector<SBVHReference> leftRefs, rightRefs;
+	int axis;
+	if (spatialCost < objectCost) {
+		axis = spatialAxis;
+		const float k0 = nodeBbox.pMin[axis];
+		const float binWidth = (nodeBbox.pMax[axis] - k0) / SBVH_NB_BINS;
+		const float k1 = 1.f / binWidth;
+		const float splitPos = k0 + (spatialBin + 1) * binWidth;
+
+		for (u_int i = 0; i < nbRefs; ++i) {
+			const SBVHReference &ref = refs[i];
+			const int firstBin = Clamp(Floor2Int(k1 * (ref.bbox.pMin[axis] - k0)), 0, SBVH_NB_BINS - 1);
+			const int lastBin = Clamp(Floor2Int(k1 * (ref.bbox.pMax[axis] - k0)), firstBin, SBVH_NB_BINS - 1);
+
+			if (lastBin <= spatialBin)
+				leftRefs.push_back(ref);
+			else if (firstBin > spatialBin)
+				rightRefs.push_back(ref);
+			else {
+				// The reference straddles the split plane
+				SBVHReference left = ref;
+				left.bbox = ClipReference(triangles, vertices, ref.primIndex,
+						ref.bbox, axis, ref.bbox.pMin[axis], splitPos);
+				SBVHReference right = ref;
+				right.bbox = ClipReference(triangles, vertices, ref.primIndex,
+						ref.bbox, axis, splitPos, ref.bbox.pMax[axis]);
+
+				if (!IsEmpty(left.bbox))
+					leftRefs.push_back(left);
+				if (!IsEmpty(right.bbox))
+					rightRefs.push_back(right);
+			}
+		}
+
+		state.nRefs += leftRefs.size() + rightRefs.size() - nbRefs;
+		++state.nSpatialSplits;
+	} else if (objectAxis >= 0) {
+		axis = objectAxis;
+		const float k0 = centroidsBbox.pMin[axis];
+		const float k1 = SBVH_NB_BINS / (centroidsBbox.pMax[axis] - k0);
+
+		for (u_int i = 0; i < nbRefs; ++i) {
+			const float centroid = (refs[i].bbox.pMin[axis] + refs[i].bbox.pMax[axis]) * .5f;
+			const int binId = min(SBVH_NB_BINS - 1, Floor2Int(k1 * (centroid - k0)));
+
+			if (binId <= objectBin)
+				leftRefs.push_back(refs[i]);
+			else
+				rightRefs.push_back(refs[i]);
+		}
+	} else {
+		// All the references have the same centroid and there are too
+		// many of them for a single leaf, split the list in 2 halves
+		axis = nodeBbox.MaximumExtent();
+		leftRefs.assign(refs.begin(), refs.begin() + nbRefs / 2);
+		rightRefs.assign(refs.begin() + nbRefs / 2, refs.end());
+	}
+
+	// Release the memory before going deeper
+	std::vector<SBVHReference>().swap(refs);
+
+	BBox leftChildBbox, rightChildBbox;
+	for (u_int i = 0; i < leftRefs.size(); ++i)
+		leftChildBbox = Union(leftChildBbox, leftRefs[i].bbox);
+	for (u_int i = 0; i < rightRefs.size(); ++i)
+		rightChildBbox = Union(rightChildBbox, rightRefs[i].bbox);
+
+	// Create an intermediate node if the depth indicates to do so.
+	// Register the split axis.
+	int32_t currentNode = parentIndex;
+	int32_t leftChildIndex = childIndex;
+	int32_t rightChildIndex = childIndex + 1;
+	if (depth % 2 == 0) {
+		currentNode = CreateIntermediateNode(bn, parentIndex, childIndex, nodeBbox);
+		leftChildIndex = 0;
+		rightChildIndex = 2;
+
+		bn.nodes[currentNode].axisMain = axis;
+	} else if (childIndex == 0)
+		bn.nodes[currentNode].axisSubLeft = axis;
+	else
+		bn.nodes[currentNode].axisSubRight = axis;
+
+	// Build recursively
+	BuildSBVHTree(bn, leftRefs, leftChildBbox, currentNode, leftChildIndex,
+			depth + 1, state);
+	BuildSBVHTree(bn, rightRefs, rightChildBbox, currentNode, rightChildIndex,
+			depth + 1, state);
+}
@@ -0,0 +1,356 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2009 by David Bucciarelli (davibu@interfree.it)    *
+ *                                                                         *
+ *   This file is part of SmallLuxGPU.                                     *
+ *                                                                         *
+ *   SmallLuxGPU is free software; you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *  SmallLuxGPU is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   This project is based on PBRT ; see http://www.pbrt.org               *
+ *   and Lux Renderer website : http://www.luxrender.net                   *
+ ***************************************************************************/
+
+// Treelet restructuring of the QBVH, see "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies" by Karras and Aila (HPG 2013).
+// The tree is expanded in a binary hierarchy whose leaves are the
+// temporary leaves of the build, the topology of each treelet of up to
+// TREELET_LEAVES leaves is replaced with the one of minimum SAH cost,
+// found by dynamic programming over the subsets of its leaves. The
+// treelets are processed bottom-up, the disjoint subtrees in parallel.
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+#include "qbvhaccel.h"
+
+/***************************************************/
+
+void QBVHAccel::OptimizeTreelets() {
+	const double startTime = WallClockTime();
+
+	std::vector<TreeletNode> tree;
+	tree.reserve(8 * nNodes);
+	const int32_t root = TreeletFromQBVH(tree, 0);
+	if ((root < 0) || (tree[root].nbLeaves < 3))
+		return;
+
+	const float sahCostBefore = SAHCost();
+
+	const u_int maxTaskLeaves = max(tree[root].nbLeaves / (8 * buildThreadCount), 64u);
+	std::vector<int32_t> tasks;
+	std::vector<char> done(tree.size());
+	for (u_int pass = 0; pass < treeletPasses; ++pass) {
+		// Split the tree in subtrees to optimize in parallel, the nodes
+		// above them are optimized at the end by a single thread. It is
+		// done at each pass since the top treelets can move the nodes.
+		tasks.clear();
+		std::fill(done.begin(), done.end(), 0);
+		std::vector<int32_t> todo(1, root);
+		while (!todo.empty()) {
+			const int32_t n = todo.back();
+			todo.pop_back();
+			if (tree[n].children[0] < 0)
+				continue;
+
+			if (tree[n].nbLeaves <= maxTaskLeaves) {
+				tasks.push_back(n);
+				done[n] = 1;
+			} else {
+				todo.push_back(tree[n].children[0]);
+				todo.push_back(tree[n].children[1]);
+			}
+		}
+
+		u_int nextTask = 0;
+		boost::mutex taskMutex;
+		if (buildThreadCount == 1)
+			TreeletTasksThread(&tree, &tasks, &nextTask, &taskMutex);
+		else {
+			boost::thread_group threads;
+			for (u_int i = 0; i < buildThreadCount; ++i)
+				threads.create_thread(boost::bind(QBVHAccel::TreeletTasksThread,
+						&tree, &tasks, &nextTask, &taskMutex));
+			threads.join_all();
+		}
+
+		OptimizeTreeletSubtree(tree, root, &done);
+	}
+
+	// Collapse the binary hierarchy in QBVH nodes, the leaves are the same
+	BuildNodes bn(nNodes);
+	TreeletToQBVH(bn, tree, root, -1, 0, 0);
+	std::swap(nodes, bn.nodes);
+	nNodes = bn.nNodes;
+	maxNodes = bn.maxNodes;
+
+	cerr << "Treelets optimized in " << treeletPasses << " passes and " <<
+			(WallClockTime() - startTime) << " secs, SAH cost: " << sahCostBefore <<
+			" -> " << SAHCost() << " (" << tasks.size() << " subtrees)" << endl;
+}
+
+int32_t QBVHAccel::TreeletFromQBVH(std::vector<TreeletNode> &tree,
+		const int32_t nodeIndex) const {
+	const QBVHNode &node = nodes[nodeIndex];
+
+	// Each QBVH node is the pair of the pairs of children 0-1 and 2-3,
+	// the empty leaves are removed
+	int32_t slots[4];
+	for (int c = 0; c < 4; ++c) {
+		if (!node.ChildIsLeaf(c)) {
+			slots[c] = TreeletFromQBVH(tree, node.children[c]);
+			continue;
+		} else if (node.LeafIsEmpty(c)) {
+			slots[c] = -1;
+			continue;
+		}
+
+		TreeletNode leaf;
+		for (int axis = 0; axis < 3; ++axis) {
+			leaf.bbox.pMin[axis] = reinterpret_cast<const float *>(&(node.bboxes[0][axis]))[c];
+			leaf.bbox.pMax[axis] = reinterpret_cast<const float *>(&(node.bboxes[1][axis]))[c];
+		}
+		leaf.children[0] = -1;
+		leaf.children[1] = -1;
+		leaf.leafData = node.children[c];
+		leaf.nbLeaves = 1;
+		u_int offset, nbQuads;
+		DecodeLeaf(node.children[c], &offset, &nbQuads);
+		leaf.cost = leaf.bbox.SurfaceArea() * nbQuads;
+
+		slots[c] = static_cast<int32_t>(tree.size());
+		tree.push_back(leaf);
+	}
+
+	return TreeletPair(tree, TreeletPair(tree, slots[0], slots[1]),
+			TreeletPair(tree, slots[2], slots[3]));
+}
+
+int32_t QBVHAccel::TreeletPair(std::vector<TreeletNode> &tree, const int32_t left,
+		const int32_t right) const {
+	if (left < 0)
+		return right;
+	if (right < 0)
+		return left;
+
+	TreeletNode pair;
+	pair.bbox = Union(tree[left].bbox, tree[right].bbox);
+	pair.children[0] = left;
+	pair.children[1] = right;
+	pair.leafData = 0;
+	pair.nbLeaves = tree[left].nbLeaves + tree[right].nbLeaves;
+	pair.cost = TREELET_NODE_COST * pair.bbox.SurfaceArea() +
+			tree[left].cost + tree[right].cost;
+
+	tree.push_back(pair);
+	return static_cast<int32_t>(tree.size() - 1);
+}
+
+/***************************************************/
+
+void QBVHAccel::TreeletTasksThread(std::vector<TreeletNode> *tree,
+		const std::vector<int32_t> *tasks, u_int *nextTask, boost::mutex *taskMutex) {
+	for (;;) {
+		u_int taskIndex;
+		{
+			boost::mutex::scoped_lock lock(*taskMutex);
+			if (*nextTask >= tasks->size())
+				return;
+			taskIndex = (*nextTask)++;
+		}
+
+		OptimizeTreeletSubtree(*tree, (*tasks)[taskIndex], NULL);
+	}
+}
+
+void QBVHAccel::OptimizeTreeletSubtree(std::vector<TreeletNode> &tree,
+		const int32_t root, const std::vector<char> *done) {
+	if (tree[root].children[0] < 0)
+		return;
+	// The subtrees built in parallel are already optimized
+	if (done && (*done)[root])
+		return;
+
+	// The treelets are formed after the optimization of the children
+	OptimizeTreeletSubtree(tree, tree[root].children[0], done);
+	OptimizeTreeletSubtree(tree, tree[root].children[1], done);
+	OptimizeTreelet(tree, root);
+}
+
+void QBVHAccel::OptimizeTreelet(std::vector<TreeletNode> &tree, const int32_t root) {
+	TreeletNode &rootNode = tree[root];
+	// The costs of the children can have changed
+	rootNode.cost = TREELET_NODE_COST * rootNode.bbox.SurfaceArea() +
+			tree[rootNode.children[0]].cost + tree[rootNode.children[1]].cost;
+
+	// Form the treelet, expanding the leaf of largest area until there
+	// are enough leaves
+	int32_t leaves[TREELET_LEAVES];
+	int32_t internals[TREELET_LEAVES - 1];
+	u_int nLeaves = 2;
+	u_int nInternals = 1;
+	leaves[0] = rootNode.children[0];
+	leaves[1] = rootNode.children[1];
+	internals[0] = root;
+	while (nLeaves < TREELET_LEAVES) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (u_int i = 0; i < nLeaves; ++i) {
+			const TreeletNode &n = tree[leaves[i]];
+			if (n.children[0] < 0)
+				continue;
+			const float area = n.bbox.SurfaceArea();
+			if (area > bestArea) {
+				best = i;
+				bestArea = area;
+			}
+		}
+		if (best < 0)
+			break;
+
+		const int32_t expanded = leaves[best];
+		internals[nInternals++] = expanded;
+		leaves[best] = tree[expanded].children[0];
+		leaves[nLeaves++] = tree[expanded].children[1];
+	}
+	if (nLeaves < 3)
+		return;
+
+	// Minimum cost of each subset of the leaves, and the subset of the
+	// left child of its best partition
+	const u_int nSubsets = 1u << nLeaves;
+	float costs[1 << TREELET_LEAVES];
+	BBox bboxes[1 << TREELET_LEAVES];
+	u_int splits[1 << TREELET_LEAVES];
+	for (u_int s = 1; s < nSubsets; ++s) {
+		const u_int lowBit = s & (~s + 1);
+		if (s == lowBit) {
+			u_int i = 0;
+			while ((1u << i) != s)
+				++i;
+			bboxes[s] = tree[leaves[i]].bbox;
+			costs[s] = tree[leaves[i]].cost;
+			splits[s] = 0;
+			continue;
+		}
+
+		bboxes[s] = Union(bboxes[s ^ lowBit], bboxes[lowBit]);
+
+		// Each partition is enumerated once, with the lowest leaf on the
+		// left side
+		float bestCost = INFINITY;
+		u_int bestSplit = lowBit;
+		for (u_int p = (s - 1) & s; p; p = (p - 1) & s) {
+			if (!(p & lowBit))
+				continue;
+			const float cost = costs[p] + costs[s ^ p];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = p;
+			}
+		}
+		costs[s] = TREELET_NODE_COST * bboxes[s].SurfaceArea() + bestCost;
+		splits[s] = bestSplit;
+	}
+
+	// Keep the current topology if it isn't worse
+	const u_int all = nSubsets - 1;
+	if (!(costs[all] < tree[root].cost * (1.f - 1e-5f)))
+		return;
+
+	// Rebuild the treelet reusing its internal nodes, the root first. A
+	// stack of subsets is enough since each node is written only after
+	// its children are known.
+	u_int stack[2 * TREELET_LEAVES];
+	int32_t stackNodes[2 * TREELET_LEAVES];
+	int stackSize = 0;
+	u_int nextInternal = 0;
+	stack[stackSize] = all;
+	stackNodes[stackSize++] = internals[nextInternal++];
+	while (stackSize > 0) {
+		const u_int s = stack[--stackSize];
+		const int32_t index = stackNodes[stackSize];
+
+		const u_int sides[2] = { splits[s], s ^ splits[s] };
+		TreeletNode &node = tree[index];
+		node.nbLeaves = 0;
+		for (int c = 0; c < 2; ++c) {
+			if ((sides[c] & (sides[c] - 1)) == 0) {
+				u_int i = 0;
+				while ((1u << i) != sides[c])
+					++i;
+				node.children[c] = leaves[i];
+				node.nbLeaves += tree[leaves[i]].nbLeaves;
+			} else {
+				node.children[c] = internals[nextInternal++];
+				stack[stackSize] = sides[c];
+				stackNodes[stackSize++] = node.children[c];
+				// The leaves of the subset
+				for (u_int i = 0; i < nLeaves; ++i) {
+					if (sides[c] & (1u << i))
+						node.nbLeaves += tree[leaves[i]].nbLeaves;
+				}
+			}
+		}
+		node.bbox = bboxes[s];
+		node.cost = costs[s];
+	}
+}
+
+/***************************************************/
+
+void QBVHAccel::TreeletToQBVH(BuildNodes &bn, const std::vector<TreeletNode> &tree,
+		const int32_t node, int32_t parentIndex, int32_t childIndex, int depth) {
+	const TreeletNode &n = tree[node];
+
+	if (n.children[0] < 0) {
+		// The temporary leaf keeps its encoding
+		if (parentIndex < 0) {
+			bn.nNodes = 1;
+			parentIndex = 0;
+		}
+		bn.nodes[parentIndex].SetBBox(childIndex, n.bbox);
+		bn.nodes[parentIndex].children[childIndex] = n.leafData;
+		return;
+	}
+
+	// The split axis is the one separating the most the children, the
+	// left child is the one with the lowest center along it
+	const Point leftCenter = (tree[n.children[0]].bbox.pMin + tree[n.children[0]].bbox.pMax) * .5f;
+	const Point rightCenter = (tree[n.children[1]].bbox.pMin + tree[n.children[1]].bbox.pMax) * .5f;
+	int axis = 0;
+	for (int a = 1; a < 3; ++a) {
+		if (fabsf(rightCenter[a] - leftCenter[a]) > fabsf(rightCenter[axis] - leftCenter[axis]))
+			axis = a;
+	}
+	const bool swapChildren = rightCenter[axis] < leftCenter[axis];
+	const int32_t left = n.children[swapChildren ? 1 : 0];
+	const int32_t right = n.children[swapChildren ? 0 : 1];
+
+	// Same node layout of BuildTree(), a QBVH node every 2 levels
+	int32_t currentNode = parentIndex;
+	int32_t leftChildIndex = childIndex;
+	int32_t rightChildIndex = childIndex + 1;
+	if (depth % 2 == 0) {
+		currentNode = CreateIntermediateNode(bn, parentIndex, childIndex, n.bbox);
+		leftChildIndex = 0;
+		rightChildIndex = 2;
+
+		bn.nodes[currentNode].axisMain = axis;
+	} else if (childIndex == 0)
+		bn.nodes[currentNode].axisSubLeft = axis;
+	else
+		bn.nodes[currentNode].axisSubRight = axis;
+
+	TreeletToQBVH(bn, tree, left, currentNode, leftChildIndex, depth + 1);
+	TreeletToQBVH(bn, tree, right, currentNode, rightChildIndex, depth + 1);
+}
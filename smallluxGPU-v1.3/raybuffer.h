@@ -23,11 +23,12 @@
 #ifndef _RAYBUFFER_H
 #define	_RAYBUFFER_H
 
-//#include <boost/thread/mutex.hpp>
-//#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include <vector>
-#include <deque>
+#include <algorithm>
+#include "smalllux.h"
 #include "ray.h"
 
 class PathIntegrator;
@@ -35,22 +36,75 @@ class PathIntegrator;
 // Must be a multiple of 1024 (for AMD CPU device) and 64 (for most GPUs)
 #define RAY_BUFFER_SIZE (65536)
 
+// The default capacity of a RayBufferQueue, it must be larger than the
+// RayBuffers in flight of a render thread (DEVICE_RENDER_BUFFER_COUNT)
+#define RAY_BUFFER_QUEUE_SIZE (64)
+
 typedef struct {
 	float t;
 	float b1, b2; // Barycentric coordinates of the hit point
 	unsigned int index;
 } RayHit;
 
+// The kind of query to perform for a ray (must match qbvh_kernel.cl)
+enum RayType {
+	RAY_INTERSECT = 0, // Look for the closest hit
+	RAY_OCCLUSION = 1 // Look for any hit (i.e. shadow rays)
+};
+
 class RayBuffer {
 public:
-	RayBuffer(const size_t bufferSize) : size(bufferSize), currentFreeRayIndex(0) {
+	RayBuffer(const size_t bufferSize) : size(bufferSize), currentFreeRayIndex(0), slice(false) {
 		rays = new Ray[size];
+		rayTypes = new unsigned char[size];
 		rayHits = new RayHit[size];
+#if defined(QBVH_TRAVERSAL_STATS)
+		// Only the native devices count the traversals
+		rayCosts = new unsigned int[size];
+		std::fill(rayCosts, rayCosts + size, 0u);
+#endif
+	}
+
+	// A slice of the count rays of rayBuffer starting at first: the memory is
+	// shared, the hits are written in rayBuffer. The size, used by the OpenCL
+	// devices as the work size, can be larger than count.
+	RayBuffer(RayBuffer *rayBuffer, const size_t first, const size_t count,
+			const size_t sliceSize) : size(sliceSize), currentFreeRayIndex(count), slice(true) {
+		rays = rayBuffer->rays + first;
+		rayTypes = rayBuffer->rayTypes + first;
+		rayHits = rayBuffer->rayHits + first;
+#if defined(QBVH_TRAVERSAL_STATS)
+		rayCosts = rayBuffer->rayCosts + first;
+#endif
+	}
+
+	// A coalesced RayBuffer made of the rays of other RayBuffers, without
+	// copying them: the devices trace each part in place
+	RayBuffer(const vector<RayBuffer *> &rayBuffers) : size(0), currentFreeRayIndex(0),
+			slice(true), parts(rayBuffers) {
+		for (size_t i = 0; i < parts.size(); ++i) {
+			size += parts[i]->GetSize();
+			currentFreeRayIndex += parts[i]->GetRayCount();
+		}
+
+		rays = NULL;
+		rayTypes = NULL;
+		rayHits = NULL;
+#if defined(QBVH_TRAVERSAL_STATS)
+		rayCosts = NULL;
+#endif
 	}
 
 	~RayBuffer() {
+		if (slice)
+			return;
+
 		delete rays;
+		delete[] rayTypes;
 		delete rayHits;
+#if defined(QBVH_TRAVERSAL_STATS)
+		delete[] rayCosts;
+#endif
 	}
 
 	void PushUserData(size_t data) {
@@ -80,12 +134,15 @@ public:
 		currentFreeRayIndex = 0;
 	}
 
-	size_t ReserveRay() {
+	size_t ReserveRay(const RayType type = RAY_INTERSECT) {
+		rayTypes[currentFreeRayIndex] = type;
+
 		return currentFreeRayIndex++;
 	}
 
-	size_t AddRay(const Ray &ray) {
+	size_t AddRay(const Ray &ray, const RayType type = RAY_INTERSECT) {
 		rays[currentFreeRayIndex] = ray;
+		rayTypes[currentFreeRayIndex] = type;
 
 		return currentFreeRayIndex++;
 	}
@@ -106,6 +163,19 @@ public:
 		return (currentFreeRayIndex >= size);
 	}
 
+	// A RayBuffer which isn't coalesced has only one part: itself
+	bool IsCoalesced() const {
+		return !parts.empty();
+	}
+
+	size_t GetPartCount() const {
+		return parts.empty() ? 1 : parts.size();
+	}
+
+	RayBuffer *GetPart(const size_t index) {
+		return parts.empty() ? this : parts[index];
+	}
+
 	size_t LeftSpace() {
 		return size - currentFreeRayIndex;
 	}
@@ -114,68 +184,182 @@ public:
 		return rays;
 	}
 
+	unsigned char *GetRayTypeBuffer() const {
+		return rayTypes;
+	}
+
 	RayHit *GetHitBuffer() {
 		return rayHits;
 	}
 
+#if defined(QBVH_TRAVERSAL_STATS)
+	// The traversal cost of each ray (see QBVHTraversalStats::Cost())
+	unsigned int GetRayCost(const size_t index) const {
+		return rayCosts[index];
+	}
+
+	unsigned int *GetRayCostBuffer() {
+		return rayCosts;
+	}
+#endif
+
 private:
 	size_t size;
 	size_t currentFreeRayIndex;
 	vector<size_t> userData;
+	// True if the memory belongs to other RayBuffers
+	bool slice;
+	// The RayBuffers of a coalesced RayBuffer
+	vector<RayBuffer *> parts;
 
 	Ray *rays;
+	unsigned char *rayTypes; // One RayType for each ray
 	RayHit *rayHits;
+#if defined(QBVH_TRAVERSAL_STATS)
+	unsigned int *rayCosts;
+#endif
 };
 
-// NOTE: this class must be thread safe
+// A bounded FIFO of RayBuffers, shared by any number of producer and
+// consumer threads. Push() waits while the queue is full, so the producers
+// are slowed down to the pace of the consumers, and Pop() waits while it
+// is empty. Both waits are boost::thread interruption points. The mutex
+// is only contended when several threads use the queue at the same time.
 class RayBufferQueue {
 public:
-
-	RayBufferQueue() {
+	RayBufferQueue(const size_t capacity = RAY_BUFFER_QUEUE_SIZE) :
+		buffers(capacity), first(0), count(0) {
+		ResetStats();
 	}
 
 	~RayBufferQueue() {
 	}
 
 	void Clear() {
-		//boost::unique_lock<boost::mutex> lock(queueMutex);
+		{
+			boost::unique_lock<boost::mutex> lock(queueMutex);
+			first = 0;
+			count = 0;
+		}
 
-		queue.clear();
+		notFull.notify_all();
 	}
 
 	size_t Size() {
-		//boost::unique_lock<boost::mutex> lock(queueMutex);
+		boost::unique_lock<boost::mutex> lock(queueMutex);
 
-		return queue.size();
+		return count;
+	}
+
+	size_t GetCapacity() const {
+		return buffers.size();
 	}
 
 	void Push(RayBuffer *rayBuffer) {
 		{
-			//boost::unique_lock<boost::mutex> lock(queueMutex);
-			queue.push_back(rayBuffer);
+			boost::unique_lock<boost::mutex> lock(queueMutex);
+
+			if (count >= buffers.size()) {
+				// Wait for a consumer to make some room
+				const double startTime = WallClockTime();
+				while (count >= buffers.size())
+					notFull.wait(lock);
+				statsPushWaitTime += WallClockTime() - startTime;
+			}
+
+			buffers[(first + count) % buffers.size()] = rayBuffer;
+			++count;
+			statsMaxSize = max(statsMaxSize, count);
 		}
 
-		//condition.notify_all();
+		notEmpty.notify_one();
+	}
+
+	// Pop the first RayBuffer if there is one no larger than maxSize,
+	// without waiting
+	RayBuffer *TryPop(const size_t maxSize) {
+		RayBuffer *rayBuffer;
+		{
+			boost::unique_lock<boost::mutex> lock(queueMutex);
+
+			if ((count == 0) || (buffers[first]->GetSize() > maxSize))
+				return NULL;
+
+			rayBuffer = buffers[first];
+			first = (first + 1) % buffers.size();
+			--count;
+		}
+
+		notFull.notify_one();
+
+		return rayBuffer;
 	}
 
 	RayBuffer *Pop() {
-		//boost::unique_lock<boost::mutex> lock(queueMutex);
+		RayBuffer *rayBuffer;
+		{
+			boost::unique_lock<boost::mutex> lock(queueMutex);
+
+			if (count == 0) {
+				// Wait for a new buffer to arrive
+				const double startTime = WallClockTime();
+				while (count == 0)
+					notEmpty.wait(lock);
+				statsPopWaitTime += WallClockTime() - startTime;
+			}
+
+			rayBuffer = buffers[first];
+			first = (first + 1) % buffers.size();
+			--count;
+		}
 
-		//while (queue.size() < 1) {
-			// Wait for a new buffer to arrive
-			//condition.wait(lock);
-		//}
+		notFull.notify_one();
 
-		RayBuffer *rayBuffer = queue.front();
-		queue.pop_front();
 		return rayBuffer;
 	}
 
+	//--------------------------------------------------------------------------
+	// Statistics: the maximum depth reached and the time spent waiting by
+	// the producers (the queue was full) and by the consumers (the queue
+	// was empty)
+	//--------------------------------------------------------------------------
+
+	void ResetStats() {
+		boost::unique_lock<boost::mutex> lock(queueMutex);
+
+		statsMaxSize = count;
+		statsPushWaitTime = 0.0;
+		statsPopWaitTime = 0.0;
+	}
+
+	size_t GetMaxSize() {
+		boost::unique_lock<boost::mutex> lock(queueMutex);
+
+		return statsMaxSize;
+	}
+
+	double GetPushWaitTime() {
+		boost::unique_lock<boost::mutex> lock(queueMutex);
+
+		return statsPushWaitTime;
+	}
+
+	double GetPopWaitTime() {
+		boost::unique_lock<boost::mutex> lock(queueMutex);
+
+		return statsPopWaitTime;
+	}
+
 private:
-	//boost::mutex queueMutex;
-	//boost::condition_variable condition;
+	boost::mutex queueMutex;
+	boost::condition_variable notEmpty, notFull;
+
+	// A ring buffer of count RayBuffers starting at first
+	std::vector<RayBuffer *> buffers;
+	size_t first, count;
 
-	std::deque<RayBuffer *> queue;
+	size_t statsMaxSize;
+	double statsPushWaitTime, statsPopWaitTime;
 };
 
 #endif	/* _RAYBUFFER_H */
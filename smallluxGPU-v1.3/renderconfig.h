@@ -43,10 +43,16 @@ public:
 		cfg.insert(make_pair("image.width", "640"));
 		cfg.insert(make_pair("image.height", "480"));
 		cfg.insert(make_pair("batch.halttime", "0"));
+		cfg.insert(make_pair("batch.animation.frames", "0"));
+		cfg.insert(make_pair("batch.animation.plyfile", ""));
 		cfg.insert(make_pair("scene.file", "scenes/luxball.scn"));
 		cfg.insert(make_pair("scene.fieldofview", "45"));
 		cfg.insert(make_pair("opencl.latency.mode", "0"));
 		cfg.insert(make_pair("opencl.nativethread.count", "0"));
+		cfg.insert(make_pair("opencl.nativethread.poolsize", "0"));
+		cfg.insert(make_pair("opencl.nativethread.async", "0"));
+		cfg.insert(make_pair("opencl.o2m.slicesize", "0"));
+		cfg.insert(make_pair("opencl.m2o.coalesce", "0"));
 		cfg.insert(make_pair("opencl.renderthread.count", "4"));
 		cfg.insert(make_pair("opencl.cpu.use", "0"));
 		cfg.insert(make_pair("opencl.gpu.use", "1"));
@@ -58,6 +64,17 @@ public:
 		cfg.insert(make_pair("screen.type", "3"));
 		cfg.insert(make_pair("path.maxdepth", "3"));
 		cfg.insert(make_pair("path.shadowrays", "1"));
+		cfg.insert(make_pair("accelerator.builder", "0"));
+		cfg.insert(make_pair("accelerator.compressednodes", "0"));
+		cfg.insert(make_pair("accelerator.cache", "0"));
+		cfg.insert(make_pair("accelerator.progressive", "0"));
+		cfg.insert(make_pair("accelerator.treelets", "0"));
+		cfg.insert(make_pair("accelerator.leafsize", "4"));
+		cfg.insert(make_pair("accelerator.bins", "8"));
+		cfg.insert(make_pair("accelerator.traversalcost", "0"));
+		cfg.insert(make_pair("accelerator.allaxes", "1"));
+		cfg.insert(make_pair("accelerator.hugepages", "0"));
+		cfg.insert(make_pair("accelerator.indexedleaves", "0"));
 
 		cerr << "Reading configuration file: " << fileName << endl;
 
@@ -103,6 +120,8 @@ public:
 
 		for (size_t i = 0; i < intersectionAllDevices.size(); ++i)
 			delete intersectionAllDevices[i];
+		if (nativeThreadPool)
+			delete nativeThreadPool;
 
 		delete scene;
 		delete film;
@@ -114,6 +133,10 @@ public:
 		const unsigned int w = atoi(cfg.find("image.width")->second.c_str());
 		const unsigned int h = atoi(cfg.find("image.height")->second.c_str());
 		const unsigned int nativeThreadCount = atoi(cfg.find("opencl.nativethread.count")->second.c_str());
+		const unsigned int nativeThreadPoolSize = atoi(cfg.find("opencl.nativethread.poolsize")->second.c_str());
+		const unsigned int nativeAsyncThreadCount = atoi(cfg.find("opencl.nativethread.async")->second.c_str());
+		const unsigned int o2mSliceSize = atoi(cfg.find("opencl.o2m.slicesize")->second.c_str());
+		const bool m2oCoalesce = (atoi(cfg.find("opencl.m2o.coalesce")->second.c_str()) == 1);
 		const bool useCPUs = (atoi(cfg.find("opencl.cpu.use")->second.c_str()) == 1);
 		const bool useGPUs = (atoi(cfg.find("opencl.gpu.use")->second.c_str()) == 1);
 		const unsigned int forceGPUWorkSize = atoi(cfg.find("opencl.gpu.workgroup.size")->second.c_str());
@@ -121,12 +144,27 @@ public:
 		const unsigned int oclPlatformIndex = atoi(cfg.find("opencl.platform.index")->second.c_str());
 		const string oclDeviceConfig = cfg.find("opencl.devices.select")->second;
 		const string oclDeviceThreads = cfg.find("opencl.devices.threads")->second;
+		const unsigned int accelBuilder = atoi(cfg.find("accelerator.builder")->second.c_str());
+		const bool accelCompressNodes = (atoi(cfg.find("accelerator.compressednodes")->second.c_str()) == 1);
+		const bool accelCache = (atoi(cfg.find("accelerator.cache")->second.c_str()) == 1);
+		const bool accelProgressive = (atoi(cfg.find("accelerator.progressive")->second.c_str()) == 1);
+		const unsigned int accelTreeletPasses = atoi(cfg.find("accelerator.treelets")->second.c_str());
+		const unsigned int accelLeafSize = atoi(cfg.find("accelerator.leafsize")->second.c_str());
+		const unsigned int accelBins = atoi(cfg.find("accelerator.bins")->second.c_str());
+		const float accelTraversalCost = atof(cfg.find("accelerator.traversalcost")->second.c_str());
+		const bool accelAllAxes = (atoi(cfg.find("accelerator.allaxes")->second.c_str()) == 1);
+		const bool accelHugePages = (atoi(cfg.find("accelerator.hugepages")->second.c_str()) == 1);
+		const bool accelIndexedLeaves = (atoi(cfg.find("accelerator.indexedleaves")->second.c_str()) == 1);
 
 		screenRefreshInterval = atoi(cfg.find("screen.refresh.interval")->second.c_str());
 
 		Init(lowLatency, sceneFileName, w, h, nativeThreadCount,
 			useCPUs, useGPUs, forceGPUWorkSize, filmType,
-			oclPlatformIndex, oclDeviceThreads, oclDeviceConfig);
+			oclPlatformIndex, oclDeviceThreads, oclDeviceConfig, accelBuilder,
+			accelCompressNodes, accelCache, accelProgressive, accelTreeletPasses,
+			accelLeafSize, accelBins, accelTraversalCost, accelAllAxes, accelHugePages,
+			accelIndexedLeaves, nativeThreadPoolSize, nativeAsyncThreadCount, o2mSliceSize,
+			m2oCoalesce);
 
 		StopAllDevice();
 		for (size_t i = 0; i < renderThreads.size(); ++i)
@@ -143,7 +181,15 @@ public:
 		const bool useCPUs, const bool useGPUs,
 		const unsigned int forceGPUWorkSize, const unsigned int filmType,
 		const unsigned int oclPlatformIndex = 0,
-		const string &oclDeviceThreads = "", const string &oclDeviceConfig = "") {
+		const string &oclDeviceThreads = "", const string &oclDeviceConfig = "",
+		const unsigned int accelBuilder = 0, const bool accelCompressNodes = false,
+		const bool accelCache = false, const bool accelProgressive = false,
+		const unsigned int accelTreeletPasses = 0, const unsigned int accelLeafSize = 4,
+		const unsigned int accelBins = NB_BINS, const float accelTraversalCost = 0.f,
+		const bool accelAllAxes = true, const bool accelHugePages = false,
+		const bool accelIndexedLeaves = false, const unsigned int nativeThreadPoolSize = 0,
+		const unsigned int nativeAsyncThreadCount = 0, const unsigned int o2mSliceSize = 0,
+		const bool m2oCoalesce = false) {
 
 		captionBuffer[0] = '\0';
 
@@ -170,14 +216,47 @@ public:
 			default:
 				throw runtime_error("Requested an unknown film type");
 		}
-		scene = new Scene(lowLatency, sceneFileName, film);
+
+		switch (accelBuilder) {
+			case 0:
+				cerr << "Accelerator builder: binned SAH" << endl;
+				break;
+			case 1:
+				cerr << "Accelerator builder: split BVH" << endl;
+				break;
+			case 2:
+				cerr << "Accelerator builder: linear BVH" << endl;
+				break;
+			default:
+				throw runtime_error("Requested an unknown accelerator builder");
+		}
+		if (accelCompressNodes)
+			cerr << "Accelerator nodes: compressed" << endl;
+		if (accelIndexedLeaves)
+			cerr << "Accelerator leaves: indexed triangles" << endl;
+		scene = new Scene(lowLatency, sceneFileName, film,
+				static_cast<QBVHAccel::BuilderType>(accelBuilder), accelCompressNodes,
+				accelCache, accelProgressive, accelTreeletPasses, accelLeafSize,
+				accelBins, accelTraversalCost, accelAllAxes, accelHugePages,
+				accelIndexedLeaves);
 
 		// Start OpenCL devices
 		SetUpOpenCLDevices(lowLatency, useCPUs, useGPUs, forceGPUWorkSize, oclDeviceConfig);
 
-		// Start Native threads
+		// The asynchronous native device is used like the OpenCL devices, by
+		// the DeviceRenderThreads and with them in the VirtualO2MIntersectionDevice
+		if (nativeAsyncThreadCount > 0) {
+			cerr << "Native asynchronous device threads: " << nativeAsyncThreadCount << endl;
+			intersectionGPUDevices.push_back(new AsyncNativeIntersectionDevice(scene, lowLatency,
+					intersectionGPUDevices.size(), nativeAsyncThreadCount));
+		}
+
+		// Start Native threads, sharing the thread pool if there is one
+		nativeThreadPool = ((nativeThreadCount > 0) && (nativeThreadPoolSize > 0)) ?
+			new NativeThreadPool(scene, nativeThreadPoolSize) : NULL;
 		for (unsigned int i = 0; i < nativeThreadCount; ++i) {
-			NativeIntersectionDevice *device = new NativeIntersectionDevice(scene, lowLatency, i);
+			NativeIntersectionDevice *device = new NativeIntersectionDevice(scene, lowLatency, i,
+					nativeThreadPool);
 			intersectionCPUDevices.push_back(device);
 		}
 
@@ -209,8 +288,9 @@ public:
 				t->Start();
 			} else {
 				// Create and start the virtual devices (only if htere is more than one GPUs)
-				o2mDevice = new VirtualO2MIntersectionDevice(intersectionGPUDevices, scene, 0);
-				m2oDevice = new VirtualM2OIntersectionDevice(gpuRenderThreadCount, o2mDevice, scene);
+				o2mDevice = new VirtualO2MIntersectionDevice(intersectionGPUDevices, scene, 0, o2mSliceSize);
+				m2oDevice = new VirtualM2OIntersectionDevice(gpuRenderThreadCount, o2mDevice, scene,
+						m2oCoalesce);
 
 				for (size_t i = 0; i < gpuRenderThreadCount; ++i) {
 					DeviceRenderThread *t = new DeviceRenderThread(i + 1, m2oDevice->GetVirtualDevice(i), scene, lowLatency);
@@ -336,6 +416,25 @@ public:
 		StartAllDevice();
 	}
 
+	// Move the objects to the vertices of a .ply file (see
+	// Scene::MoveObjects()) and update the scene
+	void RefitScene(const string &plyFileName) {
+		// First stop all devices
+		StopAllDevice();
+
+		scene->MoveObjects(plyFileName);
+		scene->Refit();
+		for (size_t i = 0; i < intersectionAllDevices.size(); ++i)
+			intersectionAllDevices[i]->UpdateQBVH();
+
+		film->Reset();
+		for (size_t i = 0; i < renderThreads.size(); ++i)
+			renderThreads[i]->ClearPaths();
+
+		// Restart all devices
+		StartAllDevice();
+	}
+
 	void SetMaxPathDepth(const int delta) {
 		// First stop all devices
 		StopAllDevice();
@@ -393,6 +492,7 @@ private:
 	VirtualO2MIntersectionDevice *o2mDevice;
 
 	vector<NativeIntersectionDevice *> intersectionCPUDevices;
+	NativeThreadPool *nativeThreadPool;
 
 	vector<IntersectionDevice *> intersectionAllDevices;
 };
@@ -19,6 +19,7 @@
  ***************************************************************************/
 
 #include <cstring>
+#include <deque>
 
 #include "renderthread.h"
 #include "raybuffer.h"
@@ -49,8 +50,9 @@ NativeRenderThread::NativeRenderThread(unsigned int index, NativeIntersectionDev
 	const size_t sampleBufferSize = lowLatency ? (SAMPLE_BUFFER_SIZE / 4) : SAMPLE_BUFFER_SIZE;
 	sampleBuffer = new SampleBuffer(sampleBufferSize);
 
-	// Ray buffer (small buffers work well with CPU)
-	const size_t rayBufferSize = 1024;
+	// Ray buffer (small buffers work well with CPU, the thread pool splits
+	// the large ones in chunks traced by all the idle threads)
+	const size_t rayBufferSize = device->GetThreadPool() ? (RAY_BUFFER_SIZE / 8) : 1024;
 	sampler = new RandomSampler(lowLatency, threadIndex + 1,
 		scene->camera->film->GetWidth(), scene->camera->film->GetHeight());
 
@@ -32,6 +32,9 @@ typedef struct {
 	float screenX, screenY;
 	unsigned int pass;
 	Spectrum radiance;
+#if defined(QBVH_TRAVERSAL_STATS)
+	float traversalCost;
+#endif
 } SampleBufferElem;
 
 class SampleBuffer {
@@ -54,6 +57,9 @@ public:
 		s->screenY = sample->screenY;
 		s->pass = sample->pass;
 		s->radiance = radiance;
+#if defined(QBVH_TRAVERSAL_STATS)
+		s->traversalCost = sample->traversalCost;
+#endif
 	}
 
 	SampleBufferElem *GetSampleBuffer() const { return samples; }
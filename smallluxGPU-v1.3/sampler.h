@@ -52,6 +52,9 @@ public:
 		screenX = x;
 		screenY = y;
 		pass = p;
+#if defined(QBVH_TRAVERSAL_STATS)
+		traversalCost = 0.f;
+#endif
 	}
 
 	float GetLazyValue() {
@@ -60,6 +63,10 @@ public:
 
 	float screenX, screenY;
 	unsigned int pass;
+#if defined(QBVH_TRAVERSAL_STATS)
+	// The traversal cost of all the rays of the sample
+	float traversalCost;
+#endif
 
 private:
 	Sampler *sampler;
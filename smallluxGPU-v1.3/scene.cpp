@@ -25,15 +25,60 @@
 #include <istream>
 #include <stdexcept>
 #include <sstream>
+#include <map>
+#include <boost/bind.hpp>
 
 #include "scene.h"
 
 using namespace std;
 
-Scene::Scene(const bool lowLatency, const string &fileName, Film *film) {
+// The 8-wide version of a QBVH, when the CPU supports it
+static OBVHAccel *NewOBVH(const QBVHAccel &qbvh, const TriangleMesh *mesh,
+		const bool accelCompressNodes) {
+	// The OBVH nodes are not compressed, they would defeat the purpose
+	if (accelCompressNodes) {
+		cerr << "Compressed nodes requested, using the QBVH" << endl;
+		return NULL;
+	} else if (qbvh.leaves) {
+		// The OBVH leaves have only the encoding in the nodes
+		cerr << "QBVH leaves table used, using the QBVH" << endl;
+		return NULL;
+	} else if (qbvh.indexedPrims) {
+		// The OBVH would store again the full triangles
+		cerr << "QBVH indexed leaves used, using the QBVH" << endl;
+		return NULL;
+	} else if (OBVHAccel::IsSupported()) {
+		cerr << "AVX2 available, building the 8-wide OBVH" << endl;
+		return new OBVHAccel(qbvh, mesh->triangles, mesh->vertices);
+	} else {
+		cerr << "AVX2 not available, using the QBVH" << endl;
+		return NULL;
+	}
+}
+
+Scene::Scene(const bool lowLatency, const string &fileName, Film *film,
+		const QBVHAccel::BuilderType accelBuilder, const bool accelCompressNodes,
+		const bool accelCache, const bool accelProgressive,
+		const unsigned int accelTreeletPasses, const unsigned int accelLeafSize,
+		const unsigned int accelBins, const float accelTraversalCost,
+		const bool accelAllAxes, const bool accelHugePages,
+		const bool accelIndexedLeaves) {
 	maxPathDepth = 3;
 	shadowRayCount = 1;
 
+	this->accelTreeletPasses = accelTreeletPasses;
+	this->accelLeafSize = max(accelLeafSize, 1u);
+	this->accelBins = accelBins;
+	this->accelTraversalCost = accelTraversalCost;
+	this->accelAllAxes = accelAllAxes;
+	this->accelHugePages = accelHugePages;
+	this->accelIndexedLeaves = accelIndexedLeaves;
+
+	accelVersion = 0;
+	accelBuildThread = NULL;
+	pendingQBVH = NULL;
+	pendingOBVH = NULL;
+
 	cerr << "Reading scene: " << fileName << endl;
 
 	ifstream file;
@@ -102,6 +147,61 @@ Scene::Scene(const bool lowLatency, const string &fileName, Film *film) {
 	cerr << "Vertex count: " << mesh->vertexCount << " (" << (mesh->vertexCount * sizeof(Point) / 1024) << "Kb)" << endl;
 	cerr << "Triangle count: " << mesh->triangleCount << " (" << (mesh->triangleCount * sizeof(Triangle) / 1024) << "Kb)" << endl;
 
+	//--------------------------------------------------------------------------
+	// Read the optional instances, one per line:
+	//   instance <.ply file> <the 3 rows of the local to world matrix>
+	// Each .ply file is read only once, all its instances share the same
+	// QBVH.
+	//--------------------------------------------------------------------------
+
+	file.exceptions(ifstream::badbit);
+	vector<string> prototypeFileNames;
+	map<string, size_t> prototypeIndices;
+	vector<size_t> instancePrototypes;
+	unsigned long long triangleOffset = mesh->triangleCount;
+	string entry;
+	while (file >> entry) {
+		if (entry != "instance")
+			throw runtime_error("Unknown entry in scene file: " + entry);
+
+		file >> plyFileName;
+		float m[4][4];
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j)
+				file >> m[i][j];
+		}
+		m[3][0] = 0.f;
+		m[3][1] = 0.f;
+		m[3][2] = 0.f;
+		m[3][3] = 1.f;
+		if (!file)
+			throw runtime_error("Wrong instance entry in scene file: " + plyFileName);
+
+		map<string, size_t>::const_iterator it = prototypeIndices.find(plyFileName);
+		size_t prototype;
+		if (it == prototypeIndices.end()) {
+			cerr << "PLY instanced file name: " << plyFileName << endl;
+			prototype = prototypes.size();
+			prototypes.push_back(new TriangleMesh(plyFileName));
+			prototypeFileNames.push_back(plyFileName);
+			prototypeIndices[plyFileName] = prototype;
+		} else
+			prototype = it->second;
+
+		// The triangle indices of the hits are 32 bit
+		if (triangleOffset + prototypes[prototype]->triangleCount >= 0xffffffffu)
+			throw runtime_error("Too many instanced triangles in scene file");
+
+		instances.push_back(MeshInstance(prototypes[prototype], Transform(m),
+				static_cast<unsigned int>(triangleOffset)));
+		instancePrototypes.push_back(prototype);
+		triangleOffset += prototypes[prototype]->triangleCount;
+	}
+
+	if (!instances.empty())
+		cerr << "Instance count: " << instances.size() << " of " << prototypes.size() <<
+				" meshes (" << (triangleOffset - mesh->triangleCount) << " triangles)" << endl;
+
 	//--------------------------------------------------------------------------
 	// Create light sources list
 	//--------------------------------------------------------------------------
@@ -116,10 +216,141 @@ Scene::Scene(const bool lowLatency, const string &fileName, Film *film) {
 	// Create BVH
 	//--------------------------------------------------------------------------
 
-	const int maxPrimsPerLeaf = 4;
-	const int fullSweepThreshold = 4 * maxPrimsPerLeaf;
-	const int skipFactor = 1;
+	if (!instances.empty()) {
+		// Two level QBVH: the mesh and each instanced .ply file have their
+		// own tree, cached next to their file, and the mesh is the first
+		// instance with the identity transformation
+		vector<const QBVHAccel *> bvhs;
+		bvhs.push_back(NewQBVH(mesh, accelBuilder, false,
+				accelCache ? (fileName + ".qbvh") : ""));
+		for (size_t i = 0; i < prototypes.size(); ++i)
+			bvhs.push_back(NewQBVH(prototypes[i], accelBuilder, false,
+					accelCache ? (prototypeFileNames[i] + ".qbvh") : ""));
+
+		vector<u_int> bvhInstances(1, 0);
+		vector<Transform> bvhTransforms(1, Transform());
+		vector<u_int> bvhTriangleOffsets(1, 0);
+		for (size_t i = 0; i < instances.size(); ++i) {
+			bvhInstances.push_back(instancePrototypes[i] + 1);
+			bvhTransforms.push_back(instances[i].localToWorld);
+			bvhTriangleOffsets.push_back(instances[i].triangleOffset);
+		}
+
+		qbvh = new QBVHAccel(bvhs, bvhInstances, bvhTransforms, bvhTriangleOffsets,
+				accelCompressNodes);
+		for (size_t i = 0; i < bvhs.size(); ++i)
+			delete bvhs[i];
+
+		// The OBVH has a single level
+		cerr << "Instances available, using the QBVH" << endl;
+		obvh = NULL;
+		return;
+	}
+
+	// The cache file is next to the scene file
+	const string cacheFileName = accelCache ? (fileName + ".qbvh") : "";
+
+	// A progressive scene starts to render with a linear BVH, the final
+	// tree is built in background. It is useless when the final tree can
+	// be loaded from the cache.
+	bool progressive = accelProgressive && (accelBuilder != QBVHAccel::LBVH);
+	if (progressive && accelCache) {
+		ifstream cacheFile(cacheFileName.c_str(), ios::in | ios::binary);
+		progressive = !cacheFile.is_open();
+	}
+
+	if (progressive) {
+		cerr << "Progressive QBVH: rendering with a linear BVH while the final one is built" << endl;
+		qbvh = NewQBVH(mesh, QBVHAccel::LBVH, accelCompressNodes, "");
+		obvh = NULL;
+
+		accelBuildThread = new boost::thread(boost::bind(Scene::AcceleratorBuildThread,
+				this, accelBuilder, accelCompressNodes, cacheFileName));
+		return;
+	}
+
+	qbvh = NewQBVH(mesh, accelBuilder, accelCompressNodes, cacheFileName);
+	obvh = NewOBVH(*qbvh, mesh, accelCompressNodes);
+}
+
+QBVHAccel *Scene::NewQBVH(const TriangleMesh *m, const QBVHAccel::BuilderType accelBuilder,
+		const bool accelCompressNodes, const string &cacheFileName) const {
+	// The full sweep is used for the small nodes
+	return new QBVHAccel(m->triangleCount, m->triangles, m->vertices,
+			accelLeafSize, 4 * accelLeafSize, 1, accelBuilder, accelCompressNodes,
+			cacheFileName, accelTreeletPasses, accelBins, accelTraversalCost,
+			accelAllAxes, accelHugePages, accelIndexedLeaves);
+}
+
+void Scene::AcceleratorBuildThread(Scene *scene, const QBVHAccel::BuilderType accelBuilder,
+		const bool accelCompressNodes, const string cacheFileName) {
+	const TriangleMesh *mesh = scene->mesh;
+	QBVHAccel *qbvh = scene->NewQBVH(mesh, accelBuilder, accelCompressNodes, cacheFileName);
+	OBVHAccel *obvh = NewOBVH(*qbvh, mesh, accelCompressNodes);
+
+	boost::mutex::scoped_lock lock(scene->pendingAccelMutex);
+	scene->pendingQBVH = qbvh;
+	scene->pendingOBVH = obvh;
+}
+
+bool Scene::SwapAccelerator(const bool wait) {
+	if (!accelBuildThread)
+		return false;
+
+	if (!wait) {
+		boost::mutex::scoped_lock lock(pendingAccelMutex);
+		if (!pendingQBVH)
+			return false;
+	}
+
+	accelBuildThread->join();
+	delete accelBuildThread;
+	accelBuildThread = NULL;
+
+	// Wait for the RayBuffers traced with the old accelerators
+	boost::unique_lock<boost::shared_mutex> lock(accelMutex);
+	delete obvh;
+	delete qbvh;
+	qbvh = pendingQBVH;
+	obvh = pendingOBVH;
+	pendingQBVH = NULL;
+	pendingOBVH = NULL;
+	++accelVersion;
+
+	cerr << "Progressive QBVH: final tree in use" << endl;
+
+	return true;
+}
+
+void Scene::MoveObjects(const string &plyFileName) {
+	cerr << "PLY moved objects file name: " << plyFileName << endl;
+
+	TriangleMesh objects(plyFileName);
+
+	// Only the vertices can change, the topology must stay the same
+	if (objects.triangleCount != meshLightOffset) {
+		stringstream ss;
+		ss << "Wrong triangle count in PLY file '" << plyFileName << "': " <<
+				objects.triangleCount << " instead of " << meshLightOffset;
+		throw runtime_error(ss.str());
+	}
+	for (unsigned int i = 0; i < objects.triangleCount; ++i) {
+		for (unsigned int j = 0; j < 3; ++j) {
+			if (objects.triangles[i].v[j] != mesh->triangles[i].v[j]) {
+				stringstream ss;
+				ss << "Triangle " << i << " in PLY file '" << plyFileName << "' doesn't match the scene";
+				throw runtime_error(ss.str());
+			}
+		}
+	}
+
+	// The final QBVH can still be built in background from the mesh
+	SwapAccelerator(true);
 
-	qbvh = new QBVHAccel(mesh->triangleCount, mesh->triangles, mesh->vertices,
-			maxPrimsPerLeaf, fullSweepThreshold, skipFactor);
+	// The vertices of the objects are the first of the mesh, the lights
+	// don't move
+	for (unsigned int i = 0; i < objects.vertexCount; ++i) {
+		mesh->vertices[i] = objects.vertices[i];
+		mesh->vertNormals[i] = objects.vertNormals[i];
+	}
 }
@@ -26,6 +26,9 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include "point.h"
 #include "normal.h"
@@ -33,26 +36,153 @@
 #include "camera.h"
 #include "triangle.h"
 #include "qbvhaccel.h"
+#include "obvhaccel.h"
 #include "ray.h"
 #include "mesh.h"
 #include "light.h"
 
 using namespace std;
 
+// An instance of a mesh read from the scene file, its triangles are
+// indexed after the ones of the instances before it
+class MeshInstance {
+public:
+	MeshInstance(const TriangleMesh *m, const Transform &t, const unsigned int offset) :
+		mesh(m), localToWorld(t), triangleOffset(offset) { }
+
+	const TriangleMesh *mesh;
+	Transform localToWorld;
+	unsigned int triangleOffset;
+};
+
 class Scene {
 public:
-	Scene(const bool lowLatency, const string &fileName, Film *film);
+	Scene(const bool lowLatency, const string &fileName, Film *film,
+		const QBVHAccel::BuilderType accelBuilder = QBVHAccel::BINNED_SAH,
+		const bool accelCompressNodes = false, const bool accelCache = false,
+		const bool accelProgressive = false, const unsigned int accelTreeletPasses = 0,
+		const unsigned int accelLeafSize = 4, const unsigned int accelBins = NB_BINS,
+		const float accelTraversalCost = 0.f, const bool accelAllAxes = true,
+		const bool accelHugePages = false, const bool accelIndexedLeaves = false);
 	~Scene() {
+		SwapAccelerator(true);
+
 		delete camera;
 		delete[] lights;
 		delete mesh;
+		for (size_t i = 0; i < prototypes.size(); ++i)
+			delete prototypes[i];
+		delete obvh;
 		delete qbvh;
 	}
 
-	void Intersect(const Ray &ray, RayHit *hit) const {
+	// Update the accelerators and the lights after the vertices of the
+	// mesh have been moved, return true if the QBVH has been built again
+	bool Refit() {
+		// The final tree must be built from the same vertices
+		SwapAccelerator(true);
+
+		const bool rebuilt = qbvh->Refit();
+
+		// The OBVH is only a collapsed copy of the QBVH
+		if (obvh) {
+			delete obvh;
+			obvh = new OBVHAccel(*qbvh, mesh->triangles, mesh->vertices);
+		}
+
+		for (size_t i = 0; i < nLights; ++i)
+			new (&lights[i]) TriangleLight(i + meshLightOffset, mesh);
+
+		return rebuilt;
+	}
+
+	// Load the new position of the vertices of the objects from a .ply file
+	// with the same triangles, Refit() must be called after
+	void MoveObjects(const string &plyFileName);
+
+	// Replace the preview QBVH of a progressive scene with the final one
+	// once it has been built in background (always wait for it when wait
+	// is true). The devices can be running, see accelMutex. Return true
+	// if the accelerators have changed.
+	bool SwapAccelerator(const bool wait = false);
+
+	// The traversal is counted in *stats when QBVH_TRAVERSAL_STATS is
+	// defined, the OBVH has no counters and isn't used then
+	void Intersect(const Ray &ray, RayHit *hit, QBVHTraversalStats *stats = NULL) const {
+		hit->t = INFINITY;
+		hit->index = 0xffffffffu;
+		if (obvh && !stats)
+			obvh->Intersect(ray, hit);
+		else
+			qbvh->Intersect(ray, hit, stats);
+	}
+
+	// Stops at the first hit found, used for shadow rays
+	void IntersectP(const Ray &ray, RayHit *hit, QBVHTraversalStats *stats = NULL) const {
 		hit->t = INFINITY;
 		hit->index = 0xffffffffu;
-		qbvh->Intersect(ray, hit);
+		if (obvh && !stats)
+			obvh->IntersectP(ray, hit);
+		else
+			qbvh->IntersectP(ray, hit, stats);
+	}
+
+	// Packets of coherent rays (see QBVHAccel::IntersectPacket()), the
+	// two level trees and the compressed nodes trace them one by one
+	void IntersectPacket(const Ray *rays, RayHit *hits, const unsigned int count) const {
+		for (unsigned int i = 0; i < count; ++i) {
+			hits[i].t = INFINITY;
+			hits[i].index = 0xffffffffu;
+		}
+		if (qbvh->instances || qbvh->compressedNodes) {
+			for (unsigned int i = 0; i < count; ++i)
+				qbvh->Intersect(rays[i], &hits[i]);
+		} else
+			qbvh->IntersectPacket(rays, hits, count);
+	}
+
+	void IntersectPPacket(const Ray *rays, RayHit *hits, const unsigned int count) const {
+		for (unsigned int i = 0; i < count; ++i) {
+			hits[i].t = INFINITY;
+			hits[i].index = 0xffffffffu;
+		}
+		if (qbvh->instances || qbvh->compressedNodes) {
+			for (unsigned int i = 0; i < count; ++i)
+				qbvh->IntersectP(rays[i], &hits[i]);
+		} else
+			qbvh->IntersectPPacket(rays, hits, count);
+	}
+
+	// Streams of incoherent rays (see QBVHAccel::IntersectStream()), the
+	// OBVH and the two level trees trace them one by one
+	void IntersectStream(const Ray *rays, RayHit *hits, const unsigned int count) const {
+		for (unsigned int i = 0; i < count; ++i) {
+			hits[i].t = INFINITY;
+			hits[i].index = 0xffffffffu;
+		}
+		if (obvh) {
+			for (unsigned int i = 0; i < count; ++i)
+				obvh->Intersect(rays[i], &hits[i]);
+		} else if (qbvh->instances) {
+			for (unsigned int i = 0; i < count; ++i)
+				qbvh->Intersect(rays[i], &hits[i]);
+		} else
+			qbvh->IntersectStream(rays, hits, count);
+	}
+
+	void IntersectPStream(const Ray *rays, RayHit *hits, const unsigned int count) const {
+		for (unsigned int i = 0; i < count; ++i) {
+			hits[i].t = INFINITY;
+			hits[i].index = 0xffffffffu;
+		}
+		if (obvh) {
+			for (unsigned int i = 0; i < count; ++i)
+				obvh->IntersectP(rays[i], &hits[i]);
+		} else if (qbvh->instances) {
+			for (unsigned int i = 0; i < count; ++i)
+				qbvh->IntersectP(rays[i], &hits[i]);
+		} else
+			qbvh->IntersectPStream(rays, hits, count);
 	}
 
 	unsigned int SampleLights(const float u) const {
@@ -62,8 +192,45 @@ public:
 		return lightIndex;
 	}
 
+	// The instances are never light sources
 	bool IsLight(const unsigned int index) const {
-		return (index >= meshLightOffset);
+		return (index >= meshLightOffset) && (index < mesh->triangleCount);
+	}
+
+	// The color and the shading normal at a hit point, the triangle
+	// can belong to the mesh or to an instance
+	Spectrum InterpolateColor(const unsigned int index, const float b1, const float b2) const {
+		if (index < mesh->triangleCount)
+			return mesh->triangles[index].InterpolateColor(mesh->vertColors, b1, b2);
+
+		const MeshInstance &instance = GetInstance(index);
+		return instance.mesh->triangles[index - instance.triangleOffset].InterpolateColor(
+				instance.mesh->vertColors, b1, b2);
+	}
+
+	Normal InterpolateNormal(const unsigned int index, const float b1, const float b2) const {
+		if (index < mesh->triangleCount)
+			return mesh->triangles[index].InterpolateNormal(mesh->vertNormals, b1, b2);
+
+		const MeshInstance &instance = GetInstance(index);
+		return Normalize(instance.localToWorld(
+				instance.mesh->triangles[index - instance.triangleOffset].InterpolateNormal(
+				instance.mesh->vertNormals, b1, b2)));
+	}
+
+	// The instance of a triangle index past the ones of the mesh
+	const MeshInstance &GetInstance(const unsigned int index) const {
+		size_t first = 0;
+		size_t last = instances.size();
+		while (last - first > 1) {
+			const size_t middle = (first + last) / 2;
+			if (instances[middle].triangleOffset <= index)
+				first = middle;
+			else
+				last = middle;
+		}
+
+		return instances[first];
 	}
 
 	// Siggned because of the delta parameter
@@ -77,7 +244,42 @@ public:
 	TriangleMesh *mesh;
 	TriangleLight *lights;
 
+	// The meshes instanced by the scene file and their instances,
+	// empty if there are none
+	vector<TriangleMesh *> prototypes;
+	vector<MeshInstance> instances;
+
 	QBVHAccel *qbvh;
+	// The 8-wide version of qbvh used by the native devices, NULL if
+	// the CPU doesn't support AVX2 (the OpenCL devices always use qbvh)
+	OBVHAccel *obvh;
+
+	// The native devices hold a shared lock while they trace a RayBuffer,
+	// the accelerators are swapped with an exclusive one. The OpenCL
+	// devices upload the QBVH again when accelVersion changes.
+	boost::shared_mutex accelMutex;
+	unsigned int accelVersion;
+
+private:
+	static void AcceleratorBuildThread(Scene *scene, const QBVHAccel::BuilderType accelBuilder,
+		const bool accelCompressNodes, const string cacheFileName);
+
+	// Build the QBVH of a mesh with the accelerator settings of the scene
+	QBVHAccel *NewQBVH(const TriangleMesh *m, const QBVHAccel::BuilderType accelBuilder,
+		const bool accelCompressNodes, const string &cacheFileName) const;
+
+	// The settings of the QBVH builders (see the accelerator.* keys of
+	// render.cfg)
+	unsigned int accelTreeletPasses, accelLeafSize, accelBins;
+	float accelTraversalCost;
+	bool accelAllAxes, accelHugePages, accelIndexedLeaves;
+
+	// The thread building the final accelerators of a progressive scene,
+	// they are available in pendingQBVH/pendingOBVH when it is done
+	boost::thread *accelBuildThread;
+	boost::mutex pendingAccelMutex;
+	QBVHAccel *pendingQBVH;
+	OBVHAccel *pendingOBVH;
 };
 
 #endif	/* _SCENE_H */
@@ -46,6 +46,8 @@ static int BatchMode(double stopTime) {
 		if (elapsedTime > stopTime)
 			break;
 
+		config->scene->SwapAccelerator();
+
 		double raysSec = 0.0;
 		const vector<IntersectionDevice *> interscetionDevices = config->GetIntersectionDevices();
 		for (size_t i = 0; i < interscetionDevices.size(); ++i)
@@ -57,10 +59,25 @@ static int BatchMode(double stopTime) {
 				int(raysSec / 1000.0), config->scene->mesh->triangleCount / 1000.0);
 		std::cerr << buff << std::endl;
 
+#if defined(QBVH_TRAVERSAL_STATS)
+		// The counters of all the native threads
+		QBVHTraversalStats stats;
+		for (size_t i = 0; i < interscetionDevices.size(); ++i)
+			stats.Add(interscetionDevices[i]->GetTraversalStats());
+		const double invRayCount = (stats.rayCount > 0) ? (1.0 / stats.rayCount) : 0.0;
+		sprintf(buff, "[Traversal by ray: %.1f nodes %.1f boxes %.1f quads][Max. stack depth: %u]",
+				stats.nodesVisited * invRayCount, stats.boxesTested * invRayCount,
+				stats.quadsTested * invRayCount, stats.maxStackDepth);
+		std::cerr << buff << std::endl;
+#endif
 	}
 
 	std::cerr << "Saving image.ppm" << std::endl;
 	config->scene->camera->film->SavePPM("image.ppm");
+#if defined(QBVH_TRAVERSAL_STATS)
+	std::cerr << "Saving image_cost.ppm" << std::endl;
+	config->scene->camera->film->SaveCostPPM("image_cost.ppm");
+#endif
 
 	sprintf(buff, "LuxMark index: %.3f", sampleSec / 1000000.0);
 	std::cerr << buff << std::endl;
@@ -71,6 +88,45 @@ static int BatchMode(double stopTime) {
 	return EXIT_SUCCESS;
 }
 
+// Render frameCount frames, stopTime secs each, moving the objects of the
+// scene to the vertices of each frame .ply file
+static int AnimationBatchMode(double stopTime, const unsigned int frameCount,
+		const string &plyFileNamePattern) {
+	char buff[512];
+	for (unsigned int frame = 0; frame < frameCount; ++frame) {
+		sprintf(buff, plyFileNamePattern.c_str(), frame);
+		config->RefitScene(buff);
+
+		const double startTime = WallClockTime();
+		for (;;) {
+			boost::this_thread::sleep(boost::posix_time::millisec(1000));
+			double elapsedTime = WallClockTime() - startTime;
+			if (elapsedTime > stopTime)
+				break;
+
+			double raysSec = 0.0;
+			const vector<IntersectionDevice *> interscetionDevices = config->GetIntersectionDevices();
+			for (size_t i = 0; i < interscetionDevices.size(); ++i)
+				raysSec += interscetionDevices[i]->GetPerformance();
+
+			const double sampleSec = config->scene->camera->film->GetAvgSampleSec();
+			sprintf(buff, "[Frame %d/%d][Elapsed time: %3d/%dsec][Avg. samples/sec % 4dK][Avg. rays/sec % 4dK on %.1fK tris]",
+					frame + 1, frameCount, int(elapsedTime), int(stopTime), int(sampleSec/ 1000.0),
+					int(raysSec / 1000.0), config->scene->mesh->triangleCount / 1000.0);
+			std::cerr << buff << std::endl;
+		}
+
+		sprintf(buff, "image_%03d.ppm", frame);
+		std::cerr << "Saving " << buff << std::endl;
+		config->scene->camera->film->SavePPM(buff);
+	}
+
+	delete config;
+	std::cerr << "Done." << std::endl;
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
 	try {
 		std::cerr << "Usage (easy mode): " << argv[0] << std::endl;
@@ -102,7 +158,13 @@ int main(int argc, char *argv[]) {
 			const unsigned int halttime = atoi(config->cfg.find("batch.halttime")->second.c_str());
 			if (halttime > 0) {
 				config->Init();
-				return BatchMode(halttime);
+
+				const unsigned int frameCount = atoi(config->cfg.find("batch.animation.frames")->second.c_str());
+				if (frameCount > 0)
+					return AnimationBatchMode(halttime, frameCount,
+							config->cfg.find("batch.animation.plyfile")->second);
+				else
+					return BatchMode(halttime);
 			}
 		} else  if (argc == 1) {
 			width = 640;